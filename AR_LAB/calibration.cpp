@@ -1,4 +1,6 @@
 #include <iostream>
+#include <string>
+#include <cstdlib>
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
@@ -8,8 +10,16 @@
 using namespace cv;
 using namespace std;
 
+// A camera index, or a video file / image sequence pattern to calibrate from
+static VideoCapture openCapture(const string& source)
+{
+	if (!source.empty() && source.find_first_not_of("0123456789") == string::npos)
+		return VideoCapture(atoi(source.c_str()));
+	return VideoCapture(source);
+}
 
-int main()
+// calibration [source], camera 1 by default
+int main(int argc, char** argv)
 {
 	int numBoards = 1;
 	int numCornersHor = 9;
@@ -28,13 +38,21 @@ int main()
 
 	int numSquares = numCornersHor * numCornersVer;
 	Size board_sz = Size(numCornersHor, numCornersVer);
-	VideoCapture capture = VideoCapture(1);
+	VideoCapture capture = openCapture(argc > 1 ? argv[1] : "1");
+	if (!capture.isOpened())
+	{
+		cout << "ERROR::CALIBRATION::SOURCE_NOT_OPENED " << (argc > 1 ? argv[1] : "1") << endl;
+		return -1;
+	}
 
 	vector<vector<Point3f>> object_points;
 	vector<vector<Point2f>> image_points;
 
 	vector<Point2f> corners;
 	int successes = 0;
+	// Of the frames the stored corners were found in; the next frame read
+	// may already be past the end of a recording
+	Size imageSize;
 
 	Mat image;
 	Mat gray_image;
@@ -46,6 +64,12 @@ int main()
 
 	while (successes<numBoards)
 	{
+		if (image.empty())
+		{
+			cout << "ERROR::CALIBRATION::SOURCE_ENDED " << successes << " of " << numBoards << " boards" << endl;
+			return -1;
+		}
+
 		cvtColor(image, gray_image, CV_BGR2GRAY);
 
 		bool found = findChessboardCorners(image, board_sz, corners, CV_CALIB_CB_ADAPTIVE_THRESH | CV_CALIB_CB_FILTER_QUADS);
@@ -59,6 +83,7 @@ int main()
 		imshow("win1", image);
 		imshow("win2", gray_image);
 
+		Size frameSize = image.size();
 		capture >> image;
 
 		int key = waitKey(1);
@@ -70,6 +95,7 @@ int main()
 		{
 			image_points.push_back(corners);
 			object_points.push_back(obj);
+			imageSize = frameSize;
 			printf("Snap stored!\n");
 
 			successes++;
@@ -87,7 +113,7 @@ int main()
 	intrinsic.ptr<float>(0)[0] = 1;
 	intrinsic.ptr<float>(1)[1] = 1;
 
-		calibrateCamera(object_points, image_points, image.size(), intrinsic, distCoeffs, rvecs, tvecs);
+		calibrateCamera(object_points, image_points, imageSize, intrinsic, distCoeffs, rvecs, tvecs);
 
 		cout << intrinsic << endl;
 		cout << distCoeffs << endl;
@@ -103,13 +129,28 @@ int main()
 	fs << "DistortionCoefficients";
 	fs << distCoeffs;
 
+	// Lets the renderer scale the intrinsics to another capture resolution
+	fs << "ImageSize";
+	fs << imageSize;
+
 	fs.release();
 
+	// undistort() would rebuild its maps every frame; they only depend on the
+	// calibration and the frame size. Fixed point maps remap fastest.
 	Mat imageUndistorted;
+	Mat map1, map2;
+	Size mapSize;
 	while (1)
 	{
 		capture >> image;
-		undistort(image, imageUndistorted, intrinsic, distCoeffs);
+		if (image.empty())
+			break;
+		if (image.size() != mapSize)
+		{
+			mapSize = image.size();
+			initUndistortRectifyMap(intrinsic, distCoeffs, Mat(), intrinsic, mapSize, CV_16SC2, map1, map2);
+		}
+		remap(image, imageUndistorted, map1, map2, INTER_LINEAR);
 
 		imshow("win1", image);
 		imshow("win2", imageUndistorted);
@@ -0,0 +1,74 @@
+#include "AllocationCounter.h"
+
+#ifdef AR_COUNT_ALLOCATIONS
+
+#include <cstdlib>
+#include <new>
+
+static thread_local unsigned long long allocations = 0;
+static thread_local int pauseDepth = 0;
+
+static void* countedAlloc(size_t size)
+{
+	if (pauseDepth == 0)
+		allocations++;
+
+	void* p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void* operator new(size_t size)
+{
+	return countedAlloc(size);
+}
+
+void* operator new[](size_t size)
+{
+	return countedAlloc(size);
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+	free(p);
+}
+
+unsigned long long AllocationCount()
+{
+	return allocations;
+}
+
+AllocationPause::AllocationPause()
+{
+	pauseDepth++;
+}
+
+AllocationPause::~AllocationPause()
+{
+	pauseDepth--;
+}
+
+#else
+
+unsigned long long AllocationCount()
+{
+	return 0;
+}
+
+AllocationPause::AllocationPause()
+{
+
+}
+
+AllocationPause::~AllocationPause()
+{
+
+}
+
+#endif
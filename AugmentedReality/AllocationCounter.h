@@ -0,0 +1,24 @@
+#pragma once
+
+// Test hook for the allocation-free detection loop.
+//
+// Builds with AR_COUNT_ALLOCATIONS defined replace the global operator new and
+// count every allocation made by the calling thread, except inside an
+// AllocationPause scope. Library calls we do not own (OpenCV) are wrapped in
+// pauses, so in steady state the count of a detection frame must stay at 0.
+// Without the define nothing is replaced and AllocationCount() is always 0.
+// The Benchmark project is built with it; "Benchmark allocations" fails on
+// any allocation after warm-up.
+
+unsigned long long AllocationCount();
+
+class AllocationPause
+{
+public:
+	AllocationPause();
+	~AllocationPause();
+
+private:
+	AllocationPause(const AllocationPause&);
+	AllocationPause& operator=(const AllocationPause&);
+};
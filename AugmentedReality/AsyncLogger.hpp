@@ -0,0 +1,327 @@
+#pragma once
+
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <initializer_list>
+
+using namespace std;
+
+enum LogLevel
+{
+	LOG_DEBUG,
+	LOG_INFO,
+	LOG_WARNING,
+	LOG_ERROR
+};
+
+// One pose of the replayable trace file. The file is the 8 byte magic
+// "ARPOSE01" followed by these records, in detection order.
+struct PoseTraceRecord
+{
+	unsigned long long sequence;
+	double timestamp;
+	double rvec[3];
+	double tvec[3];
+};
+
+// Lets through at most one record per interval from one call site, keep it
+// static next to the log call.
+class LogRateLimit
+{
+public:
+	explicit LogRateLimit(double seconds)
+		: interval(chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(seconds)).count()), next(0)
+	{
+
+	}
+
+	bool Allow()
+	{
+		long long now = chrono::steady_clock::now().time_since_epoch().count();
+		long long due = this->next.load(memory_order_relaxed);
+		if (now < due)
+			return false;
+		return this->next.compare_exchange_strong(due, now + this->interval, memory_order_relaxed);
+	}
+
+private:
+	long long interval;
+	atomic<long long> next;
+};
+
+// Structured logging off the hot path. Stages write fixed size binary records
+// into a lock-free bounded queue (multiple producers, one consumer) and a
+// background thread formats and prints them, so a slow terminal never stalls
+// detection or rendering. Writing never allocates or blocks: when the queue is
+// full the record is dropped and counted.
+//
+// Record text must be a string literal or otherwise outlive the record; only
+// the pointer is queued, numbers go in as values.
+class AsyncLogger
+{
+public:
+	static const int MAX_VALUES = 8;
+
+	static AsyncLogger& Instance()
+	{
+		static AsyncLogger logger;
+		return logger;
+	}
+
+	void SetLevel(LogLevel level)
+	{
+		this->level = level;
+	}
+
+	bool Enabled(LogLevel level) const
+	{
+		return level >= this->level;
+	}
+
+	void Write(LogLevel level, const char* tag, const char* text, const double* values, int count)
+	{
+		if (!this->Enabled(level))
+			return;
+
+		Record record;
+		record.kind = TEXT;
+		record.level = level;
+		record.time = this->now();
+		record.tag = tag;
+		record.text = text;
+		record.count = count < MAX_VALUES ? count : MAX_VALUES;
+		for (int i = 0; i < record.count; i++)
+			record.values[i] = values[i];
+		this->push(record);
+	}
+
+	void Write(LogLevel level, const char* tag, const char* text, initializer_list<double> values = {})
+	{
+		this->Write(level, tag, text, values.begin(), (int)values.size());
+	}
+
+	// Pose of one frame: written to the trace file when one is open, and
+	// printed at debug level
+	void Pose(unsigned long long sequence, double timestamp, const double* rvec, const double* tvec)
+	{
+		if (!this->tracing && !this->Enabled(LOG_DEBUG))
+			return;
+
+		Record record;
+		record.kind = POSE;
+		record.level = LOG_DEBUG;
+		record.time = this->now();
+		record.tag = "POSE";
+		record.text = "r t";
+		record.count = 6;
+		record.sequence = sequence;
+		record.timestamp = timestamp;
+		for (int i = 0; i < 3; i++)
+		{
+			record.values[i] = rvec[i];
+			record.values[3 + i] = tvec[i];
+		}
+		this->push(record);
+	}
+
+	// Starts writing poses to path. Call before the stages start.
+	bool OpenTrace(const char* path)
+	{
+		this->trace = fopen(path, "wb");
+		if (!this->trace)
+		{
+			cout << "ERROR::LOG::TRACE_NOT_OPENED " << path << endl;
+			return false;
+		}
+		fwrite("ARPOSE01", 1, 8, this->trace);
+		this->tracing = true;
+		return true;
+	}
+
+	static bool ReadTrace(const char* path, vector<PoseTraceRecord>& records)
+	{
+		records.clear();
+		FILE* file = fopen(path, "rb");
+		if (!file)
+			return false;
+
+		char magic[8];
+		bool valid = fread(magic, 1, 8, file) == 8 && memcmp(magic, "ARPOSE01", 8) == 0;
+		PoseTraceRecord record;
+		while (valid && fread(&record, sizeof(record), 1, file) == 1)
+			records.push_back(record);
+
+		fclose(file);
+		return valid;
+	}
+
+	~AsyncLogger()
+	{
+		this->running = false;
+		this->drainThread.join();
+		if (this->trace)
+			fclose(this->trace);
+	}
+
+private:
+	static const size_t CAPACITY = 4096;
+
+	enum Kind
+	{
+		TEXT,
+		POSE
+	};
+
+	struct Record
+	{
+		Kind kind;
+		LogLevel level;
+		double time;
+		const char* tag;
+		const char* text;
+		int count;
+		double values[MAX_VALUES];
+		unsigned long long sequence;
+		double timestamp;
+	};
+
+	struct Cell
+	{
+		atomic<size_t> sequence;
+		Record record;
+	};
+
+	unique_ptr<Cell[]> cells;
+	atomic<size_t> enqueuePosition;
+	size_t dequeuePosition;
+
+	atomic<int> level;
+	atomic<unsigned long long> dropped;
+	atomic<bool> running;
+	thread drainThread;
+
+	FILE* trace;
+	atomic<bool> tracing;
+
+	chrono::steady_clock::time_point start;
+
+	AsyncLogger()
+		: cells(new Cell[CAPACITY]), enqueuePosition(0), dequeuePosition(0),
+		level(LOG_INFO), dropped(0), running(true), trace(nullptr), tracing(false),
+		start(chrono::steady_clock::now())
+	{
+		for (size_t i = 0; i < CAPACITY; i++)
+			this->cells[i].sequence.store(i, memory_order_relaxed);
+		this->drainThread = thread(&AsyncLogger::drain, this);
+	}
+
+	AsyncLogger(const AsyncLogger&);
+	AsyncLogger& operator=(const AsyncLogger&);
+
+	double now() const
+	{
+		return chrono::duration<double>(chrono::steady_clock::now() - this->start).count();
+	}
+
+	// Bounded MPMC ring after Vyukov, used with a single consumer: each cell's
+	// sequence tells producers whether it is free for their ticket.
+	void push(const Record& record)
+	{
+		size_t position = this->enqueuePosition.load(memory_order_relaxed);
+		Cell* cell;
+		while (true)
+		{
+			cell = &this->cells[position % CAPACITY];
+			size_t sequence = cell->sequence.load(memory_order_acquire);
+			ptrdiff_t difference = (ptrdiff_t)sequence - (ptrdiff_t)position;
+			if (difference == 0)
+			{
+				if (this->enqueuePosition.compare_exchange_weak(position, position + 1, memory_order_relaxed))
+					break;
+			}
+			else if (difference < 0)
+			{
+				this->dropped++;
+				return;
+			}
+			else
+				position = this->enqueuePosition.load(memory_order_relaxed);
+		}
+
+		cell->record = record;
+		cell->sequence.store(position + 1, memory_order_release);
+	}
+
+	bool pop(Record& record)
+	{
+		Cell* cell = &this->cells[this->dequeuePosition % CAPACITY];
+		if (cell->sequence.load(memory_order_acquire) != this->dequeuePosition + 1)
+			return false;
+
+		record = cell->record;
+		cell->sequence.store(this->dequeuePosition + CAPACITY, memory_order_release);
+		this->dequeuePosition++;
+		return true;
+	}
+
+	void print(const Record& record)
+	{
+		static const char* levelNames[] = { "DEBUG", "INFO", "WARNING", "ERROR" };
+
+		cout << levelNames[record.level] << "::" << record.tag << "::" << record.text;
+		for (int i = 0; i < record.count; i++)
+			cout << " " << record.values[i];
+		cout << '\n';
+	}
+
+	void drain()
+	{
+		Record record;
+		unsigned long long reported = 0;
+		while (true)
+		{
+			bool stopping = !this->running;
+			int written = 0;
+			while (this->pop(record))
+			{
+				if (record.kind == POSE && this->tracing)
+				{
+					PoseTraceRecord pose;
+					pose.sequence = record.sequence;
+					pose.timestamp = record.timestamp;
+					for (int i = 0; i < 3; i++)
+					{
+						pose.rvec[i] = record.values[i];
+						pose.tvec[i] = record.values[3 + i];
+					}
+					fwrite(&pose, sizeof(pose), 1, this->trace);
+				}
+				if (this->Enabled(record.level))
+				{
+					this->print(record);
+					written++;
+				}
+			}
+
+			unsigned long long total = this->dropped;
+			if (total != reported)
+			{
+				cout << "WARNING::LOG::" << total - reported << " records dropped" << '\n';
+				reported = total;
+				written++;
+			}
+
+			if (written > 0)
+				cout.flush();
+			if (stopping)
+				return;
+			this_thread::sleep_for(chrono::milliseconds(2));
+		}
+	}
+};
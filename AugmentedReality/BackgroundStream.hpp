@@ -0,0 +1,149 @@
+#pragma once
+
+#include <iostream>
+
+#include <GL/glew.h>
+
+#include "AsyncLogger.hpp"
+
+using namespace std;
+
+// Streams camera frames into the background texture.
+//
+// The texture storage is allocated once for the capture resolution and only
+// ever updated with glTexSubImage2D. When ARB_buffer_storage is available every
+// frame buffer of the pipeline lives in its own persistently mapped pixel
+// buffer object, so the capture stage decodes straight into GL memory and the
+// upload is a GPU-side copy. Pixels stay in OpenCV's BGR, top-down layout; the
+// swizzle and the vertical flip are done by bg_v.glsl / bg_f.glsl.
+class BackgroundStream
+{
+public:
+	static const int SLOTS = 6;
+
+	GLuint Texture;
+
+	BackgroundStream()
+		: Texture(0), width(0), height(0), persistent(false)
+	{
+		for (int i = 0; i < SLOTS; i++)
+		{
+			this->pbo[i] = 0;
+			this->mapped[i] = 0;
+			this->fence[i] = 0;
+		}
+	}
+
+	void Init(int width, int height)
+	{
+		this->width = width;
+		this->height = height;
+
+		glGenTextures(1, &this->Texture);
+		glBindTexture(GL_TEXTURE_2D, this->Texture);
+		if (GLEW_ARB_texture_storage)
+			glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGB8, width, height);
+		else
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, 0);
+
+		float borderColor[] = { 1.0f, 1.0f, 0.0f, 1.0f };
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+		glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, borderColor);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		this->persistent = GLEW_ARB_buffer_storage != 0;
+		if (!this->persistent)
+		{
+			cout << "WARNING::BACKGROUND::ARB_buffer_storage not available, uploading from client memory" << endl;
+			return;
+		}
+
+		// The detection stage reads these buffers as well, so ask for client
+		// side (cached) storage rather than write-combined memory.
+		GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		GLsizeiptr size = this->FrameSize();
+
+		glGenBuffers(SLOTS, this->pbo);
+		for (int i = 0; i < SLOTS; i++)
+		{
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->pbo[i]);
+			glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, 0, flags | GL_CLIENT_STORAGE_BIT);
+			this->mapped[i] = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags);
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	}
+
+	bool Persistent() const
+	{
+		return this->persistent;
+	}
+
+	GLsizeiptr FrameSize() const
+	{
+		return (GLsizeiptr)this->width * this->height * 3;
+	}
+
+	// Mapped memory of a slot, or null when frames live in client memory.
+	unsigned char* SlotData(int slot) const
+	{
+		return this->mapped[slot];
+	}
+
+	// Copies a frame into the texture. A frame that was captured into its slot
+	// is uploaded from the PBO without touching the CPU; anything else (no
+	// buffer storage, or the capture reallocated the image) goes the classic way.
+	void Upload(int slot, const unsigned char* data, int width, int height)
+	{
+		if (width != this->width || height != this->height)
+		{
+			static LogRateLimit limit(1.0);
+			if (limit.Allow())
+				AsyncLogger::Instance().Write(LOG_ERROR, "BACKGROUND", "FRAME_SIZE_CHANGED", { (double)width, (double)height });
+			return;
+		}
+
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glBindTexture(GL_TEXTURE_2D, this->Texture);
+
+		if (this->persistent && data == this->mapped[slot])
+		{
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->pbo[slot]);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, 0);
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+			if (this->fence[slot])
+				glDeleteSync(this->fence[slot]);
+			this->fence[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		}
+		else
+		{
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, data);
+		}
+
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+
+	// Blocks until the GPU has finished reading a slot. Must be called on the
+	// GL thread before the slot is handed back to the capture stage.
+	void Release(int slot)
+	{
+		if (!this->fence[slot])
+			return;
+
+		glClientWaitSync(this->fence[slot], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+		glDeleteSync(this->fence[slot]);
+		this->fence[slot] = 0;
+	}
+
+private:
+	int width;
+	int height;
+	bool persistent;
+
+	GLuint pbo[SLOTS];
+	unsigned char* mapped[SLOTS];
+	GLsync fence[SLOTS];
+};
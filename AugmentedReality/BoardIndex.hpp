@@ -0,0 +1,65 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/aruco.hpp>
+
+using namespace std;
+
+// Marker id -> board lookup, built once per board.
+//
+// slot[id] is the position of the marker in the board (or -1), and the object
+// points of all markers are stored contiguously, four per marker, so matching
+// detections against the board costs one table lookup per detected marker.
+class BoardIndex
+{
+public:
+	BoardIndex()
+	{
+
+	}
+
+	BoardIndex(const cv::Ptr<cv::aruco::Board>& board)
+	{
+		CV_Assert(board->ids.size() == board->objPoints.size());
+
+		int maxId = 0;
+		for (size_t j = 0; j < board->ids.size(); j++)
+			maxId = max(maxId, board->ids[j]);
+		if (!board->dictionary.empty())
+			maxId = max(maxId, board->dictionary->bytesList.rows - 1);
+
+		this->slot.assign(maxId + 1, -1);
+		this->objPoints.reserve(board->ids.size() * 4);
+		for (size_t j = 0; j < board->ids.size(); j++)
+		{
+			this->slot[board->ids[j]] = (int)j;
+			for (int p = 0; p < 4; p++)
+				this->objPoints.push_back(board->objPoints[j][p]);
+		}
+	}
+
+	// Position of the marker in the board, -1 when the id is not on it
+	int Find(int id) const
+	{
+		if (id < 0 || id >= (int)this->slot.size())
+			return -1;
+		return this->slot[id];
+	}
+
+	const cv::Point3f* ObjPoints(int index) const
+	{
+		return &this->objPoints[index * 4];
+	}
+
+	size_t Markers() const
+	{
+		return this->objPoints.size() / 4;
+	}
+
+private:
+	vector<int> slot;
+	vector<cv::Point3f> objPoints;
+};
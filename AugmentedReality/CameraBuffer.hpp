@@ -0,0 +1,43 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include "Shader.h"
+
+// Projection and view matrices of the frame, in one uniform buffer that every
+// program declaring
+//
+//   layout(std140) uniform Camera { mat4 projection; mat4 view; };
+//
+// reads from. Updated once a frame instead of set on each program.
+class CameraBuffer
+{
+public:
+	CameraBuffer()
+		: buffer(0)
+	{
+
+	}
+
+	void Init()
+	{
+		glGenBuffers(1, &this->buffer);
+		glBindBuffer(GL_UNIFORM_BUFFER, this->buffer);
+		glBufferData(GL_UNIFORM_BUFFER, 2 * sizeof(glm::mat4), nullptr, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		glBindBufferBase(GL_UNIFORM_BUFFER, Shader::CameraBlockBinding, this->buffer);
+	}
+
+	void Update(const glm::mat4& projection, const glm::mat4& view)
+	{
+		glBindBuffer(GL_UNIFORM_BUFFER, this->buffer);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(glm::mat4), glm::value_ptr(projection));
+		glBufferSubData(GL_UNIFORM_BUFFER, sizeof(glm::mat4), sizeof(glm::mat4), glm::value_ptr(view));
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	}
+
+private:
+	GLuint buffer;
+};
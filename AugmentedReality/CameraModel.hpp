@@ -0,0 +1,226 @@
+#pragma once
+
+#include <string>
+#include <iostream>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/calib3d/calib3d.hpp>
+
+#include <glm/glm.hpp>
+
+using namespace std;
+
+// The calibrated camera as the renderer needs it: an OpenGL projection that
+// puts a point on the pixel the camera sees it at, and the maps that undistort
+// the camera's images. Both are derived once per capture resolution and
+// calibration and kept until either changes.
+class CameraModel
+{
+public:
+	CameraModel()
+		: distorted(false), width(0), height(0), nearPlane(1.0f), farPlane(10000.0f), version(0)
+	{
+
+	}
+
+	// Intrinsic and DistortionCoefficients as calibration writes them, and
+	// ImageSize, the resolution they were calibrated at, when present
+	bool Load(const string& path)
+	{
+		cv::FileStorage fs(path, cv::FileStorage::READ);
+		if (!fs.isOpened())
+		{
+			cout << "ERROR::CAMERA_MODEL::FILE_NOT_OPENED " << path << endl;
+			return false;
+		}
+
+		cv::Mat cameraMatrix, distCoeffs;
+		cv::Size size;
+		fs["Intrinsic"] >> cameraMatrix;
+		fs["DistortionCoefficients"] >> distCoeffs;
+		if (!fs["ImageSize"].empty())
+			fs["ImageSize"] >> size;
+		if (cameraMatrix.rows != 3 || cameraMatrix.cols != 3)
+		{
+			cout << "ERROR::CAMERA_MODEL::NO_INTRINSICS " << path << endl;
+			return false;
+		}
+		this->Set(cameraMatrix, distCoeffs, size);
+		return true;
+	}
+
+	// calibrationSize is the resolution the matrix belongs to; empty when it
+	// is the capture resolution
+	void Set(const cv::Mat& cameraMatrix, const cv::Mat& distCoeffs, cv::Size calibrationSize = cv::Size())
+	{
+		cameraMatrix.convertTo(this->calibrationMatrix, CV_64F);
+		if (distCoeffs.empty())
+			this->distCoeffs = cv::Mat::zeros(1, 5, CV_64F);
+		else
+			distCoeffs.convertTo(this->distCoeffs, CV_64F);
+		this->distorted = cv::countNonZero(this->distCoeffs) > 0;
+		this->calibrationSize = calibrationSize;
+		this->update();
+	}
+
+	// Capture resolution, rebuilding only if it changed
+	void Resize(int width, int height)
+	{
+		if (width == this->width && height == this->height)
+			return;
+		this->width = width;
+		this->height = height;
+		this->update();
+	}
+
+	void SetClipRange(float nearPlane, float farPlane)
+	{
+		if (nearPlane == this->nearPlane && farPlane == this->farPlane)
+			return;
+		this->nearPlane = nearPlane;
+		this->farPlane = farPlane;
+		this->updateProjection();
+	}
+
+	// Camera matrix at the capture resolution, for pose estimation on the
+	// distorted images
+	const cv::Mat& CameraMatrix() const
+	{
+		return this->cameraMatrix;
+	}
+
+	const cv::Mat& DistCoeffs() const
+	{
+		return this->distCoeffs;
+	}
+
+	// False for an ideal pinhole camera, whose images need no undistortion
+	bool Distorted() const
+	{
+		return this->distorted;
+	}
+
+	// Camera matrix of the undistorted images
+	const cv::Mat& RectifiedMatrix() const
+	{
+		return this->rectifiedMatrix;
+	}
+
+	// Where each pixel of the undistorted image samples the captured one,
+	// CV_32FC1 x and y in pixels
+	const cv::Mat& MapX() const
+	{
+		return this->mapX;
+	}
+
+	const cv::Mat& MapY() const
+	{
+		return this->mapY;
+	}
+
+	// Projection of the distorted camera image, and of the undistorted one;
+	// the first ignores distortion and is only exact near the centre
+	const glm::mat4& Projection() const
+	{
+		return this->projection;
+	}
+
+	const glm::mat4& RectifiedProjection() const
+	{
+		return this->rectifiedProjection;
+	}
+
+	// Changes whenever the matrices or maps are rebuilt
+	unsigned int Version() const
+	{
+		return this->version;
+	}
+
+	// Model matrix of a pose from solvePnP or the aruco estimators. OpenCV's
+	// camera looks down +z with y down; OpenGL's looks down -z with y up.
+	static glm::mat4 PoseMatrix(const cv::Vec3d& rvec, const cv::Vec3d& tvec)
+	{
+		cv::Matx33d rotation;
+		cv::Rodrigues(rvec, rotation);
+		glm::mat4 model;
+		for (int row = 0; row < 3; row++)
+		{
+			float sign = row == 0 ? 1.0f : -1.0f;
+			for (int column = 0; column < 3; column++)
+				model[column][row] = sign * (float)rotation(row, column);
+			model[3][row] = sign * (float)tvec[row];
+		}
+		return model;
+	}
+
+private:
+	cv::Mat calibrationMatrix;
+	cv::Size calibrationSize;
+	cv::Mat cameraMatrix;
+	cv::Mat distCoeffs;
+	bool distorted;
+	cv::Mat rectifiedMatrix;
+	cv::Mat mapX, mapY;
+	int width, height;
+	float nearPlane, farPlane;
+	glm::mat4 projection;
+	glm::mat4 rectifiedProjection;
+	unsigned int version;
+
+	void update()
+	{
+		if (this->calibrationMatrix.empty() || this->width <= 0 || this->height <= 0)
+			return;
+
+		// Calibrated at another resolution of the same sensor: focal lengths
+		// and principal point scale with the image
+		this->cameraMatrix = this->calibrationMatrix.clone();
+		if (this->calibrationSize.area() > 0 &&
+			(this->calibrationSize.width != this->width || this->calibrationSize.height != this->height))
+		{
+			double sx = (double)this->width / this->calibrationSize.width;
+			double sy = (double)this->height / this->calibrationSize.height;
+			this->cameraMatrix.at<double>(0, 0) *= sx;
+			this->cameraMatrix.at<double>(0, 2) *= sx;
+			this->cameraMatrix.at<double>(1, 1) *= sy;
+			this->cameraMatrix.at<double>(1, 2) *= sy;
+		}
+
+		// Undistorted images keep every valid pixel and the capture size
+		cv::Size size(this->width, this->height);
+		this->rectifiedMatrix = cv::getOptimalNewCameraMatrix(this->cameraMatrix, this->distCoeffs, size, 0.0, size);
+		cv::initUndistortRectifyMap(this->cameraMatrix, this->distCoeffs, cv::Mat(), this->rectifiedMatrix,
+			size, CV_32FC1, this->mapX, this->mapY);
+
+		this->updateProjection();
+	}
+
+	void updateProjection()
+	{
+		if (this->cameraMatrix.empty())
+			return;
+		this->projection = this->intrinsicProjection(this->cameraMatrix);
+		this->rectifiedProjection = this->intrinsicProjection(this->rectifiedMatrix);
+		this->version++;
+	}
+
+	// Clip space of a pinhole camera with the image's top row at the top of
+	// the viewport, as the background is drawn
+	glm::mat4 intrinsicProjection(const cv::Mat& matrix) const
+	{
+		double fx = matrix.at<double>(0, 0), fy = matrix.at<double>(1, 1);
+		double cx = matrix.at<double>(0, 2), cy = matrix.at<double>(1, 2);
+		float n = this->nearPlane, f = this->farPlane;
+
+		glm::mat4 result(0.0f);
+		result[0][0] = (float)(2.0 * fx / this->width);
+		result[1][1] = (float)(2.0 * fy / this->height);
+		result[2][0] = (float)(1.0 - 2.0 * cx / this->width);
+		result[2][1] = (float)(2.0 * cy / this->height - 1.0);
+		result[2][2] = -(f + n) / (f - n);
+		result[2][3] = -1.0f;
+		result[3][2] = -2.0f * f * n / (f - n);
+		return result;
+	}
+};
@@ -0,0 +1,506 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+#include <sstream>
+#include <algorithm>
+
+#include <GL/glew.h>
+
+#include "FileStamp.hpp"
+
+using namespace std;
+
+// A block-compressed texture with its whole mip chain: BC1 (DXT1) for opaque
+// images, BC3 (DXT5) when any texel has alpha. 4 or 8 bits per texel instead of
+// the 32 an RGB texture takes in the driver, and nothing left to generate at
+// load time.
+struct CompressedTexture
+{
+	GLenum format;
+	int width;
+	int height;
+	vector<unsigned char> data;
+	vector<size_t> offsets;
+	vector<size_t> sizes;
+
+	int Levels() const
+	{
+		return (int)this->offsets.size();
+	}
+
+	int LevelWidth(int level) const
+	{
+		return max(1, this->width >> level);
+	}
+
+	int LevelHeight(int level) const
+	{
+		return max(1, this->height >> level);
+	}
+
+	// Bytes of one level of the given size
+	static size_t LevelSize(GLenum format, int width, int height)
+	{
+		size_t blockBytes = format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT ? 8 : 16;
+		return (size_t)((width + 3) / 4) * ((height + 3) / 4) * blockBytes;
+	}
+};
+
+// True when the current context can sample S3TC textures. Looked up with
+// glGetStringi, which core profiles require.
+inline bool s3tcSupported()
+{
+	GLint count = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+	for (GLint i = 0; i < count; i++)
+	{
+		const char* name = (const char*)glGetStringi(GL_EXTENSIONS, i);
+		if (name && strcmp(name, "GL_EXT_texture_compression_s3tc") == 0)
+			return true;
+	}
+	return false;
+}
+
+inline uint16_t packColor565(const int color[3])
+{
+	return (uint16_t)(((color[0] * 31 + 127) / 255) << 11 | ((color[1] * 63 + 127) / 255) << 5 | ((color[2] * 31 + 127) / 255));
+}
+
+inline void unpackColor565(uint16_t packed, int color[3])
+{
+	int r = packed >> 11, g = (packed >> 5) & 63, b = packed & 31;
+	color[0] = (r << 3) | (r >> 2);
+	color[1] = (g << 2) | (g >> 4);
+	color[2] = (b << 3) | (b >> 2);
+}
+
+// Palette indices for two endpoints in four colour mode, packed two bits per
+// texel. Returns the squared error.
+inline int fitColorIndices(const unsigned char texels[16][4], uint16_t color0, uint16_t color1, uint32_t& indices)
+{
+	int palette[4][3];
+	unpackColor565(color0, palette[0]);
+	unpackColor565(color1, palette[1]);
+	for (int c = 0; c < 3; c++)
+	{
+		palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+		palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+	}
+
+	int error = 0;
+	indices = 0;
+	for (int i = 0; i < 16; i++)
+	{
+		int best = 0, bestDistance = 0x7fffffff;
+		for (int p = 0; p < 4; p++)
+		{
+			int dr = texels[i][0] - palette[p][0], dg = texels[i][1] - palette[p][1], db = texels[i][2] - palette[p][2];
+			int distance = dr * dr + dg * dg + db * db;
+			if (distance < bestDistance)
+			{
+				bestDistance = distance;
+				best = p;
+			}
+		}
+		indices |= (uint32_t)best << (2 * i);
+		error += bestDistance;
+	}
+	return error;
+}
+
+// Colour half of a BC1/BC3 block, 8 bytes, always in four colour mode.
+// Endpoints start at the extremes of the texels along their principal axis,
+// then one least squares pass moves them to fit the chosen indices.
+inline void encodeColorBlock(const unsigned char texels[16][4], unsigned char* out)
+{
+	float mean[3] = { 0, 0, 0 };
+	for (int i = 0; i < 16; i++)
+	{
+		for (int c = 0; c < 3; c++)
+			mean[c] += texels[i][c];
+	}
+	for (int c = 0; c < 3; c++)
+		mean[c] /= 16;
+
+	float covariance[6] = { 0, 0, 0, 0, 0, 0 };
+	for (int i = 0; i < 16; i++)
+	{
+		float r = texels[i][0] - mean[0], g = texels[i][1] - mean[1], b = texels[i][2] - mean[2];
+		covariance[0] += r * r;
+		covariance[1] += r * g;
+		covariance[2] += r * b;
+		covariance[3] += g * g;
+		covariance[4] += g * b;
+		covariance[5] += b * b;
+	}
+
+	// A few power iterations are plenty for a 3x3 matrix. They start from the
+	// covariance row of the channel that varies most: a fixed start such as
+	// grey is orthogonal to, say, a red/green block's axis and would collapse
+	// to zero. A non-zero row never does, the matrix being symmetric.
+	static const int rows[3][3] = { { 0, 1, 2 }, { 1, 3, 4 }, { 2, 4, 5 } };
+	int seed = 0;
+	for (int c = 1; c < 3; c++)
+	{
+		if (covariance[rows[c][c]] > covariance[rows[seed][seed]])
+			seed = c;
+	}
+	float axis[3] = { covariance[rows[seed][0]], covariance[rows[seed][1]], covariance[rows[seed][2]] };
+	if (covariance[rows[seed][seed]] == 0)
+		axis[0] = axis[1] = axis[2] = 1;
+	for (int k = 0; k < 4; k++)
+	{
+		float x = covariance[0] * axis[0] + covariance[1] * axis[1] + covariance[2] * axis[2];
+		float y = covariance[1] * axis[0] + covariance[3] * axis[1] + covariance[4] * axis[2];
+		float z = covariance[2] * axis[0] + covariance[4] * axis[1] + covariance[5] * axis[2];
+		float length = max(max(fabsf(x), fabsf(y)), fabsf(z));
+		if (length == 0)
+			break;
+		axis[0] = x / length;
+		axis[1] = y / length;
+		axis[2] = z / length;
+	}
+
+	float lowest = 0, highest = 0;
+	for (int i = 0; i < 16; i++)
+	{
+		float t = (texels[i][0] - mean[0]) * axis[0] + (texels[i][1] - mean[1]) * axis[1] + (texels[i][2] - mean[2]) * axis[2];
+		lowest = min(lowest, t);
+		highest = max(highest, t);
+	}
+	float norm = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+	int high[3], low[3];
+	for (int c = 0; c < 3; c++)
+	{
+		high[c] = min(255, max(0, (int)(mean[c] + axis[c] * highest / norm + 0.5f)));
+		low[c] = min(255, max(0, (int)(mean[c] + axis[c] * lowest / norm + 0.5f)));
+	}
+
+	uint16_t color0 = packColor565(high), color1 = packColor565(low);
+	if (color0 < color1)
+		swap(color0, color1);
+
+	uint32_t indices = 0;
+	if (color0 != color1)
+	{
+		int error = fitColorIndices(texels, color0, color1, indices);
+
+		// Weight of color0 for each index; color1 gets the rest
+		static const float weights[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+		float aa = 0, ab = 0, bb = 0, ax[3] = { 0, 0, 0 }, bx[3] = { 0, 0, 0 };
+		for (int i = 0; i < 16; i++)
+		{
+			float a = weights[(indices >> (2 * i)) & 3], b = 1.0f - a;
+			aa += a * a;
+			ab += a * b;
+			bb += b * b;
+			for (int c = 0; c < 3; c++)
+			{
+				ax[c] += a * texels[i][c];
+				bx[c] += b * texels[i][c];
+			}
+		}
+		float determinant = aa * bb - ab * ab;
+		if (fabsf(determinant) > 1e-6f)
+		{
+			for (int c = 0; c < 3; c++)
+			{
+				high[c] = min(255, max(0, (int)((ax[c] * bb - bx[c] * ab) / determinant + 0.5f)));
+				low[c] = min(255, max(0, (int)((bx[c] * aa - ax[c] * ab) / determinant + 0.5f)));
+			}
+			uint16_t refined0 = packColor565(high), refined1 = packColor565(low);
+			if (refined0 < refined1)
+				swap(refined0, refined1);
+			uint32_t refinedIndices;
+			if (refined0 != refined1 && fitColorIndices(texels, refined0, refined1, refinedIndices) < error)
+			{
+				color0 = refined0;
+				color1 = refined1;
+				indices = refinedIndices;
+			}
+		}
+	}
+
+	out[0] = (unsigned char)(color0 & 0xff);
+	out[1] = (unsigned char)(color0 >> 8);
+	out[2] = (unsigned char)(color1 & 0xff);
+	out[3] = (unsigned char)(color1 >> 8);
+	for (int b = 0; b < 4; b++)
+		out[4 + b] = (unsigned char)(indices >> (8 * b));
+}
+
+// Alpha half of a BC3 block, 8 bytes, in eight value mode
+inline void encodeAlphaBlock(const unsigned char texels[16][4], unsigned char* out)
+{
+	int alpha0 = 0, alpha1 = 255;
+	for (int i = 0; i < 16; i++)
+	{
+		alpha0 = max(alpha0, (int)texels[i][3]);
+		alpha1 = min(alpha1, (int)texels[i][3]);
+	}
+
+	uint64_t indices = 0;
+	if (alpha0 != alpha1)
+	{
+		int palette[8];
+		palette[0] = alpha0;
+		palette[1] = alpha1;
+		for (int p = 1; p < 7; p++)
+			palette[p + 1] = ((7 - p) * alpha0 + p * alpha1) / 7;
+
+		for (int i = 0; i < 16; i++)
+		{
+			int best = 0, bestDistance = 256;
+			for (int p = 0; p < 8; p++)
+			{
+				int distance = abs(texels[i][3] - palette[p]);
+				if (distance < bestDistance)
+				{
+					bestDistance = distance;
+					best = p;
+				}
+			}
+			indices |= (uint64_t)best << (3 * i);
+		}
+	}
+
+	out[0] = (unsigned char)alpha0;
+	out[1] = (unsigned char)alpha1;
+	for (int b = 0; b < 6; b++)
+		out[2 + b] = (unsigned char)(indices >> (8 * b));
+}
+
+// Compresses RGBA pixels, rows top to bottom, and every mip level below them.
+// Mips are 2x2 box filtered.
+inline void compressTexture(const unsigned char* rgba, int width, int height, CompressedTexture& texture)
+{
+	bool alpha = false;
+	for (size_t i = 0; i < (size_t)width * height && !alpha; i++)
+		alpha = rgba[4 * i + 3] != 255;
+
+	texture.format = alpha ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+	texture.width = width;
+	texture.height = height;
+	texture.data.clear();
+	texture.offsets.clear();
+	texture.sizes.clear();
+
+	vector<unsigned char> level(rgba, rgba + (size_t)width * height * 4), next;
+	int w = width, h = height;
+	while (true)
+	{
+		size_t offset = texture.data.size();
+		size_t size = CompressedTexture::LevelSize(texture.format, w, h);
+		texture.offsets.push_back(offset);
+		texture.sizes.push_back(size);
+		texture.data.resize(offset + size);
+
+		unsigned char* out = &texture.data[offset];
+		unsigned char texels[16][4];
+		for (int by = 0; by < h; by += 4)
+		{
+			for (int bx = 0; bx < w; bx += 4)
+			{
+				// Blocks hanging over the edge repeat the last row and column
+				for (int i = 0; i < 16; i++)
+				{
+					int x = min(bx + (i & 3), w - 1), y = min(by + (i >> 2), h - 1);
+					memcpy(texels[i], &level[((size_t)y * w + x) * 4], 4);
+				}
+				if (alpha)
+				{
+					encodeAlphaBlock(texels, out);
+					out += 8;
+				}
+				encodeColorBlock(texels, out);
+				out += 8;
+			}
+		}
+
+		if (w == 1 && h == 1)
+			break;
+
+		int nextWidth = max(1, w / 2), nextHeight = max(1, h / 2);
+		next.resize((size_t)nextWidth * nextHeight * 4);
+		for (int y = 0; y < nextHeight; y++)
+		{
+			int y0 = min(2 * y, h - 1), y1 = min(2 * y + 1, h - 1);
+			for (int x = 0; x < nextWidth; x++)
+			{
+				int x0 = min(2 * x, w - 1), x1 = min(2 * x + 1, w - 1);
+				for (int c = 0; c < 4; c++)
+				{
+					int sum = level[((size_t)y0 * w + x0) * 4 + c] + level[((size_t)y0 * w + x1) * 4 + c]
+						+ level[((size_t)y1 * w + x0) * 4 + c] + level[((size_t)y1 * w + x1) * 4 + c];
+					next[((size_t)y * nextWidth + x) * 4 + c] = (unsigned char)((sum + 2) / 4);
+				}
+			}
+		}
+		level.swap(next);
+		w = nextWidth;
+		h = nextHeight;
+	}
+}
+
+// KTX 1.1 container, https://www.khronos.org/opengles/sdk/tools/KTX/file_format_spec/
+// The source file's size and modification time go in the "ARSource" key, so a
+// transcoded texture is redone when its image changes.
+const unsigned char KTX_IDENTIFIER[12] = { 0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n' };
+const char KTX_SOURCE_KEY[] = "ARSource";
+
+struct KtxHeader
+{
+	unsigned char identifier[12];
+	uint32_t endianness;
+	uint32_t glType;
+	uint32_t glTypeSize;
+	uint32_t glFormat;
+	uint32_t glInternalFormat;
+	uint32_t glBaseInternalFormat;
+	uint32_t pixelWidth;
+	uint32_t pixelHeight;
+	uint32_t pixelDepth;
+	uint32_t numberOfArrayElements;
+	uint32_t numberOfFaces;
+	uint32_t numberOfMipmapLevels;
+	uint32_t bytesOfKeyValueData;
+};
+
+inline string ktxSourceValue(const string& sourcePath)
+{
+	uint64_t size;
+	int64_t time;
+	if (!fileStamp(sourcePath, size, time))
+		return string();
+	stringstream value;
+	value << size << ' ' << time;
+	return value.str();
+}
+
+inline bool writeKtx(const string& path, const string& sourcePath, const CompressedTexture& texture)
+{
+	string source = ktxSourceValue(sourcePath);
+	if (source.empty())
+		return false;
+
+	// key\0value\0, padded to 4 bytes
+	uint32_t pairSize = (uint32_t)(sizeof(KTX_SOURCE_KEY) + source.size() + 1);
+	uint32_t pairPadding = (4 - pairSize % 4) % 4;
+
+	KtxHeader header;
+	memcpy(header.identifier, KTX_IDENTIFIER, sizeof(header.identifier));
+	header.endianness = 0x04030201;
+	header.glType = 0;
+	header.glTypeSize = 1;
+	header.glFormat = 0;
+	header.glInternalFormat = texture.format;
+	header.glBaseInternalFormat = texture.format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT ? GL_RGB : GL_RGBA;
+	header.pixelWidth = texture.width;
+	header.pixelHeight = texture.height;
+	header.pixelDepth = 0;
+	header.numberOfArrayElements = 0;
+	header.numberOfFaces = 1;
+	header.numberOfMipmapLevels = texture.Levels();
+	header.bytesOfKeyValueData = 4 + pairSize + pairPadding;
+
+	string temporaryPath = path + ".tmp";
+	FILE* file = fopen(temporaryPath.c_str(), "wb");
+	if (!file)
+		return false;
+
+	static const char zeros[4] = { 0 };
+	bool written = fwrite(&header, sizeof(header), 1, file) == 1
+		&& fwrite(&pairSize, 4, 1, file) == 1
+		&& fwrite(KTX_SOURCE_KEY, sizeof(KTX_SOURCE_KEY), 1, file) == 1
+		&& fwrite(source.c_str(), source.size() + 1, 1, file) == 1
+		&& (pairPadding == 0 || fwrite(zeros, pairPadding, 1, file) == 1);
+	// Compressed levels are multiples of 8 bytes, no mip padding needed
+	for (int level = 0; written && level < texture.Levels(); level++)
+	{
+		uint32_t imageSize = (uint32_t)texture.sizes[level];
+		written = fwrite(&imageSize, 4, 1, file) == 1
+			&& fwrite(&texture.data[texture.offsets[level]], imageSize, 1, file) == 1;
+	}
+	written = fclose(file) == 0 && written;
+
+	remove(path.c_str());
+	if (!written || rename(temporaryPath.c_str(), path.c_str()) != 0)
+	{
+		remove(temporaryPath.c_str());
+		return false;
+	}
+	return true;
+}
+
+// Reads a KTX file written by writeKtx. False when it is missing, not BC1/BC3,
+// or made from another version of sourcePath.
+inline bool readKtx(const string& path, const string& sourcePath, CompressedTexture& texture)
+{
+	FILE* file = fopen(path.c_str(), "rb");
+	if (!file)
+		return false;
+
+	KtxHeader header;
+	vector<char> keyValues;
+	bool valid = fread(&header, sizeof(header), 1, file) == 1
+		&& memcmp(header.identifier, KTX_IDENTIFIER, sizeof(header.identifier)) == 0
+		&& header.endianness == 0x04030201
+		&& (header.glInternalFormat == GL_COMPRESSED_RGB_S3TC_DXT1_EXT || header.glInternalFormat == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT)
+		&& header.pixelWidth > 0 && header.pixelHeight > 0 && header.pixelDepth == 0
+		&& header.numberOfArrayElements == 0 && header.numberOfFaces == 1
+		&& header.numberOfMipmapLevels > 0 && header.numberOfMipmapLevels <= 32
+		&& header.bytesOfKeyValueData < 65536;
+	if (valid)
+	{
+		keyValues.resize(header.bytesOfKeyValueData + 1, 0);
+		valid = header.bytesOfKeyValueData == 0 || fread(&keyValues[0], header.bytesOfKeyValueData, 1, file) == 1;
+	}
+
+	// Find our key among the pairs
+	bool current = false;
+	string source = ktxSourceValue(sourcePath);
+	for (size_t offset = 0; valid && !current && offset + 4 <= header.bytesOfKeyValueData;)
+	{
+		uint32_t pairSize;
+		memcpy(&pairSize, &keyValues[offset], 4);
+		if (pairSize > header.bytesOfKeyValueData - offset - 4)
+			break;
+		const char* key = &keyValues[offset + 4];
+		size_t keySize = strlen(key) + 1;
+		if (strcmp(key, KTX_SOURCE_KEY) == 0 && keySize < pairSize)
+			current = string(key + keySize) == source;
+		offset += 4 + pairSize + (4 - pairSize % 4) % 4;
+	}
+	valid = valid && current && !source.empty();
+
+	if (valid)
+	{
+		texture.format = header.glInternalFormat;
+		texture.width = header.pixelWidth;
+		texture.height = header.pixelHeight;
+		texture.data.clear();
+		texture.offsets.clear();
+		texture.sizes.clear();
+		for (uint32_t level = 0; valid && level < header.numberOfMipmapLevels; level++)
+		{
+			uint32_t imageSize;
+			size_t expected = CompressedTexture::LevelSize(texture.format, texture.LevelWidth(level), texture.LevelHeight(level));
+			valid = fread(&imageSize, 4, 1, file) == 1 && imageSize == expected;
+			if (!valid)
+				break;
+			size_t offset = texture.data.size();
+			texture.data.resize(offset + imageSize);
+			texture.offsets.push_back(offset);
+			texture.sizes.push_back(imageSize);
+			valid = fread(&texture.data[offset], imageSize, 1, file) == 1;
+		}
+	}
+	fclose(file);
+	return valid;
+}
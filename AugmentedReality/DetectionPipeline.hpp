@@ -0,0 +1,234 @@
+#pragma once
+
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/aruco.hpp>
+#include <opencv2/calib3d/calib3d.hpp>
+
+#include "MarkerTracker.hpp"
+#include "PyramidDetector.hpp"
+#include "ThresholdKernel.h"
+#include "FrameContext.hpp"
+#include "BoardIndex.hpp"
+#include "PoseTracker.hpp"
+#include "PoseBatch.hpp"
+#include "ThreadPool.hpp"
+#include "AllocationCounter.h"
+#include "AsyncLogger.hpp"
+#include "Profiler.hpp"
+
+using namespace std;
+
+// Everything the detection stage does to one frame: gray conversion, marker
+// detection and refinement, the batched pose solve of the board and the 100
+// and 200 controller markers, and the pose filter. The app runs it on its
+// detection thread, the replay benchmark on recorded or synthetic frames.
+//
+// Construct it on the thread that starts the stages: it registers its
+// profiler stages.
+class DetectionPipeline
+{
+public:
+	DetectionPipeline(cv::Ptr<cv::aruco::Dictionary> dictionary, cv::Ptr<cv::aruco::DetectorParameters> parameters,
+		TrackerParameters trackerParameters, PyramidParameters pyramidParameters, cv::Ptr<cv::aruco::GridBoard> board,
+		const cv::Mat& cameraMatrix, const cv::Mat& distCoeffs)
+		: tracker(dictionary, parameters, trackerParameters, pyramidParameters), boardIndex(board), board(board),
+		cameraMatrix(cameraMatrix), distCoeffs(distCoeffs), boardFound(false), iterations(0)
+	{
+		Profiler& profiler = Profiler::Instance();
+		this->convertStage = profiler.Stage("convert");
+		this->detectStage = profiler.Stage("detectMarkers");
+		this->refineStage = profiler.Stage("refineMarkers");
+		this->poseStage = profiler.Stage("solvePnP");
+	}
+
+	// Detects and solves the poses of one frame taken at timestamp. With
+	// annotate the markers and pose axes are drawn into image.
+	void Process(cv::Mat& image, double timestamp, unsigned long long sequence, bool annotate)
+	{
+		FrameContext& context = this->context;
+		context.Reset();
+		this->controllerRvecs.clear();
+		this->controllerTvecs.clear();
+		this->boardFound = false;
+		this->iterations = 0;
+
+		// aruco skips its own conversion when handed a gray image
+		{
+			ScopedTimer timer(this->convertStage);
+			context.gray.create(image.size(), CV_8UC1);
+			this->kernel.Process(image.data, image.step, image.cols, image.rows, context.gray.data, context.gray.step, 0, 0, 0, 0, 0);
+		}
+		{
+			ScopedTimer timer(this->detectStage);
+			this->tracker.Detect(context.gray, context.markerCorners, context.markerIds, context.rejectedCandidates, context.corners);
+		}
+		{
+			ScopedTimer timer(this->refineStage);
+			AllocationPause pause;
+			cv::aruco::refineDetectedMarkers(context.gray, this->board, context.markerCorners, context.markerIds, context.rejectedCandidates,
+				this->cameraMatrix, this->distCoeffs);
+			if (annotate)
+				cv::aruco::drawDetectedMarkers(image, context.markerCorners, context.markerIds);
+		}
+
+		if (context.markerIds.size() > 0)
+		{
+			cv::Vec3d predictedR, predictedT;
+			bool predicted = this->poseTracker.Predict(timestamp, predictedR, predictedT);
+			int boardGroup = this->queueBoardPose(predicted, predictedR, predictedT);
+
+			// Controller 100 goes first, then 200
+			int firstController = context.poses.Size();
+			for (size_t i = 0; i < context.markerIds.size(); i++)
+			{
+				if (context.markerIds[i] == 100)
+					context.poses.AddMarker(context.markerCorners[i], 10);
+			}
+			for (size_t i = 0; i < context.markerIds.size(); i++)
+			{
+				if (context.markerIds[i] == 200)
+					context.poses.AddMarker(context.markerCorners[i], 10);
+			}
+
+			{
+				ScopedTimer timer(this->poseStage);
+				AllocationPause pause;
+				context.poses.Solve(this->pool, this->cameraMatrix, this->distCoeffs);
+			}
+
+			if (boardGroup >= 0 && context.poses.Result(boardGroup).valid)
+			{
+				const PoseResult& result = context.poses.Result(boardGroup);
+				this->rvec = result.rvec;
+				this->tvec = result.tvec;
+				this->iterations = result.iterations;
+				this->boardFound = true;
+				this->poseTracker.Correct(timestamp, this->rvec, this->tvec);
+
+				AsyncLogger::Instance().Pose(sequence, timestamp, this->rvec.val, this->tvec.val);
+				if (annotate)
+				{
+					AllocationPause pause;
+					cv::aruco::drawAxis(image, this->cameraMatrix, this->distCoeffs, this->rvec, this->tvec, 100);
+				}
+			}
+
+			for (int i = firstController; i < context.poses.Size(); i++)
+			{
+				const PoseResult& result = context.poses.Result(i);
+				if (!result.valid)
+					continue;
+				this->controllerRvecs.push_back(result.rvec);
+				this->controllerTvecs.push_back(result.tvec);
+				if (annotate)
+				{
+					AllocationPause pause;
+					cv::aruco::drawAxis(image, this->cameraMatrix, this->distCoeffs, result.rvec, result.tvec, 5);
+				}
+			}
+		}
+
+		if (!this->boardFound)
+			this->poseTracker.Miss(timestamp);
+
+		this->tracker.SetBoardPose(this->board, this->cameraMatrix, this->distCoeffs, this->rvec, this->tvec, this->boardFound);
+	}
+
+	bool BoardFound() const
+	{
+		return this->boardFound;
+	}
+
+	// Raw board pose of the last frame it was found in
+	const cv::Vec3d& Rvec() const
+	{
+		return this->rvec;
+	}
+
+	const cv::Vec3d& Tvec() const
+	{
+		return this->tvec;
+	}
+
+	// Filtered board pose, for the render stage to extrapolate
+	const PoseState& Pose() const
+	{
+		return this->poseTracker.State();
+	}
+
+	// Solver iterations of the last board pose
+	int Iterations() const
+	{
+		return this->iterations;
+	}
+
+	const vector<cv::Vec3d>& ControllerRvecs() const
+	{
+		return this->controllerRvecs;
+	}
+
+	const vector<cv::Vec3d>& ControllerTvecs() const
+	{
+		return this->controllerTvecs;
+	}
+
+private:
+	MarkerTracker tracker;
+	PoseTracker poseTracker;
+	ThreadPool pool;
+	ThresholdKernel kernel;
+	FrameContext context;
+	BoardIndex boardIndex;
+	cv::Ptr<cv::aruco::GridBoard> board;
+
+	cv::Mat cameraMatrix;
+	cv::Mat distCoeffs;
+
+	cv::Vec3d rvec, tvec;
+	bool boardFound;
+	int iterations;
+	vector<cv::Vec3d> controllerRvecs;
+	vector<cv::Vec3d> controllerTvecs;
+
+	int convertStage;
+	int detectStage;
+	int refineStage;
+	int poseStage;
+
+	// Queues the board pose in the frame's batch. rvec/tvec hold the tracker's
+	// prediction when useExtrinsicGuess is set. Returns the batch index, or -1
+	// when none of the detected markers belongs to the board.
+	int queueBoardPose(bool useExtrinsicGuess, const cv::Vec3d& rvec, const cv::Vec3d& tvec)
+	{
+		int group = this->context.poses.Add();
+		PoseBatch::Group& poses = this->context.poses.At(group);
+
+		// look for detected markers that belong to the board and get their
+		// object and image points, into the batch's reusable buffers
+		for (size_t i = 0; i < this->context.markerIds.size(); i++)
+		{
+			int j = this->boardIndex.Find(this->context.markerIds[i]);
+			if (j < 0)
+				continue;
+			const cv::Point3f* markerObjPoints = this->boardIndex.ObjPoints(j);
+			for (int p = 0; p < 4; p++)
+			{
+				poses.objPoints.push_back(markerObjPoints[p]);
+				poses.imgPoints.push_back(this->context.markerCorners[i][p]);
+			}
+		}
+
+		if (poses.objPoints.empty())
+		{
+			this->context.poses.RemoveLast();
+			return -1;
+		}
+
+		poses.useExtrinsicGuess = useExtrinsicGuess;
+		poses.rvec = rvec;
+		poses.tvec = tvec;
+		return group;
+	}
+};
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+// Size and modification time of a file. Caches derived from a file are keyed
+// on it and rebuilt when it changes.
+inline bool fileStamp(const string& path, uint64_t& size, int64_t& time)
+{
+	struct stat info;
+	if (stat(path.c_str(), &info) != 0)
+		return false;
+	size = (uint64_t)info.st_size;
+	time = (int64_t)info.st_mtime;
+	return true;
+}
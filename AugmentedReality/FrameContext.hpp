@@ -0,0 +1,75 @@
+#pragma once
+
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include "PoseBatch.hpp"
+
+using namespace std;
+
+// Keeps the storage of per-marker corner vectors alive between frames. Lists
+// are emptied by moving their inner vectors into the pool, and refilled by
+// taking them back out, so a list of quads never frees or allocates once the
+// pool has grown to the largest frame seen.
+class CornerPool
+{
+public:
+	CornerPool()
+	{
+
+	}
+
+	void Recycle(vector<vector<cv::Point2f>>& list)
+	{
+		for (size_t i = 0; i < list.size(); i++)
+		{
+			if (this->pool.size() >= MAX_POOLED)
+				break;
+			this->pool.push_back(vector<cv::Point2f>());
+			this->pool.back().swap(list[i]);
+		}
+		list.clear();
+	}
+
+	void Append(vector<vector<cv::Point2f>>& list, const vector<cv::Point2f>& quad)
+	{
+		list.push_back(vector<cv::Point2f>());
+		if (!this->pool.empty())
+		{
+			list.back().swap(this->pool.back());
+			this->pool.pop_back();
+		}
+		list.back().assign(quad.begin(), quad.end());
+	}
+
+private:
+	static const size_t MAX_POOLED = 1024;
+
+	vector<vector<cv::Point2f>> pool;
+};
+
+// Working set of one detection frame. The detection stage owns a single
+// context and calls Reset() at the start of every frame, which empties the
+// containers without releasing their memory.
+struct FrameContext
+{
+	cv::Mat gray;
+
+	vector<int> markerIds;
+	vector<vector<cv::Point2f>> markerCorners;
+	vector<vector<cv::Point2f>> rejectedCandidates;
+
+	// Board and controller correspondences, solved together
+	PoseBatch poses;
+
+	CornerPool corners;
+
+	void Reset()
+	{
+		this->markerIds.clear();
+		this->corners.Recycle(this->markerCorners);
+		this->corners.Recycle(this->rejectedCandidates);
+		this->poses.Clear();
+	}
+};
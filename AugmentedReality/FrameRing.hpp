@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+// Bounded single-producer / single-consumer ring of three slots with a
+// "latest frame wins" drop policy. The producer fills Back() and publishes
+// it, the consumer always takes the most recently published slot. A slot the
+// consumer never picked up is recycled by the producer and counted as dropped,
+// unless the producer waits for it with WaitConsumed.
+// Slots are handed over by swapping indices, so nothing is copied or locked.
+template <typename T>
+class FrameRing
+{
+public:
+	FrameRing()
+		: back(0), front(2), shared(1), published(0), dropped(0)
+	{
+
+	}
+
+	// Direct slot access, only for setting the slots up before any thread runs
+	T& Slot(int i)
+	{
+		return this->slots[i];
+	}
+
+	// Producer side
+	T& Back()
+	{
+		return this->slots[this->back];
+	}
+
+	void Publish()
+	{
+		int old = this->shared.exchange(this->back | FRESH, std::memory_order_acq_rel);
+		if (old & FRESH)
+			this->dropped.fetch_add(1, std::memory_order_relaxed);
+		this->published.fetch_add(1, std::memory_order_relaxed);
+		this->back = old & INDEX;
+	}
+
+	// Blocks until the consumer has taken the last published slot, so the
+	// next Publish drops nothing. For offline runs that must see every frame.
+	bool WaitConsumed(const std::atomic<bool>& running)
+	{
+		while (this->Pending())
+		{
+			if (!running.load(std::memory_order_relaxed))
+				return false;
+			std::this_thread::sleep_for(std::chrono::microseconds(500));
+		}
+		return true;
+	}
+
+	// Consumer side
+	bool Pending() const
+	{
+		return (this->shared.load(std::memory_order_acquire) & FRESH) != 0;
+	}
+
+	bool Acquire()
+	{
+		if (!(this->shared.load(std::memory_order_acquire) & FRESH))
+			return false;
+		int old = this->shared.exchange(this->front, std::memory_order_acq_rel);
+		this->front = old & INDEX;
+		return true;
+	}
+
+	bool WaitAcquire(const std::atomic<bool>& running)
+	{
+		while (running.load(std::memory_order_relaxed))
+		{
+			if (this->Acquire())
+				return true;
+			std::this_thread::sleep_for(std::chrono::microseconds(500));
+		}
+		// The producer may have published once more before it stopped
+		return this->Acquire();
+	}
+
+	T& Front()
+	{
+		return this->slots[this->front];
+	}
+
+	unsigned long long Published() const
+	{
+		return this->published.load(std::memory_order_relaxed);
+	}
+
+	unsigned long long Dropped() const
+	{
+		return this->dropped.load(std::memory_order_relaxed);
+	}
+
+private:
+	static const int INDEX = 3;
+	static const int FRESH = 4;
+
+	T slots[3];
+
+	int back;
+	int front;
+	std::atomic<int> shared;
+
+	std::atomic<unsigned long long> published;
+	std::atomic<unsigned long long> dropped;
+};
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/videoio/videoio.hpp>
+
+using namespace std;
+
+// Where rendered frames go when there is no window
+class FrameSink
+{
+public:
+	virtual ~FrameSink()
+	{
+
+	}
+
+	virtual void Write(const cv::Mat& frame, unsigned long long sequence) = 0;
+};
+
+// One image per frame, named by a printf pattern of the sequence number,
+// such as out/%05d.png
+class ImageSequenceSink : public FrameSink
+{
+public:
+	ImageSequenceSink(const string& pattern)
+		: pattern(pattern)
+	{
+
+	}
+
+	void Write(const cv::Mat& frame, unsigned long long sequence)
+	{
+		char path[1024];
+		snprintf(path, sizeof(path), this->pattern.c_str(), (int)sequence);
+		cv::imwrite(path, frame);
+	}
+
+private:
+	string pattern;
+};
+
+// Encodes frames into a video file, opened with the size of the first frame
+class VideoSink : public FrameSink
+{
+public:
+	VideoSink(const string& path, double fps, int fourcc = cv::VideoWriter::fourcc('M', 'J', 'P', 'G'))
+		: path(path), fps(fps), fourcc(fourcc)
+	{
+
+	}
+
+	void Write(const cv::Mat& frame, unsigned long long sequence)
+	{
+		if (!this->writer.isOpened())
+		{
+			if (!this->writer.open(this->path, this->fourcc, this->fps, frame.size()))
+				return;
+		}
+		this->writer.write(frame);
+	}
+
+private:
+	string path;
+	double fps;
+	int fourcc;
+	cv::VideoWriter writer;
+};
+
+// Moves encoding off the render thread. Frames are copied into a small ring
+// of reused images and written by a worker thread; when the ring is full
+// Write() waits, so no frame is lost and a slow encoder slows rendering down
+// rather than filling memory.
+class AsyncFrameSink : public FrameSink
+{
+public:
+	AsyncFrameSink(cv::Ptr<FrameSink> sink, int depth = 4)
+		: sink(sink), frames(depth), sequences(depth), head(0), count(0), stopping(false)
+	{
+		this->worker = thread(&AsyncFrameSink::work, this);
+	}
+
+	~AsyncFrameSink()
+	{
+		{
+			lock_guard<mutex> lock(this->lock);
+			this->stopping = true;
+		}
+		this->changed.notify_all();
+		this->worker.join();
+	}
+
+	void Write(const cv::Mat& frame, unsigned long long sequence)
+	{
+		unique_lock<mutex> lock(this->lock);
+		this->changed.wait(lock, [this] { return this->count < (int)this->frames.size(); });
+
+		int slot = (this->head + this->count) % (int)this->frames.size();
+		frame.copyTo(this->frames[slot]);
+		this->sequences[slot] = sequence;
+		this->count++;
+		this->changed.notify_all();
+	}
+
+private:
+	cv::Ptr<FrameSink> sink;
+	vector<cv::Mat> frames;
+	vector<unsigned long long> sequences;
+	int head;
+	int count;
+	bool stopping;
+
+	mutex lock;
+	condition_variable changed;
+	thread worker;
+
+	void work()
+	{
+		unique_lock<mutex> lock(this->lock);
+		while (true)
+		{
+			this->changed.wait(lock, [this] { return this->count > 0 || this->stopping; });
+			if (this->count == 0)
+				return;
+
+			// The slot stays owned by the worker until count drops
+			int slot = this->head;
+			lock.unlock();
+			this->sink->Write(this->frames[slot], this->sequences[slot]);
+			lock.lock();
+
+			this->head = (this->head + 1) % (int)this->frames.size();
+			this->count--;
+			this->changed.notify_all();
+		}
+	}
+};
+
+// Sink from a command line argument: a pattern containing % writes images,
+// anything else a video file. Encoding runs on its own thread.
+inline cv::Ptr<FrameSink> openFrameSink(const string& spec, double fps)
+{
+	cv::Ptr<FrameSink> sink;
+	if (spec.find('%') != string::npos)
+		sink = cv::makePtr<ImageSequenceSink>(spec);
+	else
+		sink = cv::makePtr<VideoSink>(spec, fps);
+	return cv::makePtr<AsyncFrameSink>(sink);
+}
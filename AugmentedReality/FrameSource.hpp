@@ -0,0 +1,218 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <chrono>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/videoio/videoio.hpp>
+#include <opencv2/calib3d/calib3d.hpp>
+#include <opencv2/aruco.hpp>
+
+#include "SyntheticBoard.hpp"
+
+using namespace std;
+
+// Where frames come from: a live camera, a recorded video or image sequence,
+// or synthetic renders of the board with known poses. Read() fills frame,
+// reusing its memory when the size matches, and the frame's time in seconds.
+class FrameSource
+{
+public:
+	virtual ~FrameSource()
+	{
+
+	}
+
+	virtual bool Read(cv::Mat& frame, double& timestamp) = 0;
+
+	// Live sources deliver frames in real time and may fail a read now and
+	// then; recorded ones end when a read fails
+	virtual bool Live() const
+	{
+		return false;
+	}
+
+	// Frames per second the source delivers or was recorded at
+	virtual double FrameRate() const
+	{
+		return 30.0;
+	}
+
+	// Camera matrix and distortion the frames were made with, when the source
+	// knows them
+	virtual bool Intrinsics(cv::Mat& cameraMatrix, cv::Mat& distCoeffs) const
+	{
+		return false;
+	}
+
+	// Board pose of the frame last read, when the source knows it
+	virtual bool Truth(cv::Vec3d& rvec, cv::Vec3d& tvec) const
+	{
+		return false;
+	}
+};
+
+class CameraSource : public FrameSource
+{
+public:
+	CameraSource(int index)
+		: capture(index)
+	{
+
+	}
+
+	bool Read(cv::Mat& frame, double& timestamp)
+	{
+		if (!this->capture.read(frame))
+			return false;
+		timestamp = chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+		return true;
+	}
+
+	bool Live() const
+	{
+		return true;
+	}
+
+	// Cameras that do not report a rate get the default
+	double FrameRate() const
+	{
+		double fps = this->capture.get(cv::CAP_PROP_FPS);
+		return fps > 0 ? fps : FrameSource::FrameRate();
+	}
+
+private:
+	cv::VideoCapture capture;
+};
+
+// A video file, or an image sequence given as a printf pattern such as
+// frames/%04d.png. Time comes from the frame index, so replay speed does not
+// change the results.
+class VideoSource : public FrameSource
+{
+public:
+	VideoSource(const string& path, double fallbackFps = 30.0)
+		: capture(path), frameIndex(0)
+	{
+		this->fps = this->capture.get(cv::CAP_PROP_FPS);
+		if (!(this->fps > 0))
+			this->fps = fallbackFps;
+	}
+
+	bool Opened() const
+	{
+		return this->capture.isOpened();
+	}
+
+	bool Read(cv::Mat& frame, double& timestamp)
+	{
+		if (!this->capture.read(frame))
+			return false;
+		timestamp = this->frameIndex++ / this->fps;
+		return true;
+	}
+
+	double FrameRate() const
+	{
+		return this->fps;
+	}
+
+private:
+	cv::VideoCapture capture;
+	double fps;
+	long long frameIndex;
+};
+
+// The GridBoard rendered along a smooth trajectory, 30 frames per second,
+// with the exact pose of every frame.
+class SyntheticSource : public FrameSource
+{
+public:
+	SyntheticSource(const cv::Ptr<cv::aruco::GridBoard>& board, cv::Size imageSize, int frames)
+		: synthetic(board, 2.0f), imageSize(imageSize), frames(frames), frameIndex(0)
+	{
+		double f = imageSize.width * 0.8;
+		this->cameraMatrix = (cv::Mat_<double>(3, 3) <<
+			f, 0, (imageSize.width - 1) * 0.5,
+			0, f, (imageSize.height - 1) * 0.5,
+			0, 0, 1);
+
+		cv::Size size = board->getGridSize();
+		float length = board->getMarkerLength(), separation = board->getMarkerSeparation();
+		this->boardCenter = cv::Vec3d(
+			(size.width * (length + separation) - separation) * 0.5,
+			(size.height * (length + separation) - separation) * 0.5, 0);
+	}
+
+	bool Read(cv::Mat& frame, double& timestamp)
+	{
+		if (this->frameIndex >= this->frames)
+			return false;
+
+		double t = this->frameIndex++ / 30.0;
+
+		// Board facing the camera, swaying and drifting slowly
+		cv::Vec3d tilt(0.35 * sin(0.9 * t), 0.3 * sin(0.6 * t + 1.0), 0.5 * sin(0.4 * t));
+		cv::Mat R, R0, R1;
+		cv::Rodrigues(cv::Vec3d(CV_PI, 0, 0), R0);
+		cv::Rodrigues(tilt, R1);
+		R = R0 * R1;
+		cv::Rodrigues(R, this->rvec);
+
+		cv::Mat center = R * cv::Mat(this->boardCenter);
+		this->tvec = cv::Vec3d(250 * sin(0.5 * t), 150 * sin(0.7 * t), 3500 + 1000 * sin(0.3 * t)) - cv::Vec3d(center);
+
+		this->synthetic.Render(this->imageSize, this->cameraMatrix, this->rvec, this->tvec, frame, this->corners, this->ids);
+		timestamp = t;
+		return true;
+	}
+
+	bool Intrinsics(cv::Mat& cameraMatrix, cv::Mat& distCoeffs) const
+	{
+		cameraMatrix = this->cameraMatrix.clone();
+		distCoeffs = cv::Mat::zeros(1, 5, CV_64F);
+		return true;
+	}
+
+	bool Truth(cv::Vec3d& rvec, cv::Vec3d& tvec) const
+	{
+		rvec = this->rvec;
+		tvec = this->tvec;
+		return this->frameIndex > 0;
+	}
+
+private:
+	SyntheticBoard synthetic;
+	cv::Size imageSize;
+	int frames;
+	int frameIndex;
+	cv::Mat cameraMatrix;
+	cv::Vec3d boardCenter;
+	cv::Vec3d rvec, tvec;
+	vector<vector<cv::Point2f>> corners;
+	vector<int> ids;
+};
+
+// Source from a command line argument:
+//   a number             camera index
+//   synthetic[:frames]   rendered board, 300 frames by default
+//   anything else        video file or image sequence pattern
+inline cv::Ptr<FrameSource> openFrameSource(const string& spec, const cv::Ptr<cv::aruco::GridBoard>& board, cv::Size syntheticSize = cv::Size(1280, 720))
+{
+	if (!spec.empty() && spec.find_first_not_of("0123456789") == string::npos)
+		return cv::makePtr<CameraSource>(atoi(spec.c_str()));
+
+	if (spec.compare(0, 9, "synthetic") == 0)
+	{
+		int frames = spec.size() > 10 ? atoi(spec.c_str() + 10) : 300;
+		return cv::makePtr<SyntheticSource>(board, syntheticSize, frames);
+	}
+
+	cv::Ptr<VideoSource> video = cv::makePtr<VideoSource>(spec);
+	if (!video->Opened())
+		return cv::Ptr<FrameSource>();
+	return video;
+}
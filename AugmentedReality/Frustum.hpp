@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cfloat>
+#include <algorithm>
+
+#include <glm/glm.hpp>
+
+using namespace std;
+
+// Axis aligned box, empty until a point is added
+struct Bounds
+{
+	glm::vec3 lower;
+	glm::vec3 upper;
+
+	Bounds()
+		: lower(FLT_MAX, FLT_MAX, FLT_MAX), upper(-FLT_MAX, -FLT_MAX, -FLT_MAX)
+	{
+
+	}
+
+	bool Empty() const
+	{
+		return this->lower.x > this->upper.x;
+	}
+
+	void Add(const glm::vec3& point)
+	{
+		this->lower = glm::min(this->lower, point);
+		this->upper = glm::max(this->upper, point);
+	}
+
+	void Add(const Bounds& other)
+	{
+		if (other.Empty())
+			return;
+		this->Add(other.lower);
+		this->Add(other.upper);
+	}
+
+	glm::vec3 Center() const
+	{
+		return (this->lower + this->upper) * 0.5f;
+	}
+};
+
+// The six clip planes of a projection * view * model matrix, in the space the
+// matrix takes in, so a model's own boxes are tested without transforming
+// them first.
+class Frustum
+{
+public:
+	Frustum(const glm::mat4& clip)
+	{
+		// Row i of the matrix is (clip[0][i], clip[1][i], clip[2][i], clip[3][i])
+		for (int axis = 0; axis < 3; axis++)
+		{
+			for (int side = 0; side < 2; side++)
+			{
+				float sign = side == 0 ? 1.0f : -1.0f;
+				glm::vec4& plane = this->planes[axis * 2 + side];
+				for (int column = 0; column < 4; column++)
+					plane[column] = clip[column][3] + sign * clip[column][axis];
+			}
+		}
+		for (int column = 0; column < 4; column++)
+			this->depth[column] = clip[column][3];
+		for (int axis = 0; axis < 2; axis++)
+			this->unitLength[axis] = glm::length(glm::vec3(clip[0][axis], clip[1][axis], clip[2][axis]));
+	}
+
+	// False only when the box is entirely outside one plane. Boxes near a
+	// corner of the frustum may pass without being inside; that only costs a
+	// draw.
+	bool Intersects(const Bounds& bounds) const
+	{
+		if (bounds.Empty())
+			return false;
+
+		for (int i = 0; i < 6; i++)
+		{
+			const glm::vec4& plane = this->planes[i];
+			// The box corner furthest along the plane normal
+			glm::vec3 corner(
+				plane.x >= 0 ? bounds.upper.x : bounds.lower.x,
+				plane.y >= 0 ? bounds.upper.y : bounds.lower.y,
+				plane.z >= 0 ? bounds.upper.z : bounds.lower.z);
+			if (plane.x * corner.x + plane.y * corner.y + plane.z * corner.z + plane.w < 0)
+				return false;
+		}
+		return true;
+	}
+
+	// Smallest clip w of the box, the view distance of its nearest corner
+	// for a perspective projection. Zero or less when the box reaches behind
+	// the eye.
+	float NearestDepth(const Bounds& bounds) const
+	{
+		const glm::vec4& row = this->depth;
+		return row.x * (row.x >= 0 ? bounds.lower.x : bounds.upper.x) +
+			row.y * (row.y >= 0 ? bounds.lower.y : bounds.upper.y) +
+			row.z * (row.z >= 0 ? bounds.lower.z : bounds.upper.z) + row.w;
+	}
+
+	// Pixels one unit spans at most at the nearest corner of the box, on a
+	// width x height viewport. Unbounded when the box reaches the eye.
+	float PixelsPerUnit(const Bounds& bounds, int width, int height) const
+	{
+		float nearest = this->NearestDepth(bounds);
+		if (nearest <= 0)
+			return FLT_MAX;
+		return max(this->unitLength[0] * width, this->unitLength[1] * height) * 0.5f / nearest;
+	}
+
+private:
+	glm::vec4 planes[6];
+	glm::vec4 depth;
+	// Clip x and y change per unit, at most
+	float unitLength[2];
+};
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <GL/glew.h>
+
+#include "Profiler.hpp"
+
+// GPU time of a block of draw calls, recorded into a profiler stage.
+//
+// Timestamps are taken with glQueryCounter into a small ring of query pairs
+// and read back a few frames later, once the GPU has got there, so timing
+// never stalls the pipeline. A result that is still not available when its
+// slot comes round again is dropped instead of waited for.
+class GpuTimer
+{
+public:
+	GpuTimer()
+		: stage(-1), frame(0)
+	{
+
+	}
+
+	// Needs the GL context
+	void Init(int stage)
+	{
+		this->stage = stage;
+		glGenQueries(FRAMES * 2, &this->queries[0][0]);
+		for (int i = 0; i < FRAMES; i++)
+			this->pending[i] = false;
+	}
+
+	void Begin()
+	{
+		if (this->stage < 0)
+			return;
+
+		// The slot is reused now: an unfinished result is given up
+		this->collect(this->frame);
+		this->pending[this->frame] = false;
+		glQueryCounter(this->queries[this->frame][0], GL_TIMESTAMP);
+	}
+
+	void End()
+	{
+		if (this->stage < 0)
+			return;
+
+		glQueryCounter(this->queries[this->frame][1], GL_TIMESTAMP);
+		this->pending[this->frame] = true;
+		this->frame = (this->frame + 1) % FRAMES;
+
+		// Pick up whatever finished meanwhile, oldest first
+		for (int i = 0; i < FRAMES; i++)
+			this->collect((this->frame + i) % FRAMES);
+	}
+
+private:
+	static const int FRAMES = 4;
+
+	int stage;
+	int frame;
+	GLuint queries[FRAMES][2];
+	bool pending[FRAMES];
+
+	void collect(int slot)
+	{
+		if (!this->pending[slot])
+			return;
+
+		GLint available = 0;
+		glGetQueryObjectiv(this->queries[slot][1], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available)
+		{
+			GLuint64 begin, end;
+			glGetQueryObjectui64v(this->queries[slot][0], GL_QUERY_RESULT, &begin);
+			glGetQueryObjectui64v(this->queries[slot][1], GL_QUERY_RESULT, &end);
+			Profiler::Instance().Record(this->stage, end - begin);
+			this->pending[slot] = false;
+		}
+	}
+};
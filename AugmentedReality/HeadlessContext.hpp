@@ -0,0 +1,200 @@
+#pragma once
+
+#include <iostream>
+
+#include <GL/glew.h>
+
+#if defined(AR_HEADLESS_EGL)
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#elif defined(AR_HEADLESS_OSMESA)
+#include <GL/osmesa.h>
+#include <vector>
+#else
+#include <GLFW/glfw3.h>
+#endif
+
+using namespace std;
+
+// GL 3.3 core context without a visible window, for rendering on servers.
+// Everything is drawn into an OffscreenTarget; the context only needs to be
+// current.
+//
+// The backend is chosen at build time:
+//   AR_HEADLESS_EGL     EGL, surfaceless or pbuffer. Works without X and with
+//                       Mesa's llvmpipe (EGL_PLATFORM=surfaceless) on CPU-only
+//                       machines. GLEW must be built with GLEW_EGL.
+//   AR_HEADLESS_OSMESA  OSMesa software rendering. GLEW must be built with
+//                       GLEW_OSMESA.
+//   neither             an invisible GLFW window, still needs a display.
+// HEADLESS in the Makefile selects one and builds GLEW to match.
+class HeadlessContext
+{
+public:
+	HeadlessContext()
+#if defined(AR_HEADLESS_EGL)
+		: display(EGL_NO_DISPLAY), surface(EGL_NO_SURFACE), context(EGL_NO_CONTEXT)
+#elif defined(AR_HEADLESS_OSMESA)
+		: context(nullptr)
+#else
+		: window(nullptr)
+#endif
+	{
+
+	}
+
+	~HeadlessContext()
+	{
+		this->Release();
+	}
+
+	// Creates the context and makes it current on the calling thread
+	bool Init(int width, int height)
+	{
+#if defined(AR_HEADLESS_EGL)
+		this->display = EGL_NO_DISPLAY;
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+		PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+			(PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+		if (getPlatformDisplay)
+			this->display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+#endif
+		if (this->display == EGL_NO_DISPLAY)
+			this->display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+		EGLint major, minor;
+		if (this->display == EGL_NO_DISPLAY || !eglInitialize(this->display, &major, &minor))
+		{
+			cout << "ERROR::HEADLESS::EGL_NOT_INITIALIZED" << endl;
+			return false;
+		}
+
+		// Prefer a pbuffer config; surfaceless platforms may only offer
+		// configs without a surface type
+		EGLint configAttributes[] = {
+			EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+			EGL_RED_SIZE, 8,
+			EGL_GREEN_SIZE, 8,
+			EGL_BLUE_SIZE, 8,
+			EGL_DEPTH_SIZE, 24,
+			EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+			EGL_NONE
+		};
+		EGLConfig config;
+		EGLint configs = 0;
+		if (!eglChooseConfig(this->display, configAttributes, &config, 1, &configs) || configs == 0)
+		{
+			configAttributes[1] = 0;
+			if (!eglChooseConfig(this->display, configAttributes, &config, 1, &configs) || configs == 0)
+			{
+				cout << "ERROR::HEADLESS::NO_EGL_CONFIG" << endl;
+				return false;
+			}
+		}
+
+		EGLint surfaceAttributes[] = { EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE };
+		this->surface = eglCreatePbufferSurface(this->display, config, surfaceAttributes);
+
+		eglBindAPI(EGL_OPENGL_API);
+		EGLint contextAttributes[] = {
+			EGL_CONTEXT_MAJOR_VERSION_KHR, 3,
+			EGL_CONTEXT_MINOR_VERSION_KHR, 3,
+			EGL_CONTEXT_OPENGL_PROFILE_MASK_KHR, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT_KHR,
+			EGL_NONE
+		};
+		this->context = eglCreateContext(this->display, config, EGL_NO_CONTEXT, contextAttributes);
+		if (this->context == EGL_NO_CONTEXT)
+		{
+			cout << "ERROR::HEADLESS::NO_GL_3_3_CONTEXT" << endl;
+			return false;
+		}
+
+		// Without a pbuffer the context is made current surfaceless
+		if (!eglMakeCurrent(this->display, this->surface, this->surface, this->context))
+		{
+			cout << "ERROR::HEADLESS::MAKE_CURRENT_FAILED" << endl;
+			return false;
+		}
+		return true;
+#elif defined(AR_HEADLESS_OSMESA)
+		const int attributes[] = {
+			OSMESA_FORMAT, OSMESA_RGBA,
+			OSMESA_DEPTH_BITS, 24,
+			OSMESA_PROFILE, OSMESA_CORE_PROFILE,
+			OSMESA_CONTEXT_MAJOR_VERSION, 3,
+			OSMESA_CONTEXT_MINOR_VERSION, 3,
+			0
+		};
+		this->context = OSMesaCreateContextAttribs(attributes, nullptr);
+		if (!this->context)
+		{
+			cout << "ERROR::HEADLESS::NO_GL_3_3_CONTEXT" << endl;
+			return false;
+		}
+
+		// OSMesa wants a colour buffer to make current; frames go to the FBO
+		this->buffer.resize((size_t)width * height * 4);
+		if (!OSMesaMakeCurrent(this->context, &this->buffer[0], GL_UNSIGNED_BYTE, width, height))
+		{
+			cout << "ERROR::HEADLESS::MAKE_CURRENT_FAILED" << endl;
+			return false;
+		}
+		return true;
+#else
+		glfwInit();
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+		glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+		glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+
+		this->window = glfwCreateWindow(width, height, "", nullptr, nullptr);
+		if (!this->window)
+		{
+			cout << "ERROR::HEADLESS::NO_GL_3_3_CONTEXT" << endl;
+			return false;
+		}
+		glfwMakeContextCurrent(this->window);
+		return true;
+#endif
+	}
+
+	void Release()
+	{
+#if defined(AR_HEADLESS_EGL)
+		if (this->display == EGL_NO_DISPLAY)
+			return;
+		eglMakeCurrent(this->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		if (this->context != EGL_NO_CONTEXT)
+			eglDestroyContext(this->display, this->context);
+		if (this->surface != EGL_NO_SURFACE)
+			eglDestroySurface(this->display, this->surface);
+		eglTerminate(this->display);
+		this->display = EGL_NO_DISPLAY;
+		this->surface = EGL_NO_SURFACE;
+		this->context = EGL_NO_CONTEXT;
+#elif defined(AR_HEADLESS_OSMESA)
+		if (this->context)
+			OSMesaDestroyContext(this->context);
+		this->context = nullptr;
+#else
+		if (this->window)
+			glfwDestroyWindow(this->window);
+		this->window = nullptr;
+#endif
+	}
+
+private:
+#if defined(AR_HEADLESS_EGL)
+	EGLDisplay display;
+	EGLSurface surface;
+	EGLContext context;
+#elif defined(AR_HEADLESS_OSMESA)
+	OSMesaContext context;
+	vector<unsigned char> buffer;
+#else
+	GLFWwindow* window;
+#endif
+
+	HeadlessContext(const HeadlessContext&);
+	HeadlessContext& operator=(const HeadlessContext&);
+};
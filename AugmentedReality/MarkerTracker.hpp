@@ -0,0 +1,293 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/aruco.hpp>
+#include <opencv2/calib3d/calib3d.hpp>
+
+#include "PyramidDetector.hpp"
+#include "FrameContext.hpp"
+#include "AllocationCounter.h"
+
+using namespace std;
+
+struct TrackerParameters
+{
+	// Run the detector over the whole frame every fullScanInterval frames
+	int fullScanInterval;
+	// Padding around a predicted marker, relative to its size and in pixels
+	float paddingRate;
+	int minPadding;
+	// Disables tracking, every frame is a full scan
+	bool enabled;
+
+	TrackerParameters()
+		: fullScanInterval(15), paddingRate(0.5f), minPadding(16), enabled(true)
+	{
+
+	}
+};
+
+// Region-of-interest tracking front end for cv::aruco::detectMarkers.
+//
+// Marker regions for the next frame are predicted from the corners seen in the
+// last two frames (constant image-space velocity) and, when the board pose is
+// known, from projecting the board markers that should be in view. Detection
+// then runs only inside the padded, merged regions. A full-frame scan is done
+// every fullScanInterval frames, and right away when tracking loses markers.
+// Full scans go through PyramidDetector, regions are small enough to be
+// searched at full resolution. All state is kept in reused containers; output
+// corner vectors come from the caller's CornerPool.
+class MarkerTracker
+{
+public:
+	int FullScans;
+	int TrackedScans;
+
+	MarkerTracker()
+		: FullScans(0), TrackedScans(0), framesSinceFullScan(0), poseValid(false)
+	{
+
+	}
+
+	MarkerTracker(cv::Ptr<cv::aruco::Dictionary> dictionary, cv::Ptr<cv::aruco::DetectorParameters> parameters,
+		TrackerParameters trackerParameters, PyramidParameters pyramidParameters)
+		: FullScans(0), TrackedScans(0), dictionary(dictionary), parameters(parameters), trackerParameters(trackerParameters),
+		fullScanDetector(dictionary, parameters, pyramidParameters), framesSinceFullScan(0), poseValid(false)
+	{
+
+	}
+
+	// Board pose of the frame just processed, used to predict board markers
+	// that are not tracked yet.
+	void SetBoardPose(const cv::Ptr<cv::aruco::Board>& board, cv::InputArray cameraMatrix, cv::InputArray distCoeffs,
+		const cv::Vec3d& rvec, const cv::Vec3d& tvec, bool valid)
+	{
+		this->board = board;
+		this->cameraMatrix = cameraMatrix.getMat();
+		this->distCoeffs = distCoeffs.getMat();
+		this->rvec = rvec;
+		this->tvec = tvec;
+		this->poseValid = valid;
+	}
+
+	void Detect(const cv::Mat& image, vector<vector<cv::Point2f>>& corners, vector<int>& ids, vector<vector<cv::Point2f>>& rejected,
+		CornerPool& pool)
+	{
+		bool fullScan = !this->trackerParameters.enabled
+			|| this->tracked.empty()
+			|| this->framesSinceFullScan >= this->trackerParameters.fullScanInterval;
+
+		if (!fullScan)
+		{
+			this->predictRegions(image.size());
+			this->detectInRegions(image, corners, ids, rejected, pool);
+			this->TrackedScans++;
+
+			// Lost something we were tracking: rescan before reporting
+			if (ids.size() < this->tracked.size())
+				fullScan = true;
+		}
+
+		if (fullScan)
+		{
+			pool.Recycle(corners);
+			pool.Recycle(rejected);
+			this->fullScanDetector.Detect(image, corners, ids, rejected);
+			this->framesSinceFullScan = 0;
+			this->FullScans++;
+		}
+		else
+			this->framesSinceFullScan++;
+
+		this->update(corners, ids);
+	}
+
+	// Regions searched in the last tracked frame, for debugging overlays
+	const vector<cv::Rect>& Regions() const
+	{
+		return this->regions;
+	}
+
+private:
+	cv::Ptr<cv::aruco::Dictionary> dictionary;
+	cv::Ptr<cv::aruco::DetectorParameters> parameters;
+	TrackerParameters trackerParameters;
+	PyramidDetector fullScanDetector;
+
+	int framesSinceFullScan;
+
+	struct TrackedMarker
+	{
+		int id;
+		cv::Point2f corners[4];
+	};
+
+	// Markers of the last frame and of the frame before it, with id -> index
+	// tables sized to the dictionary so lookups stay O(1) on large boards
+	vector<TrackedMarker> tracked;
+	vector<TrackedMarker> previous;
+	vector<int> trackedSlot;
+	vector<int> previousSlot;
+
+	cv::Ptr<cv::aruco::Board> board;
+	cv::Mat cameraMatrix, distCoeffs;
+	cv::Vec3d rvec, tvec;
+	bool poseValid;
+
+	vector<cv::Rect> regions;
+
+	// Scratch space reused every frame
+	vector<cv::Point2f> quad;
+	vector<vector<cv::Point2f>> roiCorners, roiRejected;
+	vector<int> roiIds;
+
+	void update(const vector<vector<cv::Point2f>>& corners, const vector<int>& ids)
+	{
+		if (this->trackedSlot.empty())
+		{
+			this->trackedSlot.assign(this->dictionary->bytesList.rows, -1);
+			this->previousSlot.assign(this->dictionary->bytesList.rows, -1);
+		}
+
+		for (size_t i = 0; i < this->previous.size(); i++)
+			this->previousSlot[this->previous[i].id] = -1;
+
+		this->previous.swap(this->tracked);
+		this->previousSlot.swap(this->trackedSlot);
+
+		this->tracked.clear();
+		for (size_t i = 0; i < ids.size(); i++)
+		{
+			if (ids[i] < 0 || ids[i] >= (int)this->trackedSlot.size() || this->trackedSlot[ids[i]] >= 0)
+				continue;
+
+			TrackedMarker marker;
+			marker.id = ids[i];
+			for (int p = 0; p < 4; p++)
+				marker.corners[p] = corners[i][p];
+			this->trackedSlot[marker.id] = (int)this->tracked.size();
+			this->tracked.push_back(marker);
+		}
+	}
+
+	static const TrackedMarker* find(const vector<TrackedMarker>& markers, const vector<int>& slot, int id)
+	{
+		if (id < 0 || id >= (int)slot.size() || slot[id] < 0)
+			return 0;
+		return &markers[slot[id]];
+	}
+
+	void addRegion(const vector<cv::Point2f>& quad, const cv::Size& imageSize)
+	{
+		cv::Rect box = cv::boundingRect(quad);
+		int pad = max(this->trackerParameters.minPadding, (int)(this->trackerParameters.paddingRate * max(box.width, box.height)));
+		box.x -= pad;
+		box.y -= pad;
+		box.width += 2 * pad;
+		box.height += 2 * pad;
+		box &= cv::Rect(0, 0, imageSize.width, imageSize.height);
+		if (box.area() > 0)
+			this->regions.push_back(box);
+	}
+
+	void predictRegions(const cv::Size& imageSize)
+	{
+		this->regions.clear();
+
+		for (size_t i = 0; i < this->tracked.size(); i++)
+		{
+			const TrackedMarker& marker = this->tracked[i];
+			const TrackedMarker* prev = find(this->previous, this->previousSlot, marker.id);
+
+			this->quad.resize(4);
+			for (int p = 0; p < 4; p++)
+			{
+				this->quad[p] = marker.corners[p];
+				if (prev)
+					this->quad[p] += marker.corners[p] - prev->corners[p];
+			}
+			this->addRegion(this->quad, imageSize);
+		}
+
+		// Board markers that are not tracked but should be visible given the pose
+		if (this->poseValid && !this->board.empty())
+		{
+			for (size_t j = 0; j < this->board->ids.size(); j++)
+			{
+				if (find(this->tracked, this->trackedSlot, this->board->ids[j]))
+					continue;
+
+				{
+					AllocationPause pause;
+					cv::projectPoints(this->board->objPoints[j], this->rvec, this->tvec, this->cameraMatrix, this->distCoeffs, this->quad);
+				}
+
+				cv::Rect box = cv::boundingRect(this->quad);
+				if ((box & cv::Rect(0, 0, imageSize.width, imageSize.height)) == box)
+					this->addRegion(this->quad, imageSize);
+			}
+		}
+
+		this->mergeRegions();
+	}
+
+	// Overlapping regions are merged so no marker is detected twice
+	void mergeRegions()
+	{
+		bool merged = true;
+		while (merged)
+		{
+			merged = false;
+			for (size_t i = 0; i < this->regions.size() && !merged; i++)
+			{
+				for (size_t j = i + 1; j < this->regions.size(); j++)
+				{
+					if ((this->regions[i] & this->regions[j]).area() > 0)
+					{
+						this->regions[i] |= this->regions[j];
+						this->regions.erase(this->regions.begin() + j);
+						merged = true;
+						break;
+					}
+				}
+			}
+		}
+	}
+
+	void detectInRegions(const cv::Mat& image, vector<vector<cv::Point2f>>& corners, vector<int>& ids, vector<vector<cv::Point2f>>& rejected,
+		CornerPool& pool)
+	{
+		pool.Recycle(corners);
+		pool.Recycle(rejected);
+		ids.clear();
+
+		for (size_t r = 0; r < this->regions.size(); r++)
+		{
+			const cv::Rect& roi = this->regions[r];
+			cv::Point2f offset((float)roi.x, (float)roi.y);
+
+			{
+				AllocationPause pause;
+				cv::aruco::detectMarkers(image(roi), this->dictionary, this->roiCorners, this->roiIds, this->parameters, this->roiRejected);
+			}
+
+			for (size_t i = 0; i < this->roiIds.size(); i++)
+			{
+				for (int p = 0; p < 4; p++)
+					this->roiCorners[i][p] += offset;
+				pool.Append(corners, this->roiCorners[i]);
+				ids.push_back(this->roiIds[i]);
+			}
+
+			for (size_t i = 0; i < this->roiRejected.size(); i++)
+			{
+				for (size_t p = 0; p < this->roiRejected[i].size(); p++)
+					this->roiRejected[i][p] += offset;
+				pool.Append(rejected, this->roiRejected[i]);
+			}
+		}
+	}
+};
@@ -5,6 +5,10 @@
 #include <sstream>
 #include <iostream>
 #include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
 
 using namespace std;
 
@@ -25,92 +29,116 @@ struct Vertex
 	glm::vec2 TexCoords;
 };
 
-struct Texture
+// Vertex as the GPU gets it, 16 bytes against Vertex's 32: the position
+// quantised to 16 bits per axis within the model's bounds, the normal
+// octahedral-encoded into two snorm16 and the texture coordinates as half
+// floats.
+struct PackedVertex
 {
-	GLuint id;
-	string type;
-	aiString path;
+	GLushort Position[4];
+	GLshort Normal[2];
+	GLushort TexCoords[2];
 };
 
-class Mesh
+// IEEE half with round to nearest; too large values become infinity
+inline GLushort halfFromFloat(float value)
 {
-public:
-	vector<Vertex> vertices;
-	vector<GLuint> indices;
-	vector<Texture> textures;
-
-	Mesh(vector<Vertex> vertices, vector<GLuint> indices, vector<Texture> textures)
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	uint32_t sign = (bits >> 16) & 0x8000;
+	int exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+	uint32_t mantissa = bits & 0x7fffff;
+
+	if (exponent >= 31)
+		return (GLushort)(sign | 0x7c00 | (((bits >> 23) & 0xff) == 0xff && mantissa ? 0x200 : 0));
+	if (exponent <= 0)
 	{
-		this->vertices = vertices;
-		this->indices = indices;
-		this->textures = textures;
-
-		this->setupMesh();
+		// Subnormal, or zero when even that is too small
+		if (exponent < -10)
+			return (GLushort)sign;
+		mantissa |= 0x800000;
+		int shift = 14 - exponent;
+		uint32_t half = mantissa >> shift;
+		if ((mantissa >> (shift - 1)) & 1)
+			half++;
+		return (GLushort)(sign | half);
 	}
-
-	void Draw(Shader shader)
+	uint32_t half = sign | (exponent << 10) | (mantissa >> 13);
+	// Rounding may carry into the exponent, which is still right
+	if (mantissa & 0x1000)
+		half++;
+	return (GLushort)half;
+}
+
+// Quantises v. Positions map lower..lower + extent to 0..65535.
+inline PackedVertex packVertex(const Vertex& v, const float lower[3], const float extent[3])
+{
+	PackedVertex packed;
+	for (int axis = 0; axis < 3; axis++)
 	{
-		GLuint diffuseNr = 1;
-		GLuint specularNr = 1;
-		for (GLuint i = 0; i < this->textures.size(); i++)
-		{
-			glActiveTexture(GL_TEXTURE0 + i);
-
-			stringstream ss;
-			string number;
-			string name = this->textures[i].type;
-
-			if (name == "texture_diffuse")
-				ss << diffuseNr++;
-			else if (name == "texture_specular")
-				ss << specularNr++;
-
-			number = ss.str();
-
-			glUniform1i(glGetUniformLocation(shader.Program, (name + number).c_str()), i);
-
-			glBindTexture(GL_TEXTURE_2D, this->textures[i].id);
-		}
-
-		glUniform1f(glGetUniformLocation(shader.Program, "material.shininess"), 16.0f);
-
-		glBindVertexArray(this->VAO);
-		glDrawElements(GL_TRIANGLES, this->indices.size(), GL_UNSIGNED_INT, 0);
-		glBindVertexArray(0);
-
-		for (GLuint i = 0; i < this->textures.size(); i++)
-		{
-			glActiveTexture(GL_TEXTURE0 + i);
-			glBindTexture(GL_TEXTURE_2D, 0);
-		}
+		float unit = (v.Position[axis] - lower[axis]) / extent[axis];
+		packed.Position[axis] = (GLushort)(min(max(unit, 0.0f), 1.0f) * 65535.0f + 0.5f);
 	}
+	packed.Position[3] = 0;
 
-private:
-	GLuint VAO, VBO, EBO;
-
-	void setupMesh()
+	// Onto the octahedron |x| + |y| + |z| = 1, the lower half folded over
+	float length = fabs(v.Normal.x) + fabs(v.Normal.y) + fabs(v.Normal.z);
+	float x = length > 0 ? v.Normal.x / length : 0;
+	float y = length > 0 ? v.Normal.y / length : 0;
+	if (v.Normal.z < 0)
 	{
-		glGenVertexArrays(1, &this->VAO);
-		glGenBuffers(1, &this->VBO);
-		glGenBuffers(1, &this->EBO);
+		float foldedX = (1.0f - fabs(y)) * (x >= 0 ? 1.0f : -1.0f);
+		float foldedY = (1.0f - fabs(x)) * (y >= 0 ? 1.0f : -1.0f);
+		x = foldedX;
+		y = foldedY;
+	}
+	packed.Normal[0] = (GLshort)floor(min(max(x, -1.0f), 1.0f) * 32767.0f + 0.5f);
+	packed.Normal[1] = (GLshort)floor(min(max(y, -1.0f), 1.0f) * 32767.0f + 0.5f);
 
-		glBindVertexArray(this->VAO);
-		glBindBuffer(GL_ARRAY_BUFFER, this->VBO);
+	packed.TexCoords[0] = halfFromFloat(v.TexCoords.x);
+	packed.TexCoords[1] = halfFromFloat(v.TexCoords.y);
+	return packed;
+}
+
+struct Texture
+{
+	GLuint id;
+	string type;
+	aiString path;
+};
 
-		glBufferData(GL_ARRAY_BUFFER, this->vertices.size() * sizeof(Vertex), &this->vertices[0], GL_STATIC_DRAW);
+// Attribute layout of PackedVertex in the bound VAO and vertex buffer: 0
+// position in [0, 1], which the shader scales by positionScale and offsets
+// by positionOffset, 1 octahedral normal, 2 texture coordinates
+inline void setupPackedVertexAttributes()
+{
+	glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(PackedVertex), (GLvoid*)offsetof(PackedVertex, Position));
+	glEnableVertexAttribArray(0);
 
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, this->EBO);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, this->indices.size() * sizeof(GLuint), &this->indices[0], GL_STATIC_DRAW);
+	glVertexAttribPointer(1, 2, GL_SHORT, GL_TRUE, sizeof(PackedVertex), (GLvoid*)offsetof(PackedVertex, Normal));
+	glEnableVertexAttribArray(1);
 
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)0);
-		glEnableVertexAttribArray(0);
+	glVertexAttribPointer(2, 2, GL_HALF_FLOAT, GL_FALSE, sizeof(PackedVertex), (GLvoid*)offsetof(PackedVertex, TexCoords));
+	glEnableVertexAttribArray(2);
+}
 
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, Normal));
-		glEnableVertexAttribArray(1);
+// Samplers are named texture_diffuse1, texture_diffuse2, ...,
+// texture_specular1, ... in the order the textures come
+inline void locateSamplers(const Shader& shader, const vector<Texture>& textures, vector<GLint>& locations)
+{
+	GLuint diffuseNr = 1;
+	GLuint specularNr = 1;
+	locations.resize(textures.size());
+	for (GLuint i = 0; i < textures.size(); i++)
+	{
+		stringstream ss;
+		string name = textures[i].type;
 
-		glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, TexCoords));
-		glEnableVertexAttribArray(2);
+		if (name == "texture_diffuse")
+			ss << diffuseNr++;
+		else if (name == "texture_specular")
+			ss << specularNr++;
 
-		glBindVertexArray(0);
+		locations[i] = shader.Uniform(name + ss.str());
 	}
-};
\ No newline at end of file
+}
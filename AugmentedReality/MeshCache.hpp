@@ -0,0 +1,504 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <iostream>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include <GL/glew.h>
+
+#include "Mesh.hpp"
+#include "FileStamp.hpp"
+
+using namespace std;
+
+// Binary cache of an imported model, written next to it the first time Assimp
+// reads it and memory-mapped on every later start.
+//
+// Layout, little-endian, every section 16 byte aligned:
+//   MeshCacheHeader
+//   MeshCacheMesh[meshCount]        ranges into the arrays below
+//   MeshCacheLod[lodCount]          simplified index ranges, by mesh
+//   MeshCacheTexture[textureCount]  texture table, by mesh
+//   PackedVertex[vertexCount]       interleaved, ready for glBufferData
+//   GLushort or GLuint[indexCount]  indexSize bytes each, relative to the
+//                                   mesh's first vertex, each mesh followed
+//                                   by its levels of detail
+//   char[stringBytes]               texture paths
+//
+// The cache is ignored and rewritten when its version differs or the source
+// file's size or modification time no longer match.
+const char MESH_CACHE_MAGIC[4] = { 'A', 'R', 'M', 'C' };
+const uint32_t MESH_CACHE_VERSION = 4;
+
+struct MeshCacheHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t vertexSize;
+	uint32_t meshCount;
+	uint64_t sourceSize;
+	int64_t sourceTime;
+	uint32_t textureCount;
+	uint32_t stringBytes;
+	uint64_t vertexCount;
+	uint64_t indexCount;
+	uint32_t lodCount;
+	uint32_t indexSize;
+	// PackedVertex positions decode to position * scale + offset
+	float positionScale[3];
+	float positionOffset[3];
+	uint32_t reserved[2];
+};
+
+struct MeshCacheMesh
+{
+	uint32_t firstVertex;
+	uint32_t vertexCount;
+	uint32_t firstIndex;
+	uint32_t indexCount;
+	uint32_t firstTexture;
+	uint32_t textureCount;
+	uint32_t firstLod;
+	uint32_t lodCount;
+};
+
+// A coarser index list over the same vertices as its mesh, from the
+// MeshSimplifier. error is how far the surface may have moved, model units.
+struct MeshCacheLod
+{
+	uint32_t firstIndex;
+	uint32_t indexCount;
+	float error;
+	uint32_t reserved;
+};
+
+enum MeshCacheTextureType
+{
+	MESH_TEXTURE_DIFFUSE = 0,
+	MESH_TEXTURE_SPECULAR = 1
+};
+
+struct MeshCacheTexture
+{
+	uint32_t type;
+	uint32_t pathOffset;
+	uint32_t pathLength;
+	uint32_t reserved;
+};
+
+// Pointers into a cache, mapped or still in memory
+struct MeshCacheView
+{
+	uint32_t meshCount;
+	uint64_t vertexCount;
+	uint64_t indexCount;
+	uint32_t lodCount;
+	uint32_t indexSize;
+	const float* positionScale;
+	const float* positionOffset;
+	const MeshCacheMesh* meshes;
+	const MeshCacheLod* lods;
+	const MeshCacheTexture* textures;
+	const PackedVertex* vertices;
+	const void* indices;
+	const char* strings;
+
+	string TexturePath(const MeshCacheTexture& texture) const
+	{
+		return string(this->strings + texture.pathOffset, texture.pathLength);
+	}
+};
+
+inline size_t meshCacheAlign(size_t offset)
+{
+	return (offset + 15) & ~(size_t)15;
+}
+
+// Collects the meshes of an import in full precision, then packs them and
+// writes them out in cache layout
+class MeshCacheBuilder
+{
+public:
+	vector<MeshCacheMesh> meshes;
+	vector<MeshCacheLod> lods;
+	vector<MeshCacheTexture> textures;
+	vector<Vertex> vertices;
+	vector<GLuint> indices;
+	string strings;
+
+	MeshCacheBuilder()
+	{
+		for (int axis = 0; axis < 3; axis++)
+		{
+			this->positionScale[axis] = 1;
+			this->positionOffset[axis] = 0;
+		}
+	}
+
+	// Starts a mesh; its vertices, indices and textures are whatever gets
+	// appended until the next BeginMesh
+	MeshCacheMesh& BeginMesh()
+	{
+		MeshCacheMesh mesh;
+		memset(&mesh, 0, sizeof(mesh));
+		mesh.firstVertex = (uint32_t)this->vertices.size();
+		mesh.firstIndex = (uint32_t)this->indices.size();
+		mesh.firstTexture = (uint32_t)this->textures.size();
+		mesh.firstLod = (uint32_t)this->lods.size();
+		this->meshes.push_back(mesh);
+		return this->meshes.back();
+	}
+
+	void AddTexture(MeshCacheTextureType type, const string& path)
+	{
+		MeshCacheTexture texture;
+		texture.type = type;
+		texture.pathOffset = (uint32_t)this->strings.size();
+		texture.pathLength = (uint32_t)path.size();
+		texture.reserved = 0;
+		this->textures.push_back(texture);
+		this->strings += path;
+		this->meshes.back().textureCount++;
+	}
+
+	// Closes the mesh started last
+	void EndMesh()
+	{
+		MeshCacheMesh& mesh = this->meshes.back();
+		mesh.vertexCount = (uint32_t)this->vertices.size() - mesh.firstVertex;
+		mesh.indexCount = (uint32_t)this->indices.size() - mesh.firstIndex;
+	}
+
+	// Adds a level of detail to the mesh ended last, coarser than the one
+	// before
+	void AddLod(const vector<GLuint>& indices, float error)
+	{
+		MeshCacheLod lod;
+		lod.firstIndex = (uint32_t)this->indices.size();
+		lod.indexCount = (uint32_t)indices.size();
+		lod.error = error;
+		lod.reserved = 0;
+		this->lods.push_back(lod);
+		this->indices.insert(this->indices.end(), indices.begin(), indices.end());
+		this->meshes.back().lodCount++;
+	}
+
+	// Quantises the vertices within the bounds of the whole model, and
+	// narrows the indices to 16 bits when no mesh has more than 65536
+	// vertices. Call once every mesh is in, before View and Write.
+	void Pack()
+	{
+		float lower[3], upper[3];
+		for (int axis = 0; axis < 3; axis++)
+		{
+			lower[axis] = this->vertices.empty() ? 0 : this->vertices[0].Position[axis];
+			upper[axis] = lower[axis];
+		}
+		for (size_t i = 0; i < this->vertices.size(); i++)
+		{
+			for (int axis = 0; axis < 3; axis++)
+			{
+				lower[axis] = min(lower[axis], this->vertices[i].Position[axis]);
+				upper[axis] = max(upper[axis], this->vertices[i].Position[axis]);
+			}
+		}
+		for (int axis = 0; axis < 3; axis++)
+		{
+			this->positionOffset[axis] = lower[axis];
+			this->positionScale[axis] = upper[axis] > lower[axis] ? upper[axis] - lower[axis] : 1.0f;
+		}
+
+		this->packedVertices.resize(this->vertices.size());
+		for (size_t i = 0; i < this->vertices.size(); i++)
+			this->packedVertices[i] = packVertex(this->vertices[i], this->positionOffset, this->positionScale);
+
+		bool narrow = true;
+		for (size_t i = 0; i < this->meshes.size(); i++)
+			narrow = narrow && this->meshes[i].vertexCount <= 65536;
+		this->shortIndices.clear();
+		if (narrow)
+			this->shortIndices.assign(this->indices.begin(), this->indices.end());
+	}
+
+	MeshCacheView View() const
+	{
+		MeshCacheView view;
+		view.meshCount = (uint32_t)this->meshes.size();
+		view.vertexCount = this->vertices.size();
+		view.indexCount = this->indices.size();
+		view.lodCount = (uint32_t)this->lods.size();
+		view.indexSize = this->IndexSize();
+		view.positionScale = this->positionScale;
+		view.positionOffset = this->positionOffset;
+		view.meshes = this->meshes.empty() ? nullptr : &this->meshes[0];
+		view.lods = this->lods.empty() ? nullptr : &this->lods[0];
+		view.textures = this->textures.empty() ? nullptr : &this->textures[0];
+		view.vertices = this->packedVertices.empty() ? nullptr : &this->packedVertices[0];
+		view.indices = this->indexData();
+		view.strings = this->strings.c_str();
+		return view;
+	}
+
+	bool Write(const string& cachePath, const string& sourcePath) const
+	{
+		MeshCacheHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic));
+		header.version = MESH_CACHE_VERSION;
+		header.vertexSize = sizeof(PackedVertex);
+		header.meshCount = (uint32_t)this->meshes.size();
+		header.textureCount = (uint32_t)this->textures.size();
+		header.stringBytes = (uint32_t)this->strings.size();
+		header.vertexCount = this->vertices.size();
+		header.indexCount = this->indices.size();
+		header.lodCount = (uint32_t)this->lods.size();
+		header.indexSize = this->IndexSize();
+		memcpy(header.positionScale, this->positionScale, sizeof(header.positionScale));
+		memcpy(header.positionOffset, this->positionOffset, sizeof(header.positionOffset));
+		if (!fileStamp(sourcePath, header.sourceSize, header.sourceTime))
+			return false;
+
+		// Written under a temporary name so a reader never maps half a file
+		string temporaryPath = cachePath + ".tmp";
+		FILE* file = fopen(temporaryPath.c_str(), "wb");
+		if (!file)
+			return false;
+
+		bool written = writeSection(file, &header, sizeof(header))
+			&& writeSection(file, this->meshes.empty() ? nullptr : &this->meshes[0], this->meshes.size() * sizeof(MeshCacheMesh))
+			&& writeSection(file, this->lods.empty() ? nullptr : &this->lods[0], this->lods.size() * sizeof(MeshCacheLod))
+			&& writeSection(file, this->textures.empty() ? nullptr : &this->textures[0], this->textures.size() * sizeof(MeshCacheTexture))
+			&& writeSection(file, this->packedVertices.empty() ? nullptr : &this->packedVertices[0], this->packedVertices.size() * sizeof(PackedVertex))
+			&& writeSection(file, this->indexData(), this->indices.size() * this->IndexSize())
+			&& writeSection(file, this->strings.data(), this->strings.size());
+		written = fclose(file) == 0 && written;
+
+		remove(cachePath.c_str());
+		if (!written || rename(temporaryPath.c_str(), cachePath.c_str()) != 0)
+		{
+			remove(temporaryPath.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	// Bytes per index once packed
+	uint32_t IndexSize() const
+	{
+		return this->shortIndices.empty() ? sizeof(GLuint) : sizeof(GLushort);
+	}
+
+private:
+	vector<PackedVertex> packedVertices;
+	vector<GLushort> shortIndices;
+	float positionScale[3];
+	float positionOffset[3];
+
+	const void* indexData() const
+	{
+		if (!this->shortIndices.empty())
+			return &this->shortIndices[0];
+		return this->indices.empty() ? nullptr : &this->indices[0];
+	}
+
+	static bool writeSection(FILE* file, const void* data, size_t size)
+	{
+		static const char padding[16] = { 0 };
+		if (size > 0 && fwrite(data, 1, size, file) != size)
+			return false;
+		size_t pad = meshCacheAlign(size) - size;
+		return pad == 0 || fwrite(padding, 1, pad, file) == pad;
+	}
+};
+
+// A cache file mapped read-only. The view stays valid until Close() or
+// destruction; the pages are only read in as glBufferData touches them.
+class MeshCache
+{
+public:
+	MeshCache()
+		: data(nullptr), size(0)
+#ifdef _WIN32
+		, file(INVALID_HANDLE_VALUE), mapping(nullptr)
+#else
+		, file(-1)
+#endif
+	{
+
+	}
+
+	~MeshCache()
+	{
+		this->Close();
+	}
+
+	// Maps cachePath and checks it against sourcePath. False when there is no
+	// cache or it is stale, in which case the model has to be imported again.
+	bool Open(const string& cachePath, const string& sourcePath)
+	{
+		this->Close();
+
+		uint64_t sourceSize;
+		int64_t sourceTime;
+		if (!fileStamp(sourcePath, sourceSize, sourceTime) || !this->mapFile(cachePath))
+			return false;
+
+		if (this->size < sizeof(MeshCacheHeader))
+			return this->reject();
+		const MeshCacheHeader& header = *(const MeshCacheHeader*)this->data;
+		if (memcmp(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic)) != 0
+			|| header.version != MESH_CACHE_VERSION || header.vertexSize != sizeof(PackedVertex)
+			|| (header.indexSize != sizeof(GLushort) && header.indexSize != sizeof(GLuint))
+			|| header.sourceSize != sourceSize || header.sourceTime != sourceTime)
+			return this->reject();
+
+		size_t offset = meshCacheAlign(sizeof(MeshCacheHeader));
+		this->view.meshCount = header.meshCount;
+		this->view.vertexCount = header.vertexCount;
+		this->view.indexCount = header.indexCount;
+		this->view.lodCount = header.lodCount;
+		this->view.indexSize = header.indexSize;
+		this->view.positionScale = header.positionScale;
+		this->view.positionOffset = header.positionOffset;
+		this->view.meshes = (const MeshCacheMesh*)this->section(offset, (size_t)header.meshCount * sizeof(MeshCacheMesh));
+		this->view.lods = (const MeshCacheLod*)this->section(offset, (size_t)header.lodCount * sizeof(MeshCacheLod));
+		this->view.textures = (const MeshCacheTexture*)this->section(offset, (size_t)header.textureCount * sizeof(MeshCacheTexture));
+		this->view.vertices = (const PackedVertex*)this->section(offset, (size_t)header.vertexCount * sizeof(PackedVertex));
+		this->view.indices = this->section(offset, (size_t)header.indexCount * header.indexSize);
+		this->view.strings = this->section(offset, header.stringBytes);
+		if (offset > this->size)
+			return this->reject();
+
+		// Ranges are trusted from here on, so check them once
+		for (uint32_t i = 0; i < header.meshCount; i++)
+		{
+			const MeshCacheMesh& mesh = this->view.meshes[i];
+			if ((uint64_t)mesh.firstVertex + mesh.vertexCount > header.vertexCount
+				|| (uint64_t)mesh.firstIndex + mesh.indexCount > header.indexCount
+				|| (uint64_t)mesh.firstTexture + mesh.textureCount > header.textureCount
+				|| (uint64_t)mesh.firstLod + mesh.lodCount > header.lodCount)
+				return this->reject();
+		}
+		for (uint32_t i = 0; i < header.lodCount; i++)
+		{
+			if ((uint64_t)this->view.lods[i].firstIndex + this->view.lods[i].indexCount > header.indexCount)
+				return this->reject();
+		}
+		for (uint32_t i = 0; i < header.textureCount; i++)
+		{
+			if ((uint64_t)this->view.textures[i].pathOffset + this->view.textures[i].pathLength > header.stringBytes)
+				return this->reject();
+		}
+		return true;
+	}
+
+	const MeshCacheView& View() const
+	{
+		return this->view;
+	}
+
+	void Close()
+	{
+#ifdef _WIN32
+		if (this->data)
+			UnmapViewOfFile(this->data);
+		if (this->mapping)
+			CloseHandle(this->mapping);
+		if (this->file != INVALID_HANDLE_VALUE)
+			CloseHandle(this->file);
+		this->mapping = nullptr;
+		this->file = INVALID_HANDLE_VALUE;
+#else
+		if (this->data)
+			munmap((void*)this->data, this->size);
+		if (this->file >= 0)
+			close(this->file);
+		this->file = -1;
+#endif
+		this->data = nullptr;
+		this->size = 0;
+		memset(&this->view, 0, sizeof(this->view));
+	}
+
+private:
+	const char* data;
+	size_t size;
+	MeshCacheView view;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int file;
+#endif
+
+	MeshCache(const MeshCache&);
+	MeshCache& operator=(const MeshCache&);
+
+	bool mapFile(const string& path)
+	{
+#ifdef _WIN32
+		this->file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+			FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (this->file == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(this->file, &fileSize) || fileSize.QuadPart == 0)
+			return this->reject();
+		this->mapping = CreateFileMappingA(this->file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!this->mapping)
+			return this->reject();
+		this->data = (const char*)MapViewOfFile(this->mapping, FILE_MAP_READ, 0, 0, 0);
+		if (!this->data)
+			return this->reject();
+		this->size = (size_t)fileSize.QuadPart;
+#else
+		this->file = open(path.c_str(), O_RDONLY);
+		if (this->file < 0)
+			return false;
+		struct stat info;
+		if (fstat(this->file, &info) != 0 || info.st_size == 0)
+			return this->reject();
+		void* mapped = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, this->file, 0);
+		if (mapped == MAP_FAILED)
+			return this->reject();
+		this->data = (const char*)mapped;
+		this->size = (size_t)info.st_size;
+#endif
+		return true;
+	}
+
+	// Next section starting at offset, offset moved past it. Past the end of
+	// the file it returns nullptr and Open() rejects the cache.
+	const char* section(size_t& offset, size_t bytes)
+	{
+		const char* start = offset + bytes <= this->size ? this->data + offset : nullptr;
+		offset = start ? meshCacheAlign(offset + bytes) : this->size + 1;
+		return start;
+	}
+
+	bool reject()
+	{
+		this->Close();
+		return false;
+	}
+};
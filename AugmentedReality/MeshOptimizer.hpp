@@ -0,0 +1,268 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "Mesh.hpp"
+
+using namespace std;
+
+// Import-time reordering of a mesh for the GPU. None of it changes what is
+// drawn, only the order: triangles for the post-transform vertex cache and
+// then for overdraw, vertices for fetch locality.
+
+// Tom Forsyth's linear-speed vertex cache optimisation: triangles are emitted
+// greedily by a score favouring vertices in a simulated LRU cache, and
+// vertices with few triangles left, so they are finished off and leave.
+inline void optimizeVertexCache(GLuint* indices, size_t indexCount, size_t vertexCount)
+{
+	static const int CACHE_SIZE = 32;
+	static const float CACHE_DECAY_POWER = 1.5f;
+	static const float LAST_TRIANGLE_SCORE = 0.75f;
+	static const float VALENCE_BOOST_SCALE = 2.0f;
+	static const float VALENCE_BOOST_POWER = 0.5f;
+	// Triangles looked at for a restart when nothing in the cache is left
+	static const size_t RESTART_CANDIDATES = 64;
+
+	size_t triangleCount = indexCount / 3;
+	if (triangleCount < 2)
+		return;
+
+	// Triangles of each vertex, as offsets into one array
+	vector<GLuint> firstTriangle(vertexCount + 1, 0);
+	for (size_t i = 0; i < triangleCount * 3; i++)
+		firstTriangle[indices[i] + 1]++;
+	for (size_t v = 0; v < vertexCount; v++)
+		firstTriangle[v + 1] += firstTriangle[v];
+	vector<GLuint> vertexTriangles(triangleCount * 3);
+	vector<GLuint> remaining(vertexCount, 0);
+	for (size_t i = 0; i < triangleCount * 3; i++)
+	{
+		GLuint v = indices[i];
+		vertexTriangles[firstTriangle[v] + remaining[v]++] = (GLuint)(i / 3);
+	}
+
+	vector<int> cachePosition(vertexCount, -1);
+	vector<float> vertexScore(vertexCount);
+	auto score = [&](GLuint v) -> float
+	{
+		if (remaining[v] == 0)
+			return -1.0f;
+		float result = 0;
+		int position = cachePosition[v];
+		if (position >= 0)
+		{
+			if (position < 3)
+				result = LAST_TRIANGLE_SCORE;
+			else
+				result = pow(1.0f - (position - 3) / (float)(CACHE_SIZE - 3), CACHE_DECAY_POWER);
+		}
+		return result + VALENCE_BOOST_SCALE * pow((float)remaining[v], -VALENCE_BOOST_POWER);
+	};
+	for (size_t v = 0; v < vertexCount; v++)
+		vertexScore[v] = score((GLuint)v);
+
+	vector<GLuint> source(indices, indices + triangleCount * 3);
+	vector<float> triangleScore(triangleCount);
+	vector<bool> emitted(triangleCount, false);
+	for (size_t t = 0; t < triangleCount; t++)
+		triangleScore[t] = vertexScore[source[t * 3]] + vertexScore[source[t * 3 + 1]] + vertexScore[source[t * 3 + 2]];
+
+	vector<GLuint> cache, nextCache;
+	size_t scan = 0;
+	for (size_t output = 0; output < triangleCount; output++)
+	{
+		// Best triangle touching the cache, else the best of the next few left
+		// in input order; searching all of them would make the pass quadratic
+		size_t best = triangleCount;
+		float bestScore = -1;
+		for (size_t c = 0; c < cache.size(); c++)
+		{
+			GLuint v = cache[c];
+			for (GLuint k = firstTriangle[v]; k < firstTriangle[v + 1]; k++)
+			{
+				GLuint t = vertexTriangles[k];
+				if (!emitted[t] && triangleScore[t] > bestScore)
+				{
+					best = t;
+					bestScore = triangleScore[t];
+				}
+			}
+		}
+		if (best == triangleCount)
+		{
+			while (emitted[scan])
+				scan++;
+			best = scan;
+			size_t end = min(triangleCount, scan + RESTART_CANDIDATES);
+			for (size_t t = scan; t < end; t++)
+			{
+				if (!emitted[t] && triangleScore[t] > bestScore)
+				{
+					best = t;
+					bestScore = triangleScore[t];
+				}
+			}
+		}
+
+		emitted[best] = true;
+		const GLuint* corners = &source[best * 3];
+		for (int k = 0; k < 3; k++)
+		{
+			indices[output * 3 + k] = corners[k];
+			remaining[corners[k]]--;
+		}
+
+		// The triangle's vertices move to the front, the rest shift back
+		nextCache.assign(corners, corners + 3);
+		for (size_t c = 0; c < cache.size(); c++)
+		{
+			if (cache[c] != corners[0] && cache[c] != corners[1] && cache[c] != corners[2])
+				nextCache.push_back(cache[c]);
+		}
+		for (size_t c = 0; c < nextCache.size(); c++)
+		{
+			GLuint v = nextCache[c];
+			cachePosition[v] = c < (size_t)CACHE_SIZE ? (int)c : -1;
+			vertexScore[v] = score(v);
+			for (GLuint k = firstTriangle[v]; k < firstTriangle[v + 1]; k++)
+			{
+				GLuint t = vertexTriangles[k];
+				if (!emitted[t])
+					triangleScore[t] = vertexScore[source[t * 3]] + vertexScore[source[t * 3 + 1]] + vertexScore[source[t * 3 + 2]];
+			}
+		}
+		if (nextCache.size() > (size_t)CACHE_SIZE)
+			nextCache.resize(CACHE_SIZE);
+		cache.swap(nextCache);
+	}
+}
+
+// Average cache misses per triangle through a FIFO of cacheSize vertices,
+// 0.5 at best for a large regular mesh, 3 at worst
+inline float vertexCacheMissRatio(const GLuint* indices, size_t indexCount, size_t vertexCount, size_t cacheSize = 16)
+{
+	if (indexCount < 3)
+		return 0;
+	vector<size_t> stamp(vertexCount, 0);
+	size_t misses = 0;
+	for (size_t i = 0; i < indexCount; i++)
+	{
+		GLuint v = indices[i];
+		if (stamp[v] == 0 || misses - stamp[v] + 1 > cacheSize)
+		{
+			misses++;
+			stamp[v] = misses;
+		}
+	}
+	return (float)misses / (indexCount / 3);
+}
+
+// Reorders cache-optimised triangles so that outward-facing parts come
+// first and hide what is behind them from every side, after Sander et al.
+// The order is cut into clusters where a triangle misses the cache
+// completely anyway, so the cache efficiency is kept.
+inline void optimizeOverdraw(GLuint* indices, size_t indexCount, const Vertex* vertices, size_t vertexCount)
+{
+	static const size_t CACHE_SIZE = 16;
+
+	size_t triangleCount = indexCount / 3;
+	if (triangleCount < 2)
+		return;
+
+	vector<size_t> clusterStarts;
+	vector<size_t> stamp(vertexCount, 0);
+	size_t misses = 0;
+	for (size_t t = 0; t < triangleCount; t++)
+	{
+		int triangleMisses = 0;
+		for (int k = 0; k < 3; k++)
+		{
+			GLuint v = indices[t * 3 + k];
+			if (stamp[v] == 0 || misses - stamp[v] + 1 > CACHE_SIZE)
+			{
+				misses++;
+				stamp[v] = misses;
+				triangleMisses++;
+			}
+		}
+		if (t == 0 || triangleMisses == 3)
+			clusterStarts.push_back(t);
+	}
+	clusterStarts.push_back(triangleCount);
+	if (clusterStarts.size() < 3)
+		return;
+
+	// Area-weighted centroid and normal of every cluster and the mesh
+	size_t clusterCount = clusterStarts.size() - 1;
+	vector<glm::vec3> centroids(clusterCount), normals(clusterCount);
+	glm::vec3 meshCentroid(0.0f, 0.0f, 0.0f);
+	float meshArea = 0;
+	for (size_t c = 0; c < clusterCount; c++)
+	{
+		glm::vec3 centroid(0.0f, 0.0f, 0.0f), normal(0.0f, 0.0f, 0.0f);
+		float area = 0;
+		for (size_t t = clusterStarts[c]; t < clusterStarts[c + 1]; t++)
+		{
+			const glm::vec3& a = vertices[indices[t * 3]].Position;
+			const glm::vec3& b = vertices[indices[t * 3 + 1]].Position;
+			const glm::vec3& d = vertices[indices[t * 3 + 2]].Position;
+			glm::vec3 n = glm::cross(b - a, d - a);
+			float triangleArea = glm::length(n) * 0.5f;
+			centroid = centroid + (a + b + d) * (triangleArea / 3.0f);
+			normal = normal + n;
+			area += triangleArea;
+		}
+		meshCentroid = meshCentroid + centroid;
+		meshArea += area;
+		centroids[c] = area > 0 ? centroid * (1.0f / area) : vertices[indices[clusterStarts[c] * 3]].Position;
+		normals[c] = normal;
+	}
+	if (meshArea > 0)
+		meshCentroid = meshCentroid * (1.0f / meshArea);
+
+	vector<pair<float, size_t> > order(clusterCount);
+	for (size_t c = 0; c < clusterCount; c++)
+	{
+		float length = glm::length(normals[c]);
+		float outward = length > 0 ? glm::dot(centroids[c] - meshCentroid, normals[c]) / length : 0;
+		order[c] = make_pair(-outward, c);
+	}
+	stable_sort(order.begin(), order.end());
+
+	vector<GLuint> source(indices, indices + triangleCount * 3);
+	size_t output = 0;
+	for (size_t i = 0; i < clusterCount; i++)
+	{
+		size_t c = order[i].second;
+		for (size_t index = clusterStarts[c] * 3; index < clusterStarts[c + 1] * 3; index++)
+			indices[output++] = source[index];
+	}
+}
+
+// Renumbers vertices in the order the indices first use them, so the GPU
+// reads the vertex buffer front to back, and drops vertices nothing uses.
+// Returns the number of vertices kept.
+inline size_t optimizeVertexFetch(Vertex* vertices, size_t vertexCount, GLuint* indices, size_t indexCount)
+{
+	static const GLuint UNUSED = (GLuint)-1;
+
+	vector<GLuint> remap(vertexCount, UNUSED);
+	vector<Vertex> source(vertices, vertices + vertexCount);
+	GLuint next = 0;
+	for (size_t i = 0; i < indexCount; i++)
+	{
+		GLuint& target = remap[indices[i]];
+		if (target == UNUSED)
+		{
+			target = next++;
+			vertices[target] = source[indices[i]];
+		}
+		indices[i] = target;
+	}
+	return next;
+}
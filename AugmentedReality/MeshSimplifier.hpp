@@ -0,0 +1,405 @@
+#pragma once
+
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <functional>
+#include <cmath>
+#include <cstdint>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "Mesh.hpp"
+
+using namespace std;
+
+// Symmetric 4x4 matrix of the summed squared distances to a set of planes,
+// upper triangle row by row
+struct Quadric
+{
+	double a[10];
+
+	Quadric()
+	{
+		for (int i = 0; i < 10; i++)
+			this->a[i] = 0;
+	}
+
+	// Plane n.p + d = 0 with a unit normal
+	void AddPlane(double nx, double ny, double nz, double d, double weight)
+	{
+		double p[4] = { nx, ny, nz, d };
+		int k = 0;
+		for (int row = 0; row < 4; row++)
+			for (int column = row; column < 4; column++)
+				this->a[k++] += weight * p[row] * p[column];
+	}
+
+	void Add(const Quadric& other)
+	{
+		for (int i = 0; i < 10; i++)
+			this->a[i] += other.a[i];
+	}
+
+	double Error(const glm::vec3& point) const
+	{
+		double x = point.x, y = point.y, z = point.z;
+		const double* q = this->a;
+		double error = q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z + 2 * q[3] * x
+			+ q[4] * y * y + 2 * q[5] * y * z + 2 * q[6] * y
+			+ q[7] * z * z + 2 * q[8] * z
+			+ q[9];
+		return error > 0 ? error : 0;
+	}
+};
+
+// Quadric error edge collapse (Garland and Heckbert) over one mesh's indices.
+//
+// Connectivity is taken from positions, not vertices: a model imported
+// without joining identical vertices gives every triangle its own corners,
+// and meshes split their vertices along texture seams. A collapse moves one
+// position onto a neighbouring one; the corners it moves are given the
+// vertex of the destination position whose texture coordinates are closest,
+// so the vertex buffer never changes and every level is only an index list
+// into it. Open borders and seams add planes at right angles to their edges,
+// which keep the outline in place.
+//
+// Simplify may be called with decreasing targets to get one level after
+// another, each simplified further from the last.
+class MeshSimplifier
+{
+public:
+	MeshSimplifier(const Vertex* vertices, size_t vertexCount, const GLuint* indices, size_t indexCount)
+		: vertices(vertices, vertices + vertexCount), corners(indices, indices + indexCount - indexCount % 3),
+		error(0)
+	{
+		this->weld();
+		this->live = this->corners.size() / 3;
+		this->removed.assign(this->live, false);
+		this->groupTriangles.resize(this->positions.size());
+		for (size_t t = 0; t < this->live; t++)
+		{
+			for (int k = 0; k < 3; k++)
+				this->groupTriangles[this->groupOf[this->corners[t * 3 + k]]].push_back((GLuint)t);
+		}
+		this->collapsed.assign(this->positions.size(), false);
+		this->versions.assign(this->positions.size(), 0);
+		this->addQuadrics();
+
+		for (size_t g = 0; g < this->positions.size(); g++)
+			this->pushEdges((GLuint)g);
+	}
+
+	// Collapses edges, cheapest first, until at most targetIndexCount indices
+	// are left or no edge can go. Returns the error so far, roughly the
+	// largest distance a surface point has moved, in model units.
+	float Simplify(size_t targetIndexCount, vector<GLuint>& result)
+	{
+		while (this->live * 3 > targetIndexCount && !this->heap.empty())
+		{
+			Collapse collapse = this->heap.top();
+			this->heap.pop();
+			if (this->collapsed[collapse.from] || this->collapsed[collapse.to]
+				|| this->versions[collapse.from] != collapse.fromVersion || this->versions[collapse.to] != collapse.toVersion)
+				continue;
+			if (this->collapseEdge(collapse.from, collapse.to))
+				this->error = max(this->error, collapse.cost);
+		}
+
+		result.clear();
+		for (size_t t = 0; t < this->removed.size(); t++)
+		{
+			if (this->removed[t])
+				continue;
+			for (int k = 0; k < 3; k++)
+				result.push_back(this->corners[t * 3 + k]);
+		}
+		return (float)sqrt(this->error);
+	}
+
+private:
+	struct Collapse
+	{
+		double cost;
+		GLuint from;
+		GLuint to;
+		uint32_t fromVersion;
+		uint32_t toVersion;
+
+		bool operator>(const Collapse& other) const
+		{
+			return this->cost > other.cost;
+		}
+	};
+
+	vector<Vertex> vertices;
+	// Three vertex indices per triangle, rewritten as positions collapse
+	vector<GLuint> corners;
+	vector<bool> removed;
+	size_t live;
+
+	// Vertices welded by position into groups
+	vector<GLuint> groupOf;
+	vector<glm::vec3> positions;
+	vector<vector<GLuint> > groupVertices;
+	vector<vector<GLuint> > groupTriangles;
+	vector<Quadric> quadrics;
+	vector<bool> collapsed;
+	// Bumped when a group's quadric changes, to spot outdated heap entries
+	vector<uint32_t> versions;
+
+	priority_queue<Collapse, vector<Collapse>, greater<Collapse> > heap;
+	double error;
+
+	void weld()
+	{
+		vector<GLuint> order(this->vertices.size());
+		for (size_t i = 0; i < order.size(); i++)
+			order[i] = (GLuint)i;
+		const vector<Vertex>& vertices = this->vertices;
+		sort(order.begin(), order.end(), [&vertices](GLuint a, GLuint b)
+		{
+			const glm::vec3& p = vertices[a].Position;
+			const glm::vec3& q = vertices[b].Position;
+			if (p.x != q.x)
+				return p.x < q.x;
+			if (p.y != q.y)
+				return p.y < q.y;
+			return p.z < q.z;
+		});
+
+		this->groupOf.resize(this->vertices.size());
+		for (size_t i = 0; i < order.size(); i++)
+		{
+			const glm::vec3& p = this->vertices[order[i]].Position;
+			const glm::vec3& last = this->positions.empty() ? p : this->positions.back();
+			if (this->positions.empty() || p.x != last.x || p.y != last.y || p.z != last.z)
+			{
+				this->positions.push_back(p);
+				this->groupVertices.push_back(vector<GLuint>());
+			}
+			this->groupOf[order[i]] = (GLuint)this->positions.size() - 1;
+			this->groupVertices.back().push_back(order[i]);
+		}
+	}
+
+	bool sameTexCoords(GLuint a, GLuint b) const
+	{
+		const glm::vec2& p = this->vertices[a].TexCoords;
+		const glm::vec2& q = this->vertices[b].TexCoords;
+		return p.x == q.x && p.y == q.y;
+	}
+
+	glm::vec3 normal(const glm::vec3& a, const glm::vec3& b, const glm::vec3& c) const
+	{
+		return glm::cross(b - a, c - a);
+	}
+
+	void addQuadrics()
+	{
+		this->quadrics.resize(this->positions.size());
+
+		// Triangles using each position edge, to find borders and seams
+		struct Edge
+		{
+			GLuint low, high;
+			GLuint triangle;
+			GLuint lowVertex, highVertex;
+
+			bool operator<(const Edge& other) const
+			{
+				return this->low < other.low || (this->low == other.low && this->high < other.high);
+			}
+		};
+		vector<Edge> edges;
+
+		for (size_t t = 0; t < this->live; t++)
+		{
+			const GLuint* corner = &this->corners[t * 3];
+			glm::vec3 n = this->normal(this->vertices[corner[0]].Position, this->vertices[corner[1]].Position, this->vertices[corner[2]].Position);
+			float length = glm::length(n);
+			if (length > 0)
+			{
+				n = n * (1.0f / length);
+				double d = -glm::dot(n, this->vertices[corner[0]].Position);
+				for (int k = 0; k < 3; k++)
+					this->quadrics[this->groupOf[corner[k]]].AddPlane(n.x, n.y, n.z, d, 1.0);
+			}
+
+			for (int k = 0; k < 3; k++)
+			{
+				GLuint a = corner[k], b = corner[(k + 1) % 3];
+				Edge edge;
+				edge.triangle = (GLuint)t;
+				if (this->groupOf[a] <= this->groupOf[b])
+				{
+					edge.low = this->groupOf[a];
+					edge.high = this->groupOf[b];
+					edge.lowVertex = a;
+					edge.highVertex = b;
+				}
+				else
+				{
+					edge.low = this->groupOf[b];
+					edge.high = this->groupOf[a];
+					edge.lowVertex = b;
+					edge.highVertex = a;
+				}
+				edges.push_back(edge);
+			}
+		}
+		sort(edges.begin(), edges.end());
+
+		for (size_t i = 0; i < edges.size();)
+		{
+			size_t end = i + 1;
+			bool seam = false;
+			while (end < edges.size() && edges[end].low == edges[i].low && edges[end].high == edges[i].high)
+			{
+				seam = seam || !this->sameTexCoords(edges[end].lowVertex, edges[i].lowVertex)
+					|| !this->sameTexCoords(edges[end].highVertex, edges[i].highVertex);
+				end++;
+			}
+			if (end - i == 1 || seam)
+			{
+				for (size_t e = i; e < end; e++)
+					this->addBorderPlane(edges[e]);
+			}
+			i = end;
+		}
+	}
+
+	// Plane through a border edge at right angles to its triangle, weighted
+	// well above the surface planes
+	template <typename Edge>
+	void addBorderPlane(const Edge& edge)
+	{
+		static const double BORDER_WEIGHT = 10.0;
+
+		const GLuint* corner = &this->corners[edge.triangle * 3];
+		glm::vec3 face = this->normal(this->vertices[corner[0]].Position, this->vertices[corner[1]].Position, this->vertices[corner[2]].Position);
+		const glm::vec3& a = this->positions[edge.low];
+		const glm::vec3& b = this->positions[edge.high];
+		glm::vec3 n = glm::cross(b - a, face);
+		float length = glm::length(n);
+		if (length == 0)
+			return;
+		n = n * (1.0f / length);
+		double d = -glm::dot(n, a);
+		this->quadrics[edge.low].AddPlane(n.x, n.y, n.z, d, BORDER_WEIGHT);
+		this->quadrics[edge.high].AddPlane(n.x, n.y, n.z, d, BORDER_WEIGHT);
+	}
+
+	// Queues both directions of every edge around a group
+	void pushEdges(GLuint group)
+	{
+		vector<GLuint>& triangles = this->groupTriangles[group];
+		size_t kept = 0;
+		for (size_t i = 0; i < triangles.size(); i++)
+		{
+			GLuint t = triangles[i];
+			if (this->removed[t])
+				continue;
+			triangles[kept++] = t;
+			for (int k = 0; k < 3; k++)
+			{
+				GLuint other = this->groupOf[this->corners[t * 3 + k]];
+				if (other == group)
+					continue;
+				this->push(group, other);
+				this->push(other, group);
+			}
+		}
+		triangles.resize(kept);
+	}
+
+	void push(GLuint from, GLuint to)
+	{
+		Quadric quadric = this->quadrics[from];
+		quadric.Add(this->quadrics[to]);
+
+		Collapse collapse;
+		collapse.cost = quadric.Error(this->positions[to]);
+		collapse.from = from;
+		collapse.to = to;
+		collapse.fromVersion = this->versions[from];
+		collapse.toVersion = this->versions[to];
+		this->heap.push(collapse);
+	}
+
+	// Vertex of group to standing in for vertex, by texture coordinates
+	GLuint replacement(GLuint vertex, GLuint to) const
+	{
+		const vector<GLuint>& candidates = this->groupVertices[to];
+		const glm::vec2& uv = this->vertices[vertex].TexCoords;
+		GLuint best = candidates[0];
+		float bestDistance = -1;
+		for (size_t i = 0; i < candidates.size(); i++)
+		{
+			const glm::vec2& other = this->vertices[candidates[i]].TexCoords;
+			float du = other.x - uv.x, dv = other.y - uv.y;
+			float distance = du * du + dv * dv;
+			if (bestDistance < 0 || distance < bestDistance)
+			{
+				best = candidates[i];
+				bestDistance = distance;
+			}
+		}
+		return best;
+	}
+
+	// Moves group from onto group to. Refused when a remaining triangle
+	// would turn over.
+	bool collapseEdge(GLuint from, GLuint to)
+	{
+		const vector<GLuint>& triangles = this->groupTriangles[from];
+		const glm::vec3& target = this->positions[to];
+		for (size_t i = 0; i < triangles.size(); i++)
+		{
+			GLuint t = triangles[i];
+			if (this->removed[t])
+				continue;
+			glm::vec3 before[3], after[3];
+			bool shared = false;
+			for (int k = 0; k < 3; k++)
+			{
+				GLuint group = this->groupOf[this->corners[t * 3 + k]];
+				shared = shared || group == to;
+				before[k] = this->positions[group];
+				after[k] = group == from ? target : before[k];
+			}
+			if (shared)
+				continue;
+			if (glm::dot(this->normal(before[0], before[1], before[2]), this->normal(after[0], after[1], after[2])) <= 0)
+				return false;
+		}
+
+		for (size_t i = 0; i < triangles.size(); i++)
+		{
+			GLuint t = triangles[i];
+			if (this->removed[t])
+				continue;
+			GLuint* corner = &this->corners[t * 3];
+			if (this->groupOf[corner[0]] == to || this->groupOf[corner[1]] == to || this->groupOf[corner[2]] == to)
+			{
+				this->removed[t] = true;
+				this->live--;
+				continue;
+			}
+			for (int k = 0; k < 3; k++)
+			{
+				if (this->groupOf[corner[k]] == from)
+					corner[k] = this->replacement(corner[k], to);
+			}
+			this->groupTriangles[to].push_back(t);
+		}
+
+		this->quadrics[to].Add(this->quadrics[from]);
+		this->collapsed[from] = true;
+		this->versions[to]++;
+		this->groupTriangles[from].clear();
+		this->pushEdges(to);
+		return true;
+	}
+};
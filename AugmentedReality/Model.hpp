@@ -2,185 +2,858 @@
 
 #include <vector>
 #include <string>
+#include <algorithm>
 
 #define GLEW_STATIC
 #include <GL/glew.h>
 
-#include <SOIL/SOIL.h>
-
 #include "Shader.h"
 #include "Mesh.hpp"
+#include "MeshCache.hpp"
+#include "TextureCache.hpp"
+#include "Frustum.hpp"
+#include "MeshSimplifier.hpp"
+#include "MeshOptimizer.hpp"
 
 
 #include <assimp/scene.h>
 #include <assimp/Importer.hpp>
 #include <assimp/postprocess.h>
 
-GLint TextureFromFile(const char* path, string directory);
+// Returns at once; the image is decoded and uploaded by the TextureLoader.
+// The texture is shared through the TextureCache, give it back with Release.
+inline GLint TextureFromFile(const char* path, string directory)
+{
+	string filename = string(path);
+	filename = directory + "/" + filename;
+	return TextureCache::Instance().Acquire(filename);
+}
+
+// Index range of one level of detail, and how far its surface may be from
+// the full mesh, in model units
+struct SubMeshLod
+{
+	GLuint firstIndex;
+	GLsizei indexCount;
+	float error;
+};
+
+// A mesh of the model drawn with one material. Level 0 of lods is the full
+// mesh; the others share its vertices.
+struct SubMesh
+{
+	vector<SubMeshLod> lods;
+	GLint baseVertex;
+	GLsizei vertexCount;
+	int material;
+	Bounds bounds;
+};
+
+// Uniforms a material sets, in one program
+struct MaterialLocations
+{
+	GLuint program;
+	vector<GLint> samplers;
+	GLint shininess;
+};
+
+// Textures shared by a group of submeshes, and the ranges to hand
+// glMultiDrawElementsBaseVertex for them
+struct ModelMaterial
+{
+	vector<Texture> textures;
+	vector<int> subMeshes;
+
+	vector<GLsizei> counts;
+	vector<GLvoid*> offsets;
+	vector<GLint> baseVertices;
+	// What is left of them after culling, refilled by every culled Draw
+	vector<GLsizei> visibleCounts;
+	vector<GLvoid*> visibleOffsets;
+	vector<GLint> visibleBaseVertices;
+
+	// Uniform locations in each program drawn with, looked up once
+	vector<MaterialLocations> locations;
+};
 
 class Model
 {
 public:
 	Model()
+		: VAO(0), VBO(0), EBO(0), instanceVBO(0), instanceCapacity(0), occlusionQueries(false), boxVAO(0), visible(0), triangles(0),
+		lodPixels(0), viewportWidth(0), viewportHeight(0),
+		indexType(GL_UNSIGNED_INT), indexSize(sizeof(GLuint))
 	{
 		
 	}
 	Model(GLchar* path)
+		: VAO(0), VBO(0), EBO(0), instanceVBO(0), instanceCapacity(0), occlusionQueries(false), boxVAO(0), visible(0), triangles(0),
+		lodPixels(0), viewportWidth(0), viewportHeight(0),
+		indexType(GL_UNSIGNED_INT), indexSize(sizeof(GLuint))
 	{
 		this->loadModel(path);
 	}
 
-	void Draw(Shader shader)
+	// Every mesh lives in one vertex and one index buffer, so the whole model
+	// is one VAO bind and one multi-draw per material. Textures stay bound
+	// between draws and are only rebound where they differ.
+	void Draw(Shader& shader)
+	{
+		if (!this->VAO)
+			return;
+		this->drawMaterials(shader, false);
+	}
+
+	// Draws the submeshes whose bounds are in the frustum of clip, the
+	// projection, view and model matrices multiplied together. A model out of
+	// view submits nothing at all. Each submesh is drawn at the coarsest level
+	// of detail whose error stays under the SetLodThreshold pixels.
+	//
+	// With occlusion queries on, every visible submesh first rasterises its
+	// box, nearest first, and is then drawn under conditional rendering: the
+	// GPU skips it when none of the box passed the depth test, and the CPU
+	// never waits for the answer.
+	void Draw(Shader& shader, const glm::mat4& clip)
+	{
+		this->visible = 0;
+		this->triangles = 0;
+		Frustum frustum(clip);
+		if (!this->VAO || !frustum.Intersects(this->bounds))
+			return;
+
+		if (this->occlusionQueries)
+		{
+			this->drawOccluded(shader, frustum);
+			return;
+		}
+
+		for (size_t m = 0; m < this->materials.size(); m++)
+		{
+			ModelMaterial& material = this->materials[m];
+			material.visibleCounts.clear();
+			material.visibleOffsets.clear();
+			material.visibleBaseVertices.clear();
+		}
+		for (size_t i = 0; i < this->subMeshes.size(); i++)
+		{
+			const SubMesh& subMesh = this->subMeshes[i];
+			if (!frustum.Intersects(subMesh.bounds))
+				continue;
+			const SubMeshLod& lod = subMesh.lods[this->selectLod(subMesh, frustum)];
+			ModelMaterial& material = this->materials[subMesh.material];
+			material.visibleCounts.push_back(lod.indexCount);
+			material.visibleOffsets.push_back((GLvoid*)(lod.firstIndex * this->indexSize));
+			material.visibleBaseVertices.push_back(subMesh.baseVertex);
+			this->visible++;
+			this->triangles += lod.indexCount / 3;
+		}
+		if (this->visible > 0)
+			this->drawMaterials(shader, true);
+	}
+
+	// Draws count copies of the model, one per model matrix, with a shader
+	// that reads the matrix from attribute 3 (instanced_v.glsl). The matrices
+	// are streamed into a per-model buffer, then every submesh is a single
+	// instanced draw whatever the count.
+	void DrawInstanced(Shader& shader, const glm::mat4* transforms, int count)
+	{
+		this->DrawInstanced(shader, transforms, count, nullptr);
+	}
+
+	// With viewProjection, every copy also gets the coarsest level of detail
+	// that stays under the threshold where it stands. Copies are grouped by
+	// level, which costs one instanced draw per submesh and level in use.
+	void DrawInstanced(Shader& shader, const glm::mat4* transforms, int count, const glm::mat4* viewProjection)
+	{
+		if (!this->VAO || count <= 0)
+			return;
+
+		// Counting sort of the matrices by level
+		int levelCounts[MAX_LODS] = { 0 };
+		int levelStarts[MAX_LODS];
+		this->instanceLevels.resize(count);
+		for (int i = 0; i < count; i++)
+		{
+			int level = viewProjection ? this->selectModelLod(Frustum(*viewProjection * transforms[i])) : 0;
+			this->instanceLevels[i] = level;
+			levelCounts[level]++;
+		}
+		for (int level = 0, start = 0; level < MAX_LODS; level++)
+		{
+			levelStarts[level] = start;
+			start += levelCounts[level];
+		}
+		this->instanceOrder.resize(count);
+		for (int i = 0; i < count; i++)
+			this->instanceOrder[levelStarts[this->instanceLevels[i]]++] = transforms[i];
+
+		glBindBuffer(GL_ARRAY_BUFFER, this->instanceVBO);
+		if (count > this->instanceCapacity)
+			this->instanceCapacity = max(count, 2 * this->instanceCapacity);
+		// Orphans last frame's matrices instead of waiting for the GPU to be
+		// done with them
+		glBufferData(GL_ARRAY_BUFFER, this->instanceCapacity * sizeof(glm::mat4), nullptr, GL_STREAM_DRAW);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, count * sizeof(glm::mat4), &this->instanceOrder[0]);
+
+		this->setDecode(shader);
+		glBindVertexArray(this->VAO);
+
+		GLuint bound[MAX_TEXTURES];
+		for (int i = 0; i < MAX_TEXTURES; i++)
+			bound[i] = (GLuint)-1;
+
+		for (int level = 0, start = 0; level < MAX_LODS; start += levelCounts[level], level++)
+		{
+			if (levelCounts[level] == 0)
+				continue;
+			// GL 3.3 has no base instance: point the matrix attributes at the
+			// level's first matrix instead
+			this->pointInstanceAttributes(start);
+
+			for (size_t m = 0; m < this->materials.size(); m++)
+			{
+				ModelMaterial& material = this->materials[m];
+				if (material.subMeshes.empty())
+					continue;
+				this->bindMaterial(material, shader, bound);
+
+				for (size_t i = 0; i < material.subMeshes.size(); i++)
+				{
+					const SubMesh& subMesh = this->subMeshes[material.subMeshes[i]];
+					const SubMeshLod& lod = subMesh.lods[min(level, (int)subMesh.lods.size() - 1)];
+					glDrawElementsInstancedBaseVertex(GL_TRIANGLES, lod.indexCount, this->indexType,
+						(GLvoid*)(lod.firstIndex * this->indexSize), levelCounts[level], subMesh.baseVertex);
+				}
+			}
+		}
+
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindVertexArray(0);
+		glActiveTexture(GL_TEXTURE0);
+	}
+
+	// Screen-space error allowed for a level of detail, in pixels on a width x
+	// height viewport. Zero always draws the full meshes.
+	void SetLodThreshold(float pixels, int width, int height)
+	{
+		this->lodPixels = pixels;
+		this->viewportWidth = width;
+		this->viewportHeight = height;
+	}
+
+	void SetOcclusionQueries(bool enabled)
+	{
+		this->occlusionQueries = enabled;
+	}
+
+	// Submeshes the last culled Draw let through
+	int Visible() const
 	{
-		for (GLuint i = 0; i < this->meshes.size(); i++)
-			this->meshes[i].Draw(shader);
+		return this->visible;
+	}
+
+	// Triangles the last culled Draw submitted
+	int Triangles() const
+	{
+		return this->triangles;
+	}
+
+	// In model space
+	const Bounds& BoundingBox() const
+	{
+		return this->bounds;
+	}
+
+	int DrawCalls() const
+	{
+		int calls = 0;
+		for (size_t m = 0; m < this->materials.size(); m++)
+			calls += this->materials[m].counts.empty() ? 0 : 1;
+		return calls;
+	}
+
+	// Gives the model's textures back to the TextureCache. Copies of a Model
+	// share its textures, so only one of them releases, while GL is still up.
+	void Release()
+	{
+		for (GLuint i = 0; i < this->textures_loaded.size(); i++)
+			TextureCache::Instance().Release(this->textures_loaded[i].id);
+		this->textures_loaded.clear();
 	}
 
 private:
 
+	static const int MAX_TEXTURES = 16;
+	// Levels of detail per mesh, the full mesh included; each has about half
+	// the triangles of the one before
+	static const int MAX_LODS = 4;
+
 	vector<Texture> textures_loaded;
-	vector<Mesh> meshes;
+	vector<SubMesh> subMeshes;
+	vector<ModelMaterial> materials;
 	string directory;
 
+	GLuint VAO, VBO, EBO;
+
+	// Per-instance model matrices, attributes 3 to 6
+	GLuint instanceVBO;
+	int instanceCapacity;
+
+	Bounds bounds;
+	bool occlusionQueries;
+	// Eight corners per submesh, drawn as the occlusion query proxies
+	GLuint boxVAO, boxVBO, boxEBO;
+	vector<GLuint> queries;
+	vector<pair<float, int> > drawOrder;
+	int visible;
+	int triangles;
+
+	float lodPixels;
+	int viewportWidth, viewportHeight;
+	// Error of each level over all submeshes, for picking one per instance
+	vector<float> lodErrors;
+	vector<int> instanceLevels;
+	vector<glm::mat4> instanceOrder;
+
+	// GL_UNSIGNED_SHORT when every mesh fits, see MeshCacheBuilder::Pack
+	GLenum indexType;
+	GLuint indexSize;
+	float positionScale[3];
+	float positionOffset[3];
+	// positionScale and positionOffset in each program drawn with; the
+	// instanced and plain programs alternate every frame
+	struct DecodeLocations
+	{
+		GLuint program;
+		GLint scale;
+		GLint offset;
+	};
+	vector<DecodeLocations> decodeLocations;
+
+	// Coarsest level of the submesh that keeps under the threshold
+	int selectLod(const SubMesh& subMesh, const Frustum& frustum) const
+	{
+		if (this->lodPixels <= 0 || subMesh.lods.size() < 2)
+			return 0;
+		float pixelsPerUnit = frustum.PixelsPerUnit(subMesh.bounds, this->viewportWidth, this->viewportHeight);
+		int level = 0;
+		while (level + 1 < (int)subMesh.lods.size() && subMesh.lods[level + 1].error * pixelsPerUnit <= this->lodPixels)
+			level++;
+		return level;
+	}
+
+	// The same for the whole model, in the frustum of one instance
+	int selectModelLod(const Frustum& frustum) const
+	{
+		if (this->lodPixels <= 0 || this->lodErrors.size() < 2)
+			return 0;
+		float pixelsPerUnit = frustum.PixelsPerUnit(this->bounds, this->viewportWidth, this->viewportHeight);
+		int level = 0;
+		while (level + 1 < (int)this->lodErrors.size() && this->lodErrors[level + 1] * pixelsPerUnit <= this->lodPixels)
+			level++;
+		return level;
+	}
+
+	// Matrix attributes 3 to 6 start at instance first of the bound buffer
+	void pointInstanceAttributes(int first)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, this->instanceVBO);
+		for (int column = 0; column < 4; column++)
+		{
+			glVertexAttribPointer(3 + column, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4),
+				(GLvoid*)(first * sizeof(glm::mat4) + column * sizeof(glm::vec4)));
+		}
+	}
+
+	void drawMaterials(Shader& shader, bool culled)
+	{
+		this->setDecode(shader);
+		glBindVertexArray(this->VAO);
+
+		GLuint bound[MAX_TEXTURES];
+		for (int i = 0; i < MAX_TEXTURES; i++)
+			bound[i] = (GLuint)-1;
+
+		for (size_t m = 0; m < this->materials.size(); m++)
+		{
+			ModelMaterial& material = this->materials[m];
+			vector<GLsizei>& counts = culled ? material.visibleCounts : material.counts;
+			vector<GLvoid*>& offsets = culled ? material.visibleOffsets : material.offsets;
+			vector<GLint>& baseVertices = culled ? material.visibleBaseVertices : material.baseVertices;
+			if (counts.empty())
+				continue;
+			this->bindMaterial(material, shader, bound);
+
+			glMultiDrawElementsBaseVertex(GL_TRIANGLES, &counts[0], this->indexType, &offsets[0],
+				(GLsizei)counts.size(), &baseVertices[0]);
+		}
+
+		glBindVertexArray(0);
+		glActiveTexture(GL_TEXTURE0);
+	}
+
+	void drawOccluded(Shader& shader, const Frustum& frustum)
+	{
+		if (!this->boxVAO)
+			this->createBoxes();
+
+		this->drawOrder.clear();
+		for (size_t i = 0; i < this->subMeshes.size(); i++)
+		{
+			const Bounds& bounds = this->subMeshes[i].bounds;
+			if (frustum.Intersects(bounds))
+				this->drawOrder.push_back(make_pair(frustum.NearestDepth(bounds), (int)i));
+		}
+		sort(this->drawOrder.begin(), this->drawOrder.end());
+		this->visible = (int)this->drawOrder.size();
+		this->triangles = 0;
+		this->setDecode(shader);
+
+		GLuint bound[MAX_TEXTURES];
+		for (int i = 0; i < MAX_TEXTURES; i++)
+			bound[i] = (GLuint)-1;
+
+		for (size_t k = 0; k < this->drawOrder.size(); k++)
+		{
+			int i = this->drawOrder[k].second;
+			const SubMesh& subMesh = this->subMeshes[i];
+			const SubMeshLod& lod = subMesh.lods[this->selectLod(subMesh, frustum)];
+			this->triangles += lod.indexCount / 3;
+
+			// A box around the eye only shows its far side, which may be
+			// hidden while the mesh is not: draw it as is
+			bool query = this->drawOrder[k].first > 0;
+			if (query)
+			{
+				glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+				glDepthMask(GL_FALSE);
+				glBindVertexArray(this->boxVAO);
+				glBeginQuery(GL_ANY_SAMPLES_PASSED, this->queries[i]);
+				glDrawElementsBaseVertex(GL_TRIANGLES, 36, GL_UNSIGNED_BYTE, 0, i * 8);
+				glEndQuery(GL_ANY_SAMPLES_PASSED);
+				glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+				glDepthMask(GL_TRUE);
+				glBeginConditionalRender(this->queries[i], GL_QUERY_NO_WAIT);
+			}
+
+			glBindVertexArray(this->VAO);
+			this->bindMaterial(this->materials[subMesh.material], shader, bound);
+			glDrawElementsBaseVertex(GL_TRIANGLES, lod.indexCount, this->indexType,
+				(GLvoid*)(lod.firstIndex * this->indexSize), subMesh.baseVertex);
+
+			if (query)
+				glEndConditionalRender();
+		}
+
+		glBindVertexArray(0);
+		glActiveTexture(GL_TEXTURE0);
+	}
+
+	void createBoxes()
+	{
+		static const GLubyte boxIndices[36] = {
+			0, 2, 1, 1, 2, 3,
+			4, 5, 6, 5, 7, 6,
+			0, 1, 4, 1, 5, 4,
+			2, 6, 3, 3, 6, 7,
+			0, 4, 2, 2, 4, 6,
+			1, 3, 5, 3, 7, 5
+		};
+
+		// Corner c takes x, y and z from the upper bound where bits 0, 1 and
+		// 2 of c are set. Packed like the meshes, rounded outwards so the box
+		// still holds its mesh.
+		vector<PackedVertex> corners(this->subMeshes.size() * 8);
+		memset(&corners[0], 0, corners.size() * sizeof(PackedVertex));
+		for (size_t i = 0; i < this->subMeshes.size(); i++)
+		{
+			const Bounds& bounds = this->subMeshes[i].bounds;
+			for (int c = 0; c < 8; c++)
+			{
+				for (int axis = 0; axis < 3; axis++)
+				{
+					bool upper = ((c >> axis) & 1) != 0;
+					float unit = ((upper ? bounds.upper : bounds.lower)[axis] - this->positionOffset[axis]) / this->positionScale[axis] * 65535.0f;
+					unit = upper ? ceil(unit) : floor(unit);
+					corners[i * 8 + c].Position[axis] = (GLushort)min(max(unit, 0.0f), 65535.0f);
+				}
+			}
+		}
+
+		glGenVertexArrays(1, &this->boxVAO);
+		glGenBuffers(1, &this->boxVBO);
+		glGenBuffers(1, &this->boxEBO);
+
+		glBindVertexArray(this->boxVAO);
+		glBindBuffer(GL_ARRAY_BUFFER, this->boxVBO);
+		glBufferData(GL_ARRAY_BUFFER, corners.size() * sizeof(PackedVertex), &corners[0], GL_STATIC_DRAW);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, this->boxEBO);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(boxIndices), boxIndices, GL_STATIC_DRAW);
+		setupPackedVertexAttributes();
+		glBindVertexArray(0);
+
+		this->queries.resize(this->subMeshes.size());
+		glGenQueries((GLsizei)this->queries.size(), &this->queries[0]);
+	}
+
+	// Uniforms turning PackedVertex positions back into model space
+	void setDecode(Shader& shader)
+	{
+		size_t i = 0;
+		while (i < this->decodeLocations.size() && this->decodeLocations[i].program != shader.Program)
+			i++;
+		if (i == this->decodeLocations.size())
+		{
+			DecodeLocations located;
+			located.program = shader.Program;
+			located.scale = shader.Uniform("positionScale");
+			located.offset = shader.Uniform("positionOffset");
+			this->decodeLocations.push_back(located);
+		}
+		glUniform3fv(this->decodeLocations[i].scale, 1, this->positionScale);
+		glUniform3fv(this->decodeLocations[i].offset, 1, this->positionOffset);
+	}
+
+	glm::vec3 decodePosition(const PackedVertex& vertex) const
+	{
+		return glm::vec3(
+			vertex.Position[0] / 65535.0f * this->positionScale[0] + this->positionOffset[0],
+			vertex.Position[1] / 65535.0f * this->positionScale[1] + this->positionOffset[1],
+			vertex.Position[2] / 65535.0f * this->positionScale[2] + this->positionOffset[2]);
+	}
+
+	void bindMaterial(ModelMaterial& material, Shader& shader, GLuint* bound)
+	{
+		size_t l = 0;
+		while (l < material.locations.size() && material.locations[l].program != shader.Program)
+			l++;
+		if (l == material.locations.size())
+		{
+			MaterialLocations located;
+			located.program = shader.Program;
+			locateSamplers(shader, material.textures, located.samplers);
+			located.shininess = shader.Uniform("material.shininess");
+			material.locations.push_back(located);
+		}
+		const MaterialLocations& locations = material.locations[l];
+
+		for (GLuint i = 0; i < material.textures.size() && i < MAX_TEXTURES; i++)
+		{
+			glUniform1i(locations.samplers[i], i);
+			if (bound[i] == material.textures[i].id)
+				continue;
+			glActiveTexture(GL_TEXTURE0 + i);
+			glBindTexture(GL_TEXTURE_2D, material.textures[i].id);
+			bound[i] = material.textures[i].id;
+		}
+		glUniform1f(locations.shininess, 16.0f);
+	}
+
+	// Maps the model's cache when it is current, otherwise imports the model
+	// with Assimp and writes the cache for the next start
 	void loadModel(string path)
 	{
+		this->directory = path.substr(0, path.find_last_of('/'));
+
+		string cachePath = path + ".armesh";
+		MeshCache cache;
+		if (cache.Open(cachePath, path))
+		{
+			this->createMeshes(cache.View());
+			return;
+		}
+
 		Assimp::Importer import;
 
-		const aiScene* scene = import.ReadFile(path, aiProcess_Triangulate | aiProcess_FlipUVs);
+		const aiScene* scene = import.ReadFile(path, aiProcess_Triangulate | aiProcess_JoinIdenticalVertices | aiProcess_FlipUVs);
 
 		if (!scene || scene->mFlags == AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode)
 		{
 			cout << "ERROR::ASSIMP" << import.GetErrorString() << endl;
 			return;
 		}
-		
-		this->directory = path.substr(0, path.find_last_of('/'));
 
-		this->processNode(scene->mRootNode, scene);
+		// Start decoding the textures while the geometry is converted
+		for (GLuint i = 0; i < scene->mNumMaterials; i++)
+		{
+			this->requestMaterialTextures(scene->mMaterials[i], aiTextureType_DIFFUSE, "texture_diffuse");
+			this->requestMaterialTextures(scene->mMaterials[i], aiTextureType_SPECULAR, "texture_specular");
+		}
+
+		MeshCacheBuilder builder;
+		this->processNode(scene->mRootNode, scene, builder);
 
+		builder.Pack();
+		if (!builder.Write(cachePath, path))
+			cout << "ERROR::MODEL::CACHE_NOT_WRITTEN " << cachePath << endl;
+		this->createMeshes(builder.View());
 	}
-	void processNode(aiNode* node, const aiScene* scene)
+	void processNode(aiNode* node, const aiScene* scene, MeshCacheBuilder& builder)
 	{
 		for (GLuint i = 0; i < node->mNumMeshes; i++)
 		{
 			aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
-			this->meshes.push_back(this->processMesh(mesh, scene));
+			this->processMesh(mesh, scene, builder);
 		}
 
 		for (GLuint i = 0; i < node->mNumChildren; i++)
 		{
-			this->processNode(node->mChildren[i], scene);
+			this->processNode(node->mChildren[i], scene, builder);
 		}
 	}
-	Mesh processMesh(aiMesh* mesh, const aiScene* scene)
+	void processMesh(aiMesh* mesh, const aiScene* scene, MeshCacheBuilder& builder)
 	{
-		vector<Vertex> vertices;
-		vector<GLuint> indices;
-		vector<Texture> textures;
+		builder.BeginMesh();
 
+		size_t first = builder.vertices.size();
+		builder.vertices.resize(first + mesh->mNumVertices);
+		Vertex* vertices = &builder.vertices[first];
 		for (GLuint i = 0; i < mesh->mNumVertices; i++)
 		{
-			Vertex vertex;
+			Vertex& vertex = vertices[i];
+			vertex.Position = glm::vec3(mesh->mVertices[i].x, mesh->mVertices[i].y, mesh->mVertices[i].z);
 
-			glm::vec3 v;
-			v.x = mesh->mVertices[i].x;
-			v.y = mesh->mVertices[i].y;
-			v.z = mesh->mVertices[i].z;
-
-			vertex.Position = v;
-
-			v.x = mesh->mNormals[i].x;
-			v.y = mesh->mNormals[i].y;
-			v.z = mesh->mNormals[i].z;
-
-			vertex.Normal = v;
+			if (mesh->mNormals)
+				vertex.Normal = glm::vec3(mesh->mNormals[i].x, mesh->mNormals[i].y, mesh->mNormals[i].z);
+			else
+				vertex.Normal = glm::vec3(0.0f, 0.0f, 0.0f);
 
 			if (mesh->mTextureCoords[0])
-			{
-				glm::vec2 v2;
-				v2.x = mesh->mTextureCoords[0][i].x;
-				v2.y = mesh->mTextureCoords[0][i].y;
-				vertex.TexCoords = v2;
-			}
+				vertex.TexCoords = glm::vec2(mesh->mTextureCoords[0][i].x, mesh->mTextureCoords[0][i].y);
 			else
 				vertex.TexCoords = glm::vec2(0.0f, 0.0f);
-
-			vertices.push_back(vertex);
 		}
 
+		// Triangulated, so faces have three indices; points and lines
+		// Triangulate leaves alone are dropped
+		first = builder.indices.size();
+		builder.indices.resize(first + (size_t)mesh->mNumFaces * 3);
+		size_t count = first;
 		for (GLuint i = 0; i < mesh->mNumFaces; i++)
 		{
-			aiFace face = mesh->mFaces[i];
-			for (GLuint j = 0; j < face.mNumIndices; j++)
-				indices.push_back(face.mIndices[j]);
+			const aiFace& face = mesh->mFaces[i];
+			if (face.mNumIndices != 3)
+				continue;
+			builder.indices[count++] = face.mIndices[0];
+			builder.indices[count++] = face.mIndices[1];
+			builder.indices[count++] = face.mIndices[2];
 		}
+		builder.indices.resize(count);
+
+		aiMaterial* material = scene->mMaterials[mesh->mMaterialIndex];
+		this->addMaterialTextures(material, aiTextureType_DIFFUSE, MESH_TEXTURE_DIFFUSE, builder);
+		this->addMaterialTextures(material, aiTextureType_SPECULAR, MESH_TEXTURE_SPECULAR, builder);
+
+		builder.EndMesh();
+		this->optimizeMesh(builder);
+	}
+
+	// Reorders the mesh just added for the vertex cache, then for overdraw,
+	// adds its levels of detail, and finally orders the vertices by first use
+	// over all levels, which share them
+	void optimizeMesh(MeshCacheBuilder& builder)
+	{
+		MeshCacheMesh& mesh = builder.meshes.back();
+		if (mesh.vertexCount == 0 || mesh.indexCount == 0)
+			return;
 
-		if (mesh -> mMaterialIndex >= 0)
+		optimizeVertexCache(&builder.indices[mesh.firstIndex], mesh.indexCount, mesh.vertexCount);
+		optimizeOverdraw(&builder.indices[mesh.firstIndex], mesh.indexCount, &builder.vertices[mesh.firstVertex], mesh.vertexCount);
+		this->addLods(builder);
+
+		mesh.vertexCount = (uint32_t)optimizeVertexFetch(&builder.vertices[mesh.firstVertex], mesh.vertexCount,
+			&builder.indices[mesh.firstIndex], builder.indices.size() - mesh.firstIndex);
+		builder.vertices.resize(mesh.firstVertex + mesh.vertexCount);
+	}
+
+	// Simplifies the mesh just added, halving its triangles per level. Stops
+	// early when borders and seams leave too little to collapse.
+	void addLods(MeshCacheBuilder& builder)
+	{
+		static const GLuint MIN_LOD_TRIANGLES = 64;
+
+		const MeshCacheMesh& mesh = builder.meshes.back();
+		if (mesh.indexCount < MIN_LOD_TRIANGLES * 3 * 2)
+			return;
+
+		MeshSimplifier simplifier(&builder.vertices[mesh.firstVertex], mesh.vertexCount,
+			&builder.indices[mesh.firstIndex], mesh.indexCount);
+		size_t previous = mesh.indexCount;
+		vector<GLuint> indices;
+		for (int level = 1; level < MAX_LODS; level++)
 		{
-			aiMaterial* material = scene->mMaterials[mesh->mMaterialIndex];
-			vector<Texture> diffuseMaps = this->loadMaterialTextures(material, aiTextureType_DIFFUSE, "texture_diffuse");
-			textures.insert(textures.end(), diffuseMaps.begin(), diffuseMaps.end());
-			vector<Texture> specularMaps = this->loadMaterialTextures(material, aiTextureType_SPECULAR, "texture_specular");
-			textures.insert(textures.end(), specularMaps.begin(), specularMaps.end());
+			size_t target = previous / 2 / 3 * 3;
+			float error = simplifier.Simplify(target, indices);
+			if (indices.size() > previous * 3 / 4 || indices.size() < MIN_LOD_TRIANGLES * 3)
+				break;
+			optimizeVertexCache(&indices[0], indices.size(), mesh.vertexCount);
+			optimizeOverdraw(&indices[0], indices.size(), &builder.vertices[mesh.firstVertex], mesh.vertexCount);
+			builder.AddLod(indices, error);
+			previous = indices.size();
 		}
+	}
 
-		return Mesh(vertices, indices, textures);
+	void addMaterialTextures(aiMaterial* mat, aiTextureType type, MeshCacheTextureType cacheType, MeshCacheBuilder& builder)
+	{
+		for (GLuint i = 0; i < mat->GetTextureCount(type); i++)
+		{
+			aiString str;
+			mat->GetTexture(type, i, &str);
+			builder.AddTexture(cacheType, str.C_Str());
+		}
 	}
 
-	vector<Texture> loadMaterialTextures(aiMaterial* mat, aiTextureType type, string typeName)
+	void requestMaterialTextures(aiMaterial* mat, aiTextureType type, const string& typeName)
 	{
-		vector<Texture> textures;
-		for(GLuint i = 0; i<mat->GetTextureCount(type); i++)
+		for (GLuint i = 0; i < mat->GetTextureCount(type); i++)
 		{
 			aiString str;
 			mat->GetTexture(type, i, &str);
-			GLboolean skip = false;
+			this->loadTexture(str.C_Str(), typeName);
+		}
+	}
 
-			for (GLuint j = 0; j <textures_loaded.size(); j++)
+	void createMeshes(const MeshCacheView& view)
+	{
+		// Every texture is queued before the buffer upload, so decoding runs
+		// alongside it
+		for (uint32_t i = 0; i < view.meshCount; i++)
+		{
+			const MeshCacheMesh& mesh = view.meshes[i];
+			for (uint32_t t = 0; t < mesh.textureCount; t++)
 			{
-				if (textures_loaded[i].path == str)
-				{
-					textures.push_back(textures_loaded[j]);
-					skip = true;
-					break;
+				const MeshCacheTexture& texture = view.textures[mesh.firstTexture + t];
+				this->loadTexture(view.TexturePath(texture), texture.type == MESH_TEXTURE_SPECULAR ? "texture_specular" : "texture_diffuse");
+			}
+		}
 
-				}
+		if (view.vertexCount == 0 || view.indexCount == 0)
+			return;
+
+		// The cache already keeps all meshes back to back, packed, with
+		// indices relative to each mesh's first vertex: upload it as it is
+		for (int axis = 0; axis < 3; axis++)
+		{
+			this->positionScale[axis] = view.positionScale[axis];
+			this->positionOffset[axis] = view.positionOffset[axis];
+		}
+		this->indexSize = view.indexSize;
+		this->indexType = view.indexSize == sizeof(GLushort) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+
+		glGenVertexArrays(1, &this->VAO);
+		glGenBuffers(1, &this->VBO);
+		glGenBuffers(1, &this->EBO);
+
+		glBindVertexArray(this->VAO);
+		glBindBuffer(GL_ARRAY_BUFFER, this->VBO);
+		glBufferData(GL_ARRAY_BUFFER, view.vertexCount * sizeof(PackedVertex), view.vertices, GL_STATIC_DRAW);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, this->EBO);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, view.indexCount * view.indexSize, view.indices, GL_STATIC_DRAW);
+		setupPackedVertexAttributes();
+
+		// A mat4 attribute takes four locations, one column each
+		glGenBuffers(1, &this->instanceVBO);
+		this->pointInstanceAttributes(0);
+		for (int column = 0; column < 4; column++)
+		{
+			glEnableVertexAttribArray(3 + column);
+			glVertexAttribDivisor(3 + column, 1);
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindVertexArray(0);
+
+		for (uint32_t i = 0; i < view.meshCount; i++)
+		{
+			const MeshCacheMesh& mesh = view.meshes[i];
+			if (mesh.vertexCount == 0 || mesh.indexCount == 0)
+				continue;
+
+			vector<Texture> textures;
+			for (uint32_t t = 0; t < mesh.textureCount; t++)
+			{
+				const MeshCacheTexture& texture = view.textures[mesh.firstTexture + t];
+				textures.push_back(this->loadTexture(view.TexturePath(texture),
+					texture.type == MESH_TEXTURE_SPECULAR ? "texture_specular" : "texture_diffuse"));
 			}
 
-			if (!skip)
+			SubMesh subMesh;
+			SubMeshLod full;
+			full.firstIndex = mesh.firstIndex;
+			full.indexCount = mesh.indexCount;
+			full.error = 0;
+			subMesh.lods.push_back(full);
+			for (uint32_t l = 0; l < mesh.lodCount && subMesh.lods.size() < MAX_LODS; l++)
 			{
-				Texture texture;
-				texture.id = TextureFromFile(str.C_Str(), this->directory);
-				texture.type = typeName;
-				texture.path = str;
-				textures.push_back(texture);
+				const MeshCacheLod& cached = view.lods[mesh.firstLod + l];
+				SubMeshLod lod;
+				lod.firstIndex = cached.firstIndex;
+				lod.indexCount = cached.indexCount;
+				lod.error = cached.error;
+				subMesh.lods.push_back(lod);
+			}
+			subMesh.baseVertex = mesh.firstVertex;
+			subMesh.vertexCount = mesh.vertexCount;
+			subMesh.material = this->findMaterial(textures);
+			for (uint32_t v = 0; v < mesh.vertexCount; v++)
+				subMesh.bounds.Add(this->decodePosition(view.vertices[mesh.firstVertex + v]));
+			this->bounds.Add(subMesh.bounds);
+			this->subMeshes.push_back(subMesh);
+
+			ModelMaterial& material = this->materials[subMesh.material];
+			material.subMeshes.push_back((int)this->subMeshes.size() - 1);
+			material.counts.push_back(full.indexCount);
+			material.offsets.push_back((GLvoid*)(full.firstIndex * this->indexSize));
+			material.baseVertices.push_back(subMesh.baseVertex);
+
+			// A submesh with fewer levels keeps drawing its last one
+			for (size_t l = 0; l < subMesh.lods.size(); l++)
+			{
+				if (this->lodErrors.size() <= l)
+					this->lodErrors.push_back(0);
+				this->lodErrors[l] = max(this->lodErrors[l], subMesh.lods[l].error);
+			}
+		}
+		for (size_t l = 1; l < this->lodErrors.size(); l++)
+			this->lodErrors[l] = max(this->lodErrors[l], this->lodErrors[l - 1]);
+	}
+
+	// Index of the material with exactly these textures, added when new
+	int findMaterial(const vector<Texture>& textures)
+	{
+		for (size_t m = 0; m < this->materials.size(); m++)
+		{
+			const vector<Texture>& other = this->materials[m].textures;
+			bool same = other.size() == textures.size();
+			for (size_t i = 0; same && i < textures.size(); i++)
+				same = other[i].id == textures[i].id && other[i].type == textures[i].type;
+			if (same)
+				return (int)m;
+		}
+
+		ModelMaterial material;
+		material.textures = textures;
+		this->materials.push_back(material);
+		return (int)this->materials.size() - 1;
+	}
 
-				this->textures_loaded.push_back(texture);
+	Texture loadTexture(const string& path, const string& typeName)
+	{
+		aiString str(path);
+		for (GLuint j = 0; j < this->textures_loaded.size(); j++)
+		{
+			if (this->textures_loaded[j].path == str)
+			{
+				Texture texture = this->textures_loaded[j];
+				texture.type = typeName;
+				return texture;
 			}
 		}
 
-		return textures;
+		Texture texture;
+		texture.id = TextureFromFile(path.c_str(), this->directory);
+		texture.type = typeName;
+		texture.path = str;
+		this->textures_loaded.push_back(texture);
+		return texture;
 	}
 };
-
-GLint TextureFromFile(const char* path, string directory)
-{
-	string filename = string(path);
-	filename = directory + "/" + filename;
-	GLuint textureID;
-	glGenTextures(1, &textureID);
-	int width, height;
-	unsigned char* image = SOIL_load_image(filename.c_str(), &width, &height, 0, SOIL_LOAD_RGB);
-
-	glBindTexture(GL_TEXTURE_2D, textureID);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-	glGenerateMipmap(GL_TEXTURE_2D);
-
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT );
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR );
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glBindTexture(GL_TEXTURE_2D, 0);
-	SOIL_free_image_data(image);
-	return textureID;
-}
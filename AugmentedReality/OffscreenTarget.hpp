@@ -0,0 +1,187 @@
+#pragma once
+
+#include <iostream>
+
+#include <GL/glew.h>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "FrameSink.hpp"
+
+using namespace std;
+
+// Framebuffer the scene is drawn into when there is no window, read back
+// without stalling.
+//
+// Readback() only queues a glReadPixels into one of a ring of pixel pack
+// buffers and drops a fence after it; Collect() later maps the buffers whose
+// fence has signalled and hands the frames to a sink, bottom-up rows flipped
+// and in BGR like every other image in the app. The CPU keeps drawing while
+// the copies of the previous frames complete.
+class OffscreenTarget
+{
+public:
+	OffscreenTarget()
+		: width(0), height(0), framebuffer(0), colorBuffer(0), depthBuffer(0), next(0)
+	{
+		for (int i = 0; i < SLOTS; i++)
+		{
+			this->packBuffers[i] = 0;
+			this->fences[i] = 0;
+			this->sequences[i] = 0;
+		}
+	}
+
+	~OffscreenTarget()
+	{
+		if (!this->framebuffer)
+			return;
+		for (int i = 0; i < SLOTS; i++)
+		{
+			if (this->fences[i])
+				glDeleteSync(this->fences[i]);
+		}
+		glDeleteBuffers(SLOTS, this->packBuffers);
+		glDeleteRenderbuffers(1, &this->colorBuffer);
+		glDeleteRenderbuffers(1, &this->depthBuffer);
+		glDeleteFramebuffers(1, &this->framebuffer);
+	}
+
+	bool Init(int width, int height)
+	{
+		this->width = width;
+		this->height = height;
+
+		glGenRenderbuffers(1, &this->colorBuffer);
+		glBindRenderbuffer(GL_RENDERBUFFER, this->colorBuffer);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+
+		glGenRenderbuffers(1, &this->depthBuffer);
+		glBindRenderbuffer(GL_RENDERBUFFER, this->depthBuffer);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+		glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+		glGenFramebuffers(1, &this->framebuffer);
+		glBindFramebuffer(GL_FRAMEBUFFER, this->framebuffer);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, this->colorBuffer);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, this->depthBuffer);
+		GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		if (status != GL_FRAMEBUFFER_COMPLETE)
+		{
+			cout << "ERROR::OFFSCREEN::FRAMEBUFFER_INCOMPLETE " << status << endl;
+			return false;
+		}
+
+		glGenBuffers(SLOTS, this->packBuffers);
+		for (int i = 0; i < SLOTS; i++)
+		{
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, this->packBuffers[i]);
+			glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)width * height * 4, nullptr, GL_STREAM_READ);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		return true;
+	}
+
+	void Bind()
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, this->framebuffer);
+		glViewport(0, 0, this->width, this->height);
+	}
+
+	// Queues the copy of what was drawn. When every slot is still in flight
+	// the oldest one is waited for and handed to sink first. Call Collect()
+	// every frame as well, so frames go out as soon as their copy is done.
+	void Readback(unsigned long long sequence, FrameSink& sink)
+	{
+		int slot = this->next;
+		if (this->fences[slot])
+			this->collect(slot, sink, true);
+
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, this->framebuffer);
+		glReadBuffer(GL_COLOR_ATTACHMENT0);
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, this->packBuffers[slot]);
+		glReadPixels(0, 0, this->width, this->height, GL_BGRA, GL_UNSIGNED_BYTE, 0);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+		this->fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		this->sequences[slot] = sequence;
+		this->next = (slot + 1) % SLOTS;
+	}
+
+	// Hands every finished frame to sink, oldest first. With wait, blocks
+	// until all queued frames are out, e.g. before shutting down.
+	int Collect(FrameSink& sink, bool wait)
+	{
+		int collected = 0;
+		for (int i = 0; i < SLOTS; i++)
+		{
+			int slot = (this->next + i) % SLOTS;
+			if (!this->fences[slot])
+				continue;
+			if (!this->collect(slot, sink, wait))
+				break;
+			collected++;
+		}
+		return collected;
+	}
+
+private:
+	static const int SLOTS = 3;
+
+	int width;
+	int height;
+
+	GLuint framebuffer;
+	GLuint colorBuffer;
+	GLuint depthBuffer;
+
+	GLuint packBuffers[SLOTS];
+	GLsync fences[SLOTS];
+	unsigned long long sequences[SLOTS];
+	int next;
+
+	cv::Mat bgr;
+	cv::Mat frame;
+
+	bool collect(int slot, FrameSink& sink, bool wait)
+	{
+		// GL_SYNC_FLUSH_COMMANDS_BIT so the fence is guaranteed to get there.
+		// Waiting means until the copy is done, however long the GPU takes;
+		// the slot is about to be reused.
+		GLuint64 timeout = wait ? 1000000000ull : 0;
+		GLenum state;
+		do
+		{
+			state = glClientWaitSync(this->fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, timeout);
+		} while (wait && state == GL_TIMEOUT_EXPIRED);
+		if (state == GL_WAIT_FAILED)
+		{
+			cout << "ERROR::OFFSCREEN::WAIT_FAILED frame " << this->sequences[slot] << " dropped" << endl;
+			glDeleteSync(this->fences[slot]);
+			this->fences[slot] = 0;
+			return false;
+		}
+		if (state == GL_TIMEOUT_EXPIRED)
+			return false;
+
+		glDeleteSync(this->fences[slot]);
+		this->fences[slot] = 0;
+
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, this->packBuffers[slot]);
+		void* pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, (GLsizeiptr)this->width * this->height * 4, GL_MAP_READ_BIT);
+		if (pixels)
+		{
+			cv::Mat bgra(this->height, this->width, CV_8UC4, pixels);
+			cv::cvtColor(bgra, this->bgr, cv::COLOR_BGRA2BGR);
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+
+			cv::flip(this->bgr, this->frame, 0);
+			sink.Write(this->frame, this->sequences[slot]);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		return true;
+	}
+};
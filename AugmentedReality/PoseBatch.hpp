@@ -0,0 +1,159 @@
+#pragma once
+
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/calib3d/calib3d.hpp>
+
+#include "ThreadPool.hpp"
+#include "PoseTracker.hpp"
+
+using namespace std;
+
+struct PoseResult
+{
+	bool valid;
+	cv::Vec3d rvec, tvec;
+	// RMS reprojection error, pixels
+	double reprojectionError;
+	int iterations;
+};
+
+// Pose solve for every marker group of a frame: boards, controller markers and
+// whatever else is tracked. Groups are filled on the calling thread, then
+// solved in parallel with one task per group. Group storage survives Clear(),
+// so a steady scene does not allocate.
+//
+// A group with an initial guess (the pose tracker's prediction) is refined
+// with a few Gauss-Newton steps. Groups without one, or whose refined guess
+// does not fit the points, start from solvePnP: EPnP for boards, the
+// iterative solver for a single square as estimatePoseSingleMarkers does.
+class PoseBatch
+{
+public:
+	struct Group
+	{
+		vector<cv::Point3f> objPoints;
+		vector<cv::Point2f> imgPoints;
+		bool useExtrinsicGuess;
+		cv::Vec3d rvec, tvec;
+		PoseResult result;
+	};
+
+	PoseBatch()
+		: count(0)
+	{
+
+	}
+
+	void Clear()
+	{
+		this->count = 0;
+	}
+
+	int Size() const
+	{
+		return this->count;
+	}
+
+	// New empty group, returns its index
+	int Add()
+	{
+		if (this->count == (int)this->groups.size())
+			this->groups.push_back(Group());
+
+		Group& group = this->groups[this->count];
+		group.objPoints.clear();
+		group.imgPoints.clear();
+		group.useExtrinsicGuess = false;
+		return this->count++;
+	}
+
+	// Drops the group added last, e.g. when no points were found for it
+	void RemoveLast()
+	{
+		if (this->count > 0)
+			this->count--;
+	}
+
+	// Single square marker with its centre at the origin, corners in aruco order
+	int AddMarker(const vector<cv::Point2f>& corners, float length)
+	{
+		int index = this->Add();
+		Group& group = this->groups[index];
+		float half = length / 2.f;
+		group.objPoints.push_back(cv::Point3f(-half, half, 0));
+		group.objPoints.push_back(cv::Point3f(half, half, 0));
+		group.objPoints.push_back(cv::Point3f(half, -half, 0));
+		group.objPoints.push_back(cv::Point3f(-half, -half, 0));
+		group.imgPoints.assign(corners.begin(), corners.end());
+		return index;
+	}
+
+	Group& At(int index)
+	{
+		return this->groups[index];
+	}
+
+	const PoseResult& Result(int index) const
+	{
+		return this->groups[index].result;
+	}
+
+	void Solve(ThreadPool& pool, const cv::Mat& cameraMatrix, const cv::Mat& distCoeffs)
+	{
+		this->cameraMatrix = cameraMatrix;
+		this->distCoeffs = distCoeffs;
+		pool.ParallelFor(this->count, &PoseBatch::solveTask, this);
+	}
+
+private:
+	static const int MAX_ITERATIONS = 20;
+
+	vector<Group> groups;
+	int count;
+
+	cv::Mat cameraMatrix;
+	cv::Mat distCoeffs;
+
+	static void solveTask(void* context, int index)
+	{
+		PoseBatch* batch = (PoseBatch*)context;
+		batch->solve(batch->groups[index]);
+	}
+
+	void solve(Group& group) const
+	{
+		PoseResult& result = group.result;
+		result.valid = false;
+		result.iterations = 0;
+
+		if (group.objPoints.size() < 4 || group.objPoints.size() != group.imgPoints.size())
+			return;
+
+		const double epsilon = 1e-6;
+		// Pixels, above which a refined guess is treated as wrong
+		const double maxGuessError = 2.0;
+
+		if (group.useExtrinsicGuess)
+		{
+			result.rvec = group.rvec;
+			result.tvec = group.tvec;
+			result.iterations = refinePose(group.objPoints, group.imgPoints, this->cameraMatrix, this->distCoeffs,
+				result.rvec, result.tvec, MAX_ITERATIONS, epsilon, result.reprojectionError);
+			if (result.iterations < MAX_ITERATIONS && result.reprojectionError < maxGuessError)
+			{
+				result.valid = true;
+				return;
+			}
+		}
+
+		int method = group.objPoints.size() > 4 ? cv::SOLVEPNP_EPNP : cv::SOLVEPNP_ITERATIVE;
+		if (!cv::solvePnP(group.objPoints, group.imgPoints, this->cameraMatrix, this->distCoeffs, result.rvec, result.tvec, false, method))
+			return;
+
+		result.iterations += refinePose(group.objPoints, group.imgPoints, this->cameraMatrix, this->distCoeffs,
+			result.rvec, result.tvec, MAX_ITERATIONS, epsilon, result.reprojectionError);
+		result.valid = true;
+	}
+};
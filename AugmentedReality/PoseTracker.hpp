@@ -0,0 +1,286 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/video/tracking.hpp>
+#include <opencv2/calib3d/calib3d.hpp>
+
+using namespace std;
+
+struct PoseTrackerParameters
+{
+	// Measurement noise (std dev) of solvePnP, in board units and radians
+	double translationNoise;
+	double rotationNoise;
+	// White acceleration driving the constant velocity model, per second squared
+	double translationAcceleration;
+	double rotationAcceleration;
+	// Tracking is dropped when no measurement came in for this long, seconds
+	double maxLostTime;
+	// Poses are never extrapolated further than this past the last measurement
+	double maxPrediction;
+
+	PoseTrackerParameters()
+		: translationNoise(5.0), rotationNoise(0.01),
+		translationAcceleration(2000.0), rotationAcceleration(10.0),
+		maxLostTime(0.5), maxPrediction(0.1)
+	{
+
+	}
+};
+
+// Filtered pose with its velocity at a point in time. Small enough to be
+// handed to the render stage, which extrapolates it to display time.
+struct PoseState
+{
+	bool valid;
+	double time;
+	cv::Vec3d rvec, tvec;
+	cv::Vec3d rvecVelocity, tvecVelocity;
+	double maxPrediction;
+
+	PoseState()
+		: valid(false), time(0), maxPrediction(0)
+	{
+
+	}
+
+	bool At(double t, cv::Vec3d& r, cv::Vec3d& tr) const
+	{
+		if (!this->valid)
+			return false;
+		double dt = min(max(t - this->time, 0.0), this->maxPrediction);
+		r = this->rvec + this->rvecVelocity * dt;
+		tr = this->tvec + this->tvecVelocity * dt;
+		return true;
+	}
+};
+
+// Constant velocity Kalman filter over the board pose.
+//
+// State is [t, r, dt/dt, dr/dt] with r a rotation vector. Rotation vectors of
+// a board facing the camera sit near |r| = pi where solvePnP may flip to the
+// equivalent vector on the other side, so every measurement is first moved to
+// the equivalent closest to the prediction.
+class PoseTracker
+{
+public:
+	PoseTracker()
+		: kalman(12, 6, 0, CV_64F), lastTime(0)
+	{
+		this->setup();
+	}
+
+	PoseTracker(PoseTrackerParameters parameters)
+		: parameters(parameters), kalman(12, 6, 0, CV_64F), lastTime(0)
+	{
+		this->setup();
+	}
+
+	bool Tracking() const
+	{
+		return this->state.valid;
+	}
+
+	// Pose extrapolated to time t, used as the initial guess for the solver
+	bool Predict(double t, cv::Vec3d& rvec, cv::Vec3d& tvec) const
+	{
+		if (!this->state.valid || t - this->lastTime > this->parameters.maxLostTime)
+			return false;
+		return this->state.At(t, rvec, tvec);
+	}
+
+	void Correct(double t, const cv::Vec3d& rvec, const cv::Vec3d& tvec)
+	{
+		if (!this->state.valid || t - this->lastTime > this->parameters.maxLostTime)
+		{
+			this->reset(t, rvec, tvec);
+			return;
+		}
+
+		double dt = max(t - this->lastTime, 1e-3);
+		this->setTransition(dt);
+		cv::Mat prediction = this->kalman.predict();
+
+		cv::Vec3d predictedR(prediction.at<double>(3), prediction.at<double>(4), prediction.at<double>(5));
+		cv::Vec3d r = closestEquivalent(rvec, predictedR);
+
+		double* z = this->measurement.ptr<double>();
+		for (int i = 0; i < 3; i++)
+		{
+			z[i] = tvec[i];
+			z[3 + i] = r[i];
+		}
+		this->kalman.correct(this->measurement);
+
+		this->lastTime = t;
+		this->publish(t);
+	}
+
+	// No measurement in this frame
+	void Miss(double t)
+	{
+		if (this->state.valid && t - this->lastTime > this->parameters.maxLostTime)
+			this->state.valid = false;
+	}
+
+	const PoseState& State() const
+	{
+		return this->state;
+	}
+
+private:
+	PoseTrackerParameters parameters;
+	cv::KalmanFilter kalman;
+	cv::Mat measurement;
+	double lastTime;
+	PoseState state;
+
+	void setup()
+	{
+		this->measurement = cv::Mat::zeros(6, 1, CV_64F);
+		this->kalman.measurementMatrix = cv::Mat::zeros(6, 12, CV_64F);
+		for (int i = 0; i < 6; i++)
+			this->kalman.measurementMatrix.at<double>(i, i) = 1;
+
+		this->kalman.measurementNoiseCov = cv::Mat::zeros(6, 6, CV_64F);
+		for (int i = 0; i < 3; i++)
+		{
+			this->kalman.measurementNoiseCov.at<double>(i, i) = this->parameters.translationNoise * this->parameters.translationNoise;
+			this->kalman.measurementNoiseCov.at<double>(3 + i, 3 + i) = this->parameters.rotationNoise * this->parameters.rotationNoise;
+		}
+		this->state.maxPrediction = this->parameters.maxPrediction;
+	}
+
+	void setTransition(double dt)
+	{
+		cv::Mat& F = this->kalman.transitionMatrix;
+		cv::Mat& Q = this->kalman.processNoiseCov;
+		F = cv::Mat::eye(12, 12, CV_64F);
+		Q = cv::Mat::zeros(12, 12, CV_64F);
+
+		for (int i = 0; i < 6; i++)
+		{
+			double a = i < 3 ? this->parameters.translationAcceleration : this->parameters.rotationAcceleration;
+			double q = a * a;
+			F.at<double>(i, 6 + i) = dt;
+			Q.at<double>(i, i) = q * dt * dt * dt * dt / 4;
+			Q.at<double>(i, 6 + i) = q * dt * dt * dt / 2;
+			Q.at<double>(6 + i, i) = q * dt * dt * dt / 2;
+			Q.at<double>(6 + i, 6 + i) = q * dt * dt;
+		}
+	}
+
+	void reset(double t, const cv::Vec3d& rvec, const cv::Vec3d& tvec)
+	{
+		this->kalman.statePost = cv::Mat::zeros(12, 1, CV_64F);
+		this->kalman.errorCovPost = cv::Mat::zeros(12, 12, CV_64F);
+		for (int i = 0; i < 3; i++)
+		{
+			this->kalman.statePost.at<double>(i) = tvec[i];
+			this->kalman.statePost.at<double>(3 + i) = rvec[i];
+			this->kalman.errorCovPost.at<double>(i, i) = this->parameters.translationNoise * this->parameters.translationNoise;
+			this->kalman.errorCovPost.at<double>(3 + i, 3 + i) = this->parameters.rotationNoise * this->parameters.rotationNoise;
+			// Unknown velocity: about what one frame of full acceleration gives
+			this->kalman.errorCovPost.at<double>(6 + i, 6 + i) = this->parameters.translationAcceleration * this->parameters.translationAcceleration;
+			this->kalman.errorCovPost.at<double>(9 + i, 9 + i) = this->parameters.rotationAcceleration * this->parameters.rotationAcceleration;
+		}
+		this->lastTime = t;
+		this->publish(t);
+	}
+
+	void publish(double t)
+	{
+		const double* x = this->kalman.statePost.ptr<double>();
+		this->state.valid = true;
+		this->state.time = t;
+		this->state.tvec = cv::Vec3d(x[0], x[1], x[2]);
+		this->state.rvec = cv::Vec3d(x[3], x[4], x[5]);
+		this->state.tvecVelocity = cv::Vec3d(x[6], x[7], x[8]);
+		this->state.rvecVelocity = cv::Vec3d(x[9], x[10], x[11]);
+	}
+
+	// r and r - 2 pi r / |r| describe the same rotation; keep the one nearest to reference
+	static cv::Vec3d closestEquivalent(const cv::Vec3d& r, const cv::Vec3d& reference)
+	{
+		double angle = cv::norm(r);
+		if (angle < 1e-9)
+			return r;
+
+		cv::Vec3d axis = r * (1.0 / angle);
+		cv::Vec3d best = r;
+		double bestDistance = cv::norm(r - reference);
+		for (int k = -2; k <= 2; k++)
+		{
+			cv::Vec3d candidate = axis * (angle + 2 * CV_PI * k);
+			double distance = cv::norm(candidate - reference);
+			if (distance < bestDistance)
+			{
+				best = candidate;
+				bestDistance = distance;
+			}
+		}
+		return best;
+	}
+};
+
+// Gauss-Newton refinement of a pose on the reprojection error, starting from
+// rvec/tvec. Returns the number of iterations used; rms receives the final
+// reprojection error in pixels. With a good initial guess (the tracker's
+// prediction) it typically converges in one or two iterations.
+inline int refinePose(const vector<cv::Point3f>& objPoints, const vector<cv::Point2f>& imgPoints,
+	cv::InputArray cameraMatrix, cv::InputArray distCoeffs, cv::Vec3d& rvec, cv::Vec3d& tvec,
+	int maxIterations, double epsilon, double& rms)
+{
+	vector<cv::Point2f> projected;
+	cv::Mat jacobian;
+	cv::Mat JtJ(6, 6, CV_64F), Jte(6, 1, CV_64F), delta;
+
+	int iteration = 0;
+	for (; iteration < maxIterations; iteration++)
+	{
+		cv::projectPoints(objPoints, rvec, tvec, cameraMatrix, distCoeffs, projected, jacobian);
+
+		JtJ = cv::Scalar(0);
+		Jte = cv::Scalar(0);
+		for (size_t i = 0; i < projected.size(); i++)
+		{
+			cv::Point2f e = imgPoints[i] - projected[i];
+			const double* jx = jacobian.ptr<double>((int)(2 * i));
+			const double* jy = jacobian.ptr<double>((int)(2 * i + 1));
+			for (int a = 0; a < 6; a++)
+			{
+				Jte.at<double>(a) += jx[a] * e.x + jy[a] * e.y;
+				for (int b = 0; b < 6; b++)
+					JtJ.at<double>(a, b) += jx[a] * jx[b] + jy[a] * jy[b];
+			}
+		}
+
+		if (!cv::solve(JtJ, Jte, delta, cv::DECOMP_CHOLESKY))
+			break;
+
+		const double* d = delta.ptr<double>();
+		rvec += cv::Vec3d(d[0], d[1], d[2]);
+		tvec += cv::Vec3d(d[3], d[4], d[5]);
+
+		if (cv::norm(delta) < epsilon)
+		{
+			iteration++;
+			break;
+		}
+	}
+
+	cv::projectPoints(objPoints, rvec, tvec, cameraMatrix, distCoeffs, projected);
+	double sum = 0;
+	for (size_t i = 0; i < projected.size(); i++)
+	{
+		cv::Point2f e = imgPoints[i] - projected[i];
+		sum += e.x * e.x + e.y * e.y;
+	}
+	rms = projected.empty() ? 0 : sqrt(sum / projected.size());
+
+	return iteration;
+}
@@ -0,0 +1,318 @@
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+using namespace std;
+
+// Lock-free latency histogram with HDR style log-linear buckets: 32 buckets
+// per power of two, so any recorded value is known to within about 3%, from
+// nanoseconds up to about a minute. Any thread may record at any time;
+// readers take a copy of the counts.
+class LatencyHistogram
+{
+public:
+	static const int SUB_BITS = 5;
+	static const int SUB_BUCKETS = 1 << SUB_BITS;
+	static const int BUCKETS = SUB_BUCKETS * 34;
+
+	struct Counts
+	{
+		unsigned long long bucket[BUCKETS];
+		unsigned long long total;
+		unsigned long long max;
+	};
+
+	LatencyHistogram()
+		: max(0)
+	{
+		for (int i = 0; i < BUCKETS; i++)
+			this->bucket[i].store(0, memory_order_relaxed);
+	}
+
+	void Record(unsigned long long nanoseconds)
+	{
+		this->bucket[index(nanoseconds)].fetch_add(1, memory_order_relaxed);
+
+		unsigned long long previous = this->max.load(memory_order_relaxed);
+		while (nanoseconds > previous && !this->max.compare_exchange_weak(previous, nanoseconds, memory_order_relaxed));
+	}
+
+	void Read(Counts& counts) const
+	{
+		counts.total = 0;
+		for (int i = 0; i < BUCKETS; i++)
+		{
+			counts.bucket[i] = this->bucket[i].load(memory_order_relaxed);
+			counts.total += counts.bucket[i];
+		}
+		counts.max = this->max.load(memory_order_relaxed);
+	}
+
+	// counts -= earlier, for statistics over a window
+	static void Subtract(Counts& counts, const Counts& earlier)
+	{
+		counts.total = 0;
+		for (int i = 0; i < BUCKETS; i++)
+		{
+			counts.bucket[i] -= earlier.bucket[i];
+			counts.total += counts.bucket[i];
+		}
+	}
+
+	// Value below which the fraction p of the samples lie, nanoseconds
+	static double Percentile(const Counts& counts, double p)
+	{
+		if (counts.total == 0)
+			return 0;
+
+		unsigned long long rank = (unsigned long long)(p * counts.total);
+		if (rank >= counts.total)
+			rank = counts.total - 1;
+
+		unsigned long long seen = 0;
+		for (int i = 0; i < BUCKETS; i++)
+		{
+			seen += counts.bucket[i];
+			if (seen > rank)
+				return middle(i);
+		}
+		return middle(BUCKETS - 1);
+	}
+
+	static double Mean(const Counts& counts)
+	{
+		if (counts.total == 0)
+			return 0;
+
+		double sum = 0;
+		for (int i = 0; i < BUCKETS; i++)
+			sum += counts.bucket[i] * middle(i);
+		return sum / counts.total;
+	}
+
+private:
+	atomic<unsigned long long> bucket[BUCKETS];
+	atomic<unsigned long long> max;
+
+	static int index(unsigned long long value)
+	{
+		if (value < 2 * SUB_BUCKETS)
+			return (int)value;
+
+		int msb = 0;
+		for (unsigned long long v = value; v > 1; v >>= 1)
+			msb++;
+
+		int shift = msb - SUB_BITS;
+		int i = SUB_BUCKETS * (shift + 1) + (int)((value >> shift) - SUB_BUCKETS);
+		return i < BUCKETS ? i : BUCKETS - 1;
+	}
+
+	static double middle(int index)
+	{
+		if (index < 2 * SUB_BUCKETS)
+			return index;
+
+		int shift = index / SUB_BUCKETS - 1;
+		double low = (double)((unsigned long long)(index % SUB_BUCKETS + SUB_BUCKETS) << shift);
+		return low + ((1ull << shift) - 1) * 0.5;
+	}
+};
+
+// Named per-stage latency histograms. Stages are registered once at start-up,
+// before the threads that record into them exist; recording is lock-free.
+class Profiler
+{
+public:
+	static const int MAX_STAGES = 32;
+
+	static Profiler& Instance()
+	{
+		static Profiler profiler;
+		return profiler;
+	}
+
+	// Returns the id of the stage called name, registering it if needed
+	int Stage(const char* name)
+	{
+		for (int i = 0; i < this->stageCount; i++)
+		{
+			if (this->names[i] == name)
+				return i;
+		}
+		if (this->stageCount == MAX_STAGES)
+			return MAX_STAGES - 1;
+
+		this->names[this->stageCount] = name;
+		return this->stageCount++;
+	}
+
+	int Stages() const
+	{
+		return this->stageCount;
+	}
+
+	const char* Name(int stage) const
+	{
+		return this->names[stage].c_str();
+	}
+
+	void Record(int stage, unsigned long long nanoseconds)
+	{
+		this->histograms[stage].Record(nanoseconds);
+	}
+
+	const LatencyHistogram& Histogram(int stage) const
+	{
+		return this->histograms[stage];
+	}
+
+	bool WriteCSV(const char* path) const
+	{
+		FILE* file = fopen(path, "w");
+		if (!file)
+			return false;
+
+		LatencyHistogram::Counts counts;
+		fprintf(file, "stage,count,mean_ms,p50_ms,p90_ms,p99_ms,max_ms\n");
+		for (int i = 0; i < this->stageCount; i++)
+		{
+			this->histograms[i].Read(counts);
+			fprintf(file, "%s,%llu,%.4f,%.4f,%.4f,%.4f,%.4f\n", this->names[i].c_str(), counts.total,
+				LatencyHistogram::Mean(counts) * 1e-6,
+				LatencyHistogram::Percentile(counts, 0.50) * 1e-6,
+				LatencyHistogram::Percentile(counts, 0.90) * 1e-6,
+				LatencyHistogram::Percentile(counts, 0.99) * 1e-6,
+				counts.max * 1e-6);
+		}
+
+		fclose(file);
+		return true;
+	}
+
+	bool WriteJSON(const char* path) const
+	{
+		FILE* file = fopen(path, "w");
+		if (!file)
+			return false;
+
+		LatencyHistogram::Counts counts;
+		fprintf(file, "{\n  \"stages\": [\n");
+		for (int i = 0; i < this->stageCount; i++)
+		{
+			this->histograms[i].Read(counts);
+			fprintf(file, "    { \"stage\": \"%s\", \"count\": %llu, \"mean_ms\": %.4f, \"p50_ms\": %.4f, \"p90_ms\": %.4f, \"p99_ms\": %.4f, \"max_ms\": %.4f }%s\n",
+				this->names[i].c_str(), counts.total,
+				LatencyHistogram::Mean(counts) * 1e-6,
+				LatencyHistogram::Percentile(counts, 0.50) * 1e-6,
+				LatencyHistogram::Percentile(counts, 0.90) * 1e-6,
+				LatencyHistogram::Percentile(counts, 0.99) * 1e-6,
+				counts.max * 1e-6,
+				i + 1 < this->stageCount ? "," : "");
+		}
+		fprintf(file, "  ]\n}\n");
+
+		fclose(file);
+		return true;
+	}
+
+private:
+	string names[MAX_STAGES];
+	LatencyHistogram histograms[MAX_STAGES];
+	int stageCount;
+
+	Profiler()
+		: stageCount(0)
+	{
+
+	}
+
+	Profiler(const Profiler&);
+	Profiler& operator=(const Profiler&);
+};
+
+// Times its own scope into a profiler stage
+class ScopedTimer
+{
+public:
+	explicit ScopedTimer(int stage)
+		: stage(stage), start(chrono::steady_clock::now())
+	{
+
+	}
+
+	~ScopedTimer()
+	{
+		Profiler::Instance().Record(this->stage,
+			chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - this->start).count());
+	}
+
+private:
+	int stage;
+	chrono::steady_clock::time_point start;
+};
+
+// p50/p99 of every stage over the last second, drawn into a frame
+class ProfilerOverlay
+{
+public:
+	ProfilerOverlay()
+		: windowStart(chrono::steady_clock::now()), stages(0)
+	{
+
+	}
+
+	void Draw(cv::Mat& image)
+	{
+		Profiler& profiler = Profiler::Instance();
+
+		if (chrono::steady_clock::now() - this->windowStart >= chrono::seconds(1))
+		{
+			this->windowStart = chrono::steady_clock::now();
+			this->stages = profiler.Stages();
+			if (!this->current)
+			{
+				this->current.reset(new LatencyHistogram::Counts[Profiler::MAX_STAGES]);
+				this->previous.reset(new LatencyHistogram::Counts[Profiler::MAX_STAGES]);
+				memset(this->previous.get(), 0, sizeof(LatencyHistogram::Counts) * Profiler::MAX_STAGES);
+			}
+
+			for (int i = 0; i < this->stages; i++)
+			{
+				profiler.Histogram(i).Read(this->current[i]);
+				LatencyHistogram::Counts window = this->current[i];
+				LatencyHistogram::Subtract(window, this->previous[i]);
+				this->previous[i] = this->current[i];
+
+				snprintf(this->lines[i], sizeof(this->lines[i]), "%-20s p50 %7.2f  p99 %7.2f ms", profiler.Name(i),
+					LatencyHistogram::Percentile(window, 0.50) * 1e-6,
+					LatencyHistogram::Percentile(window, 0.99) * 1e-6);
+			}
+		}
+
+		int lineHeight = 18;
+		cv::Point origin(10, 20);
+		for (int i = 0; i < this->stages; i++)
+		{
+			cv::Point position = origin + cv::Point(0, i * lineHeight);
+			cv::putText(image, this->lines[i], position + cv::Point(1, 1), cv::FONT_HERSHEY_PLAIN, 1.0, cv::Scalar(0, 0, 0));
+			cv::putText(image, this->lines[i], position, cv::FONT_HERSHEY_PLAIN, 1.0, cv::Scalar(0, 255, 0));
+		}
+	}
+
+private:
+	chrono::steady_clock::time_point windowStart;
+	int stages;
+	char lines[Profiler::MAX_STAGES][80];
+
+	unique_ptr<LatencyHistogram::Counts[]> current;
+	unique_ptr<LatencyHistogram::Counts[]> previous;
+};
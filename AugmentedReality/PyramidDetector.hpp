@@ -0,0 +1,118 @@
+#pragma once
+
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/aruco.hpp>
+
+#include "AllocationCounter.h"
+
+using namespace std;
+
+struct PyramidParameters
+{
+	// Number of pyrDown levels before detection, 0 detects at full resolution
+	int levels;
+	// cornerSubPix half window at full resolution, per unit of level scale
+	int refineWindow;
+	int refineMaxIterations;
+	double refineEpsilon;
+
+	PyramidParameters()
+		: levels(0), refineWindow(2), refineMaxIterations(30), refineEpsilon(0.01)
+	{
+
+	}
+};
+
+// Coarse-to-fine marker detection for high resolution input. Candidates are
+// found and decoded on a downscaled pyramid level, which is where the adaptive
+// thresholding cost goes away, then only the corners of the accepted markers
+// are refined with cornerSubPix on the full resolution image.
+class PyramidDetector
+{
+public:
+	PyramidDetector()
+	{
+
+	}
+
+	PyramidDetector(cv::Ptr<cv::aruco::Dictionary> dictionary, cv::Ptr<cv::aruco::DetectorParameters> parameters, PyramidParameters pyramidParameters)
+		: dictionary(dictionary), parameters(parameters), pyramidParameters(pyramidParameters)
+	{
+
+	}
+
+	void Detect(const cv::Mat& image, vector<vector<cv::Point2f>>& corners, vector<int>& ids, vector<vector<cv::Point2f>>& rejected)
+	{
+		// aruco and the pyramid levels allocate internally; our buffers are members
+		AllocationPause pause;
+
+		if (this->pyramidParameters.levels <= 0)
+		{
+			cv::aruco::detectMarkers(image, this->dictionary, corners, ids, this->parameters, rejected);
+			return;
+		}
+
+		const cv::Mat* level = &image;
+		for (int l = 0; l < this->pyramidParameters.levels; l++)
+		{
+			cv::pyrDown(*level, this->pyramid[l % 2]);
+			level = &this->pyramid[l % 2];
+		}
+
+		cv::aruco::detectMarkers(*level, this->dictionary, corners, ids, this->parameters, rejected);
+
+		// Exact for every size: pyrDown rounds odd sizes up, so the ratio of
+		// the sizes is not the factor
+		float scale = (float)(1 << this->pyramidParameters.levels);
+
+		for (size_t i = 0; i < corners.size(); i++)
+			this->upscale(corners[i], scale);
+		for (size_t i = 0; i < rejected.size(); i++)
+			this->upscale(rejected[i], scale);
+
+		if (corners.empty())
+			return;
+
+		if (image.channels() == 1)
+			this->gray = image;
+		else
+			cv::cvtColor(image, this->gray, cv::COLOR_BGR2GRAY);
+
+		this->points.clear();
+		for (size_t i = 0; i < corners.size(); i++)
+			this->points.insert(this->points.end(), corners[i].begin(), corners[i].end());
+
+		int window = max(1, (int)(this->pyramidParameters.refineWindow * scale));
+		cv::cornerSubPix(this->gray, this->points, cv::Size(window, window), cv::Size(-1, -1),
+			cv::TermCriteria(cv::TermCriteria::MAX_ITER | cv::TermCriteria::EPS,
+				this->pyramidParameters.refineMaxIterations, this->pyramidParameters.refineEpsilon));
+
+		for (size_t i = 0; i < corners.size(); i++)
+			for (int p = 0; p < 4; p++)
+				corners[i][p] = this->points[i * 4 + p];
+	}
+
+private:
+	cv::Ptr<cv::aruco::Dictionary> dictionary;
+	cv::Ptr<cv::aruco::DetectorParameters> parameters;
+	PyramidParameters pyramidParameters;
+
+	cv::Mat pyramid[2];
+	cv::Mat gray;
+	vector<cv::Point2f> points;
+
+	// Level coordinates to full resolution. pyrDown centres output pixel i on
+	// input pixel 2i, so with pixel centres at integers the mapping is a plain
+	// scale; the area-resize half-pixel offset does not apply.
+	void upscale(vector<cv::Point2f>& quad, float scale)
+	{
+		for (size_t p = 0; p < quad.size(); p++)
+		{
+			quad[p].x *= scale;
+			quad[p].y *= scale;
+		}
+	}
+};
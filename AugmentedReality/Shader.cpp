@@ -78,6 +78,7 @@ Shader::Shader(const GLchar* vertexPath, const GLchar* fragmentPath)
 	glDeleteShader(vertex);
 	glDeleteShader(fragment);
 
+	this->reflect();
 }
 
 void Shader::Use()
@@ -85,5 +86,40 @@ void Shader::Use()
 	glUseProgram(this->Program);
 }
 
+GLint Shader::Uniform(const std::string& name) const
+{
+	std::map<std::string, GLint>::const_iterator found = this->uniforms.find(name);
+	return found == this->uniforms.end() ? -1 : found->second;
+}
+
+void Shader::reflect()
+{
+	GLint count = 0, maxLength = 0;
+	glGetProgramiv(this->Program, GL_ACTIVE_UNIFORMS, &count);
+	glGetProgramiv(this->Program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+
+	std::string name(maxLength > 0 ? maxLength : 1, '\0');
+	for (GLint i = 0; i < count; i++)
+	{
+		GLsizei length = 0;
+		GLint size;
+		GLenum type;
+		glGetActiveUniform(this->Program, i, (GLsizei)name.size(), &length, &size, &type, &name[0]);
+		std::string uniform = name.substr(0, length);
+
+		// Uniforms inside blocks have no location
+		GLint location = glGetUniformLocation(this->Program, uniform.c_str());
+		if (location < 0)
+			continue;
+		this->uniforms[uniform] = location;
+		if (uniform.size() > 3 && uniform.compare(uniform.size() - 3, 3, "[0]") == 0)
+			this->uniforms[uniform.substr(0, uniform.size() - 3)] = location;
+	}
+
+	GLuint camera = glGetUniformBlockIndex(this->Program, "Camera");
+	if (camera != GL_INVALID_INDEX)
+		glUniformBlockBinding(this->Program, camera, CameraBlockBinding);
+}
+
 
 
@@ -4,14 +4,27 @@
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <map>
 
 #include <GL/glew.h>
 
 class Shader
 {
 public:
+	// Binding point of the Camera uniform block, see CameraBuffer
+	static const GLuint CameraBlockBinding = 0;
+
 	GLuint Program;
 	Shader();
 	Shader(const GLchar* vertexPath, const GLchar* fragmentPath);
 	void Use();
+
+	// Location of an active uniform, looked up once after linking. -1 when the
+	// program has no such uniform. Arrays answer to both name and name[0].
+	GLint Uniform(const std::string& name) const;
+
+private:
+	std::map<std::string, GLint> uniforms;
+
+	void reflect();
 };
\ No newline at end of file
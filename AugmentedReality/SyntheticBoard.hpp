@@ -0,0 +1,121 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cfloat>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/aruco.hpp>
+#include <opencv2/calib3d/calib3d.hpp>
+
+using namespace std;
+
+// Renders a planar aruco board seen by a pinhole camera at a known pose, with
+// the exact image position of every marker corner as ground truth.
+//
+// The markers are drawn once into a flat canvas; a frame is the canvas warped
+// by the homography K [r1 r2 t] of the board plane. Image coordinates have
+// pixel centres at integers, like the corners aruco reports.
+class SyntheticBoard
+{
+public:
+	SyntheticBoard()
+	{
+
+	}
+
+	SyntheticBoard(const cv::Ptr<cv::aruco::Board>& board, float pixelsPerUnit)
+		: board(board), pixelsPerUnit(pixelsPerUnit)
+	{
+		float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX;
+		float markerLength = 0;
+		for (size_t j = 0; j < board->objPoints.size(); j++)
+		{
+			for (int p = 0; p < 4; p++)
+			{
+				minX = min(minX, board->objPoints[j][p].x);
+				minY = min(minY, board->objPoints[j][p].y);
+				maxX = max(maxX, board->objPoints[j][p].x);
+				maxY = max(maxY, board->objPoints[j][p].y);
+			}
+			markerLength = (float)cv::norm(board->objPoints[j][1] - board->objPoints[j][0]);
+		}
+
+		// A white margin of one marker keeps the quiet zone around the border markers
+		this->margin = markerLength;
+		this->originX = minX - this->margin;
+		this->topY = maxY + this->margin;
+
+		int width = (int)cvRound((maxX - minX + 2 * this->margin) * pixelsPerUnit);
+		int height = (int)cvRound((maxY - minY + 2 * this->margin) * pixelsPerUnit);
+		this->canvas = cv::Mat(height, width, CV_8UC1, cv::Scalar(255));
+
+		int side = (int)cvRound(markerLength * pixelsPerUnit);
+		cv::Mat marker;
+		for (size_t j = 0; j < board->objPoints.size(); j++)
+		{
+			cv::Point2f topLeft = this->toCanvasEdge(board->objPoints[j][0]);
+			cv::aruco::drawMarker(board->dictionary, board->ids[j], side, marker, 1);
+			marker.copyTo(this->canvas(cv::Rect(cvRound(topLeft.x), cvRound(topLeft.y), side, side)));
+		}
+	}
+
+	// Renders the board at (rvec, tvec). corners/ids receive the projection of
+	// every board marker, in the order of board->ids.
+	void Render(const cv::Size& imageSize, const cv::Mat& cameraMatrix, const cv::Vec3d& rvec, const cv::Vec3d& tvec,
+		cv::Mat& image, vector<vector<cv::Point2f>>& corners, vector<int>& ids) const
+	{
+		cv::Mat R;
+		cv::Rodrigues(rvec, R);
+
+		cv::Mat Rt = (cv::Mat_<double>(3, 3) <<
+			R.at<double>(0, 0), R.at<double>(0, 1), tvec[0],
+			R.at<double>(1, 0), R.at<double>(1, 1), tvec[1],
+			R.at<double>(2, 0), R.at<double>(2, 1), tvec[2]);
+		cv::Mat K;
+		cameraMatrix.convertTo(K, CV_64F);
+
+		// canvas pixel centre -> board plane
+		double s = 1.0 / this->pixelsPerUnit;
+		cv::Mat canvasToBoard = (cv::Mat_<double>(3, 3) <<
+			s, 0, this->originX + 0.5 * s,
+			0, -s, this->topY - 0.5 * s,
+			0, 0, 1);
+
+		cv::Mat H = K * Rt * canvasToBoard;
+
+		cv::Mat gray;
+		cv::warpPerspective(this->canvas, gray, H, imageSize, cv::INTER_LINEAR, cv::BORDER_CONSTANT, cv::Scalar(128));
+		cv::cvtColor(gray, image, cv::COLOR_GRAY2BGR);
+
+		corners.resize(this->board->objPoints.size());
+		ids = this->board->ids;
+		for (size_t j = 0; j < this->board->objPoints.size(); j++)
+			cv::projectPoints(this->board->objPoints[j], rvec, tvec, K, cv::noArray(), corners[j]);
+	}
+
+	// True when every corner of the marker lies inside the image
+	static bool Visible(const vector<cv::Point2f>& quad, const cv::Size& imageSize)
+	{
+		for (size_t p = 0; p < quad.size(); p++)
+		{
+			if (quad[p].x < 0 || quad[p].y < 0 || quad[p].x > imageSize.width - 1 || quad[p].y > imageSize.height - 1)
+				return false;
+		}
+		return true;
+	}
+
+private:
+	cv::Ptr<cv::aruco::Board> board;
+	float pixelsPerUnit;
+	float margin;
+	float originX;
+	float topY;
+	cv::Mat canvas;
+
+	cv::Point2f toCanvasEdge(const cv::Point3f& p) const
+	{
+		return cv::Point2f((p.x - this->originX) * this->pixelsPerUnit, (this->topY - p.y) * this->pixelsPerUnit);
+	}
+};
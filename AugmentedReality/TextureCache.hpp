@@ -0,0 +1,99 @@
+#pragma once
+
+#include <string>
+#include <map>
+
+#include <GL/glew.h>
+
+#include "TextureLoader.hpp"
+
+using namespace std;
+
+struct TextureCacheStats
+{
+	int hits;
+	int misses;
+	int textures;
+	// GPU memory of the uploaded textures, mip chains included
+	size_t bytes;
+};
+
+// Process-wide texture table shared by every Model. A texture is keyed by its
+// file and the format it is loaded in, loaded through the TextureLoader on the
+// first Acquire and deleted when the last Release drops its count to zero.
+//
+// GL thread only, like the loader.
+class TextureCache
+{
+public:
+	static TextureCache& Instance()
+	{
+		static TextureCache cache;
+		return cache;
+	}
+
+	GLuint Acquire(const string& filename, bool compress = true)
+	{
+		string key = filename + (compress ? "|bc" : "|rgb");
+		map<string, Entry>::iterator found = this->entries.find(key);
+		if (found != this->entries.end())
+		{
+			found->second.references++;
+			this->hits++;
+			return found->second.texture;
+		}
+
+		Entry entry;
+		entry.texture = TextureLoader::Instance().Request(filename, compress);
+		entry.references = 1;
+		this->entries[key] = entry;
+		this->keys[entry.texture] = key;
+		this->misses++;
+		return entry.texture;
+	}
+
+	void Release(GLuint texture)
+	{
+		map<GLuint, string>::iterator key = this->keys.find(texture);
+		if (key == this->keys.end())
+			return;
+		map<string, Entry>::iterator entry = this->entries.find(key->second);
+		if (--entry->second.references > 0)
+			return;
+
+		TextureLoader::Instance().Delete(texture);
+		this->entries.erase(entry);
+		this->keys.erase(key);
+	}
+
+	TextureCacheStats Stats() const
+	{
+		TextureCacheStats stats;
+		stats.hits = this->hits;
+		stats.misses = this->misses;
+		stats.textures = (int)this->entries.size();
+		stats.bytes = TextureLoader::Instance().Bytes();
+		return stats;
+	}
+
+private:
+	struct Entry
+	{
+		GLuint texture;
+		int references;
+	};
+
+	map<string, Entry> entries;
+	map<GLuint, string> keys;
+	int hits;
+	int misses;
+
+	TextureCache()
+		: hits(0), misses(0)
+	{
+
+	}
+
+	TextureCache(const TextureCache&);
+	TextureCache& operator=(const TextureCache&);
+};
@@ -0,0 +1,353 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <GL/glew.h>
+
+#include <SOIL/SOIL.h>
+
+#include "CompressedTexture.hpp"
+#include "AsyncLogger.hpp"
+
+using namespace std;
+
+// Loads textures without blocking the GL thread.
+//
+// Request() hands back a texture name at once, holding a 1x1 grey texel, and
+// queues the file for a pool of decode threads. Update(), called once a frame
+// on the GL thread, uploads what has been decoded through a pair of staging
+// pixel buffers, at most budget bytes per call. Meshes keep the name they got
+// and simply draw the real image once it is there.
+//
+// When the GL supports S3TC, images are transcoded once to BC1/BC3 with their
+// mip chain and kept as <image>.ktx next to the source; later loads read that
+// file and upload it as is. Otherwise they go up as RGB and the driver builds
+// the mipmaps.
+//
+// Request, Update and Finish must be called on the thread that owns the GL
+// context.
+class TextureLoader
+{
+public:
+	static TextureLoader& Instance()
+	{
+		static TextureLoader loader;
+		return loader;
+	}
+
+	~TextureLoader()
+	{
+		{
+			lock_guard<mutex> lock(this->lock);
+			this->stopping = true;
+		}
+		this->changed.notify_all();
+		for (size_t i = 0; i < this->workers.size(); i++)
+			this->workers[i].join();
+
+		// GL objects are left to the context, which may already be gone
+		for (size_t i = 0; i < this->decoded.size(); i++)
+			SOIL_free_image_data(this->decoded[i].pixels);
+	}
+
+	// With compress, the texture is transcoded to BC1/BC3 when the GL can
+	// sample it
+	GLuint Request(const string& filename, bool compress = true)
+	{
+		if (!this->checked)
+		{
+			this->compress = s3tcSupported();
+			this->checked = true;
+		}
+
+		GLuint texture;
+		glGenTextures(1, &texture);
+
+		static const unsigned char grey[3] = { 128, 128, 128 };
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 1, 1, 0, GL_RGB, GL_UNSIGNED_BYTE, grey);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+		Job job;
+		job.texture = texture;
+		job.request = ++this->requests;
+		this->loading[texture] = job.request;
+		job.filename = filename;
+		job.compress = compress && this->compress;
+		job.compressed = false;
+		job.pixels = nullptr;
+		job.width = 0;
+		job.height = 0;
+		{
+			lock_guard<mutex> lock(this->lock);
+			this->queued.push_back(move(job));
+			this->pending++;
+		}
+		this->changed.notify_one();
+		return texture;
+	}
+
+	// Uploads decoded images until budget bytes have gone to the GPU, always
+	// at least one. Returns the number of textures completed.
+	int Update(size_t budget)
+	{
+		int uploaded = 0;
+		size_t bytes = 0;
+		while (uploaded == 0 || bytes < budget)
+		{
+			Job job;
+			{
+				lock_guard<mutex> lock(this->lock);
+				if (this->decoded.empty())
+					break;
+				job = move(this->decoded.front());
+				this->decoded.pop_front();
+			}
+
+			bytes += this->upload(job);
+			uploaded++;
+
+			lock_guard<mutex> lock(this->lock);
+			this->pending--;
+		}
+		return uploaded;
+	}
+
+	// Blocks until every requested texture is uploaded
+	void Finish()
+	{
+		while (this->Pending() > 0)
+		{
+			if (this->Update((size_t)-1) == 0)
+			{
+				unique_lock<mutex> lock(this->lock);
+				this->changed.wait(lock, [this] { return !this->decoded.empty() || this->pending == 0; });
+			}
+		}
+	}
+
+	// Textures requested but not uploaded yet
+	int Pending()
+	{
+		lock_guard<mutex> lock(this->lock);
+		return this->pending;
+	}
+
+	// Deletes a texture from Request, also one still being loaded: its job
+	// finds itself no longer loading and is dropped, even if GL has handed
+	// the name out again to a newer request by then
+	void Delete(GLuint texture)
+	{
+		map<GLuint, size_t>::iterator size = this->sizes.find(texture);
+		if (size != this->sizes.end())
+		{
+			this->bytes -= size->second;
+			this->sizes.erase(size);
+		}
+		this->loading.erase(texture);
+		glDeleteTextures(1, &texture);
+	}
+
+	// GPU memory of the uploaded textures
+	size_t Bytes() const
+	{
+		return this->bytes;
+	}
+
+private:
+	struct Job
+	{
+		GLuint texture;
+		// Tells this job from an older one for a deleted texture of the same name
+		unsigned long long request;
+		string filename;
+		bool compress;
+		bool compressed;
+		CompressedTexture levels;
+		unsigned char* pixels;
+		int width;
+		int height;
+	};
+
+	static const int STAGING = 2;
+
+	vector<thread> workers;
+	deque<Job> queued;
+	deque<Job> decoded;
+	int pending;
+	bool stopping;
+	mutex lock;
+	condition_variable changed;
+
+	GLuint staging[STAGING];
+	int nextStaging;
+	bool checked;
+	bool compress;
+
+	// Uploaded textures and their GPU bytes, and the request each texture
+	// still being loaded waits for. Both only touched on the GL thread.
+	map<GLuint, size_t> sizes;
+	map<GLuint, unsigned long long> loading;
+	unsigned long long requests;
+	size_t bytes;
+
+	TextureLoader()
+		: pending(0), stopping(false), nextStaging(0), checked(false), compress(false), requests(0), bytes(0)
+	{
+		for (int i = 0; i < STAGING; i++)
+			this->staging[i] = 0;
+
+		// One core stays with the GL thread
+		int count = (int)thread::hardware_concurrency() - 1;
+		if (count < 1)
+			count = 1;
+		for (int i = 0; i < count; i++)
+			this->workers.push_back(thread(&TextureLoader::work, this));
+	}
+
+	TextureLoader(const TextureLoader&);
+	TextureLoader& operator=(const TextureLoader&);
+
+	void work()
+	{
+		unique_lock<mutex> lock(this->lock);
+		while (true)
+		{
+			this->changed.wait(lock, [this] { return !this->queued.empty() || this->stopping; });
+			if (this->stopping)
+				return;
+
+			Job job = move(this->queued.front());
+			this->queued.pop_front();
+
+			lock.unlock();
+			if (job.compress)
+				job.compressed = this->transcode(job);
+			if (!job.compressed)
+				job.pixels = SOIL_load_image(job.filename.c_str(), &job.width, &job.height, 0, SOIL_LOAD_RGB);
+			lock.lock();
+
+			this->decoded.push_back(move(job));
+			this->changed.notify_all();
+		}
+	}
+
+	// Worker side: the cached .ktx when it is current, otherwise the image
+	// compressed now and cached for the next run
+	bool transcode(Job& job)
+	{
+		string cachePath = job.filename + ".ktx";
+		if (readKtx(cachePath, job.filename, job.levels))
+			return true;
+
+		int width, height;
+		unsigned char* rgba = SOIL_load_image(job.filename.c_str(), &width, &height, 0, SOIL_LOAD_RGBA);
+		if (!rgba)
+			return false;
+		compressTexture(rgba, width, height, job.levels);
+		SOIL_free_image_data(rgba);
+
+		if (!writeKtx(cachePath, job.filename, job.levels))
+			AsyncLogger::Instance().Write(LOG_WARNING, "TEXTURE", "compressed texture not cached");
+		return true;
+	}
+
+	// Copies the data into the next staging buffer, orphaning its previous
+	// contents. Returns what to pass GL as the data pointer.
+	const GLvoid* stage(const void* data, size_t size)
+	{
+		if (!this->staging[0])
+			glGenBuffers(STAGING, this->staging);
+
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->staging[this->nextStaging]);
+		this->nextStaging = (this->nextStaging + 1) % STAGING;
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+		void* mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		if (!mapped)
+		{
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			return data;
+		}
+		memcpy(mapped, data, size);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		return 0;
+	}
+
+	// Uploads through a staging buffer and lets the driver pull it from there.
+	// Returns bytes uploaded.
+	size_t upload(Job& job)
+	{
+		map<GLuint, unsigned long long>::iterator loading = this->loading.find(job.texture);
+		if (loading == this->loading.end() || loading->second != job.request)
+		{
+			if (job.pixels)
+				SOIL_free_image_data(job.pixels);
+			return 0;
+		}
+		this->loading.erase(loading);
+		if (!job.compressed && !job.pixels)
+		{
+			// Stays grey, and counts as uploaded with nothing resident
+			cout << "ERROR::TEXTURE::LOAD_FAILED " << job.filename << endl;
+			this->sizes[job.texture] = 0;
+			return 0;
+		}
+
+		size_t size;
+		glBindTexture(GL_TEXTURE_2D, job.texture);
+		if (job.compressed)
+		{
+			const CompressedTexture& levels = job.levels;
+			size = levels.data.size();
+			const unsigned char* source = (const unsigned char*)this->stage(&levels.data[0], size);
+			for (int level = 0; level < levels.Levels(); level++)
+			{
+				glCompressedTexImage2D(GL_TEXTURE_2D, level, levels.format, levels.LevelWidth(level), levels.LevelHeight(level), 0,
+					(GLsizei)levels.sizes[level], source + levels.offsets[level]);
+			}
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels.Levels() - 1);
+		}
+		else
+		{
+			size = (size_t)job.width * job.height * 3;
+			const GLvoid* source = this->stage(job.pixels, size);
+
+			// RGB rows are not 4 byte aligned for every width
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, job.width, job.height, 0, GL_RGB, GL_UNSIGNED_BYTE, source);
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		if (!job.compressed)
+			glGenerateMipmap(GL_TEXTURE_2D);
+
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		// The driver keeps RGB as RGBA, and its mip chain adds a third
+		size_t resident = job.compressed ? size : size / 3 * 4 * 4 / 3;
+		this->sizes[job.texture] = resident;
+		this->bytes += resident;
+
+		if (job.pixels)
+			SOIL_free_image_data(job.pixels);
+		job.pixels = nullptr;
+		job.levels.data.clear();
+		return size;
+	}
+};
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+
+using namespace std;
+
+// Fixed set of worker threads with one task queue each. A worker takes from
+// the back of its own queue and steals from the front of the others once it
+// runs dry, so uneven tasks even out without every thread fighting over a
+// single queue. Tasks are a function pointer and an index, and the queues are
+// fixed rings, so handing out work never allocates.
+class ThreadPool
+{
+public:
+	typedef void(*TaskFunction)(void* context, int index);
+
+	// workers < 0 starts one thread per core besides the caller's, 0 runs
+	// everything on the calling thread
+	explicit ThreadPool(int workers = -1)
+		: stopping(false), queued(0)
+	{
+		if (workers < 0)
+			workers = max(1, (int)thread::hardware_concurrency() - 1);
+
+		for (int i = 0; i < workers; i++)
+			this->queues.push_back(unique_ptr<Queue>(new Queue()));
+		for (int i = 0; i < workers; i++)
+			this->threads.push_back(thread(&ThreadPool::work, this, i));
+	}
+
+	~ThreadPool()
+	{
+		{
+			lock_guard<mutex> lock(this->wakeLock);
+			this->stopping = true;
+		}
+		this->wake.notify_all();
+		for (size_t i = 0; i < this->threads.size(); i++)
+			this->threads[i].join();
+	}
+
+	int Workers() const
+	{
+		return (int)this->threads.size();
+	}
+
+	// Runs function(context, i) for i in [0, count) and returns when all are
+	// done. The calling thread works on the batch too.
+	void ParallelFor(int count, TaskFunction function, void* context)
+	{
+		if (this->queues.empty() || count == 1)
+		{
+			for (int i = 0; i < count; i++)
+				function(context, i);
+			return;
+		}
+
+		atomic<int> remaining(count);
+		int pushed = 0;
+		for (int i = 0; i < count; i++)
+		{
+			Task task = { function, context, i, &remaining };
+			if (this->queues[i % this->queues.size()]->Push(task))
+				pushed++;
+			else
+				this->run(task);
+		}
+
+		{
+			lock_guard<mutex> lock(this->wakeLock);
+			this->queued += pushed;
+		}
+		this->wake.notify_all();
+
+		Task task;
+		while (remaining > 0)
+		{
+			if (this->take(0, task))
+				this->run(task);
+			else
+				this_thread::yield();
+		}
+	}
+
+	template<typename Body>
+	void ParallelFor(int count, Body& body)
+	{
+		this->ParallelFor(count, &ThreadPool::invoke<Body>, &body);
+	}
+
+private:
+	struct Task
+	{
+		TaskFunction function;
+		void* context;
+		int index;
+		atomic<int>* remaining;
+	};
+
+	class Queue
+	{
+	public:
+		Queue()
+			: head(0), count(0)
+		{
+
+		}
+
+		bool Push(const Task& task)
+		{
+			lock_guard<mutex> lock(this->lock);
+			if (this->count == CAPACITY)
+				return false;
+			this->tasks[(this->head + this->count) % CAPACITY] = task;
+			this->count++;
+			return true;
+		}
+
+		// Owner end
+		bool PopBack(Task& task)
+		{
+			lock_guard<mutex> lock(this->lock);
+			if (this->count == 0)
+				return false;
+			this->count--;
+			task = this->tasks[(this->head + this->count) % CAPACITY];
+			return true;
+		}
+
+		// Thief end
+		bool PopFront(Task& task)
+		{
+			lock_guard<mutex> lock(this->lock);
+			if (this->count == 0)
+				return false;
+			task = this->tasks[this->head];
+			this->head = (this->head + 1) % CAPACITY;
+			this->count--;
+			return true;
+		}
+
+	private:
+		static const int CAPACITY = 256;
+
+		mutex lock;
+		Task tasks[CAPACITY];
+		int head;
+		int count;
+	};
+
+	vector<unique_ptr<Queue>> queues;
+	vector<thread> threads;
+
+	mutex wakeLock;
+	condition_variable wake;
+	bool stopping;
+	// Tasks sitting in any queue, guards the workers' sleep
+	atomic<int> queued;
+
+	template<typename Body>
+	static void invoke(void* context, int index)
+	{
+		(*(Body*)context)(index);
+	}
+
+	void run(const Task& task)
+	{
+		task.function(task.context, task.index);
+		task.remaining->fetch_sub(1);
+	}
+
+	bool take(int self, Task& task)
+	{
+		int n = (int)this->queues.size();
+		bool found = this->queues[self]->PopBack(task);
+		for (int k = 1; !found && k < n; k++)
+			found = this->queues[(self + k) % n]->PopFront(task);
+		if (found)
+			this->queued--;
+		return found;
+	}
+
+	void work(int self)
+	{
+		Task task;
+		while (true)
+		{
+			if (this->take(self, task))
+			{
+				this->run(task);
+				continue;
+			}
+
+			unique_lock<mutex> lock(this->wakeLock);
+			this->wake.wait(lock, [this] { return this->queued > 0 || this->stopping; });
+			if (this->stopping && this->queued == 0)
+				return;
+		}
+	}
+};
@@ -0,0 +1,377 @@
+#include "ThresholdKernel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define KERNEL_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define KERNEL_TARGET(isa)
+#else
+#define KERNEL_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+// cvtColor fixed point coefficients (yuv_shift = 14), rounding folded in
+static const int B2Y = 1868;
+static const int G2Y = 9617;
+static const int R2Y = 4899;
+static const int GRAY_SHIFT = 14;
+static const int GRAY_ROUND = 1 << (GRAY_SHIFT - 1);
+
+static void grayRowScalar(const unsigned char* bgr, unsigned char* gray, int x, int width)
+{
+	for (; x < width; x++, bgr += 3)
+		gray[x] = (unsigned char)((bgr[0] * B2Y + bgr[1] * G2Y + bgr[2] * R2Y + GRAY_ROUND) >> GRAY_SHIFT);
+}
+
+// Rounded box mean, same as boxFilter's saturate_cast<uchar>(sum * (1.0 / area)).
+// Window areas are odd, so the quotient is never exactly halfway.
+static void thresholdRowScalar(const unsigned char* gray, unsigned char* binary, int x, int width,
+	const unsigned int* top, const unsigned int* bottom, int left, int right, int area, int delta)
+{
+	for (; x < width; x++)
+	{
+		unsigned int sum = bottom[x + right] - top[x + right] - bottom[x + left] + top[x + left];
+		int mean = (int)((2 * sum + area) / (2 * area));
+		binary[x] = gray[x] + delta <= mean ? 255 : 0;
+	}
+}
+
+#ifdef KERNEL_X86
+
+// Splits 16 interleaved BGR pixels into B, G and R planes
+KERNEL_TARGET("sse4.1")
+static inline void deinterleave16(const unsigned char* bgr, __m128i& b, __m128i& g, __m128i& r)
+{
+	__m128i c0 = _mm_loadu_si128((const __m128i*)bgr);
+	__m128i c1 = _mm_loadu_si128((const __m128i*)(bgr + 16));
+	__m128i c2 = _mm_loadu_si128((const __m128i*)(bgr + 32));
+
+	b = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(c0, _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+		_mm_shuffle_epi8(c1, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1))),
+		_mm_shuffle_epi8(c2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13)));
+	g = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(c0, _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+		_mm_shuffle_epi8(c1, _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1))),
+		_mm_shuffle_epi8(c2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14)));
+	r = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(c0, _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+		_mm_shuffle_epi8(c1, _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1))),
+		_mm_shuffle_epi8(c2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15)));
+}
+
+// (b, g) and (r, 1) pairs against (B2Y, G2Y) and (R2Y, GRAY_ROUND) with pmaddwd
+KERNEL_TARGET("sse4.1")
+static inline __m128i gray4(__m128i bg, __m128i r1)
+{
+	const __m128i cBG = _mm_set1_epi32(B2Y | (G2Y << 16));
+	const __m128i cR1 = _mm_set1_epi32(R2Y | (GRAY_ROUND << 16));
+	__m128i sum = _mm_add_epi32(_mm_madd_epi16(bg, cBG), _mm_madd_epi16(r1, cR1));
+	return _mm_srli_epi32(sum, GRAY_SHIFT);
+}
+
+KERNEL_TARGET("sse4.1")
+static void grayRowSSE41(const unsigned char* bgr, unsigned char* gray, int width)
+{
+	const __m128i one = _mm_set1_epi16(1);
+	int x = 0;
+	for (; x + 16 <= width; x += 16)
+	{
+		__m128i b, g, r;
+		deinterleave16(bgr + x * 3, b, g, r);
+
+		__m128i packed[2];
+		for (int half = 0; half < 2; half++)
+		{
+			__m128i b16 = _mm_cvtepu8_epi16(half ? _mm_srli_si128(b, 8) : b);
+			__m128i g16 = _mm_cvtepu8_epi16(half ? _mm_srli_si128(g, 8) : g);
+			__m128i r16 = _mm_cvtepu8_epi16(half ? _mm_srli_si128(r, 8) : r);
+
+			__m128i lo = gray4(_mm_unpacklo_epi16(b16, g16), _mm_unpacklo_epi16(r16, one));
+			__m128i hi = gray4(_mm_unpackhi_epi16(b16, g16), _mm_unpackhi_epi16(r16, one));
+			packed[half] = _mm_packs_epi32(lo, hi);
+		}
+		_mm_storeu_si128((__m128i*)(gray + x), _mm_packus_epi16(packed[0], packed[1]));
+	}
+	grayRowScalar(bgr + x * 3, gray, x, width);
+}
+
+KERNEL_TARGET("avx2")
+static void grayRowAVX2(const unsigned char* bgr, unsigned char* gray, int width)
+{
+	const __m256i one = _mm256_set1_epi16(1);
+	const __m256i cBG = _mm256_set1_epi32(B2Y | (G2Y << 16));
+	const __m256i cR1 = _mm256_set1_epi32(R2Y | (GRAY_ROUND << 16));
+	int x = 0;
+	for (; x + 16 <= width; x += 16)
+	{
+		__m128i b, g, r;
+		deinterleave16(bgr + x * 3, b, g, r);
+
+		__m256i b16 = _mm256_cvtepu8_epi16(b);
+		__m256i g16 = _mm256_cvtepu8_epi16(g);
+		__m256i r16 = _mm256_cvtepu8_epi16(r);
+
+		// In-lane unpacks: lo holds pixels 0-3 and 8-11, hi holds 4-7 and 12-15
+		__m256i lo = _mm256_add_epi32(
+			_mm256_madd_epi16(_mm256_unpacklo_epi16(b16, g16), cBG),
+			_mm256_madd_epi16(_mm256_unpacklo_epi16(r16, one), cR1));
+		__m256i hi = _mm256_add_epi32(
+			_mm256_madd_epi16(_mm256_unpackhi_epi16(b16, g16), cBG),
+			_mm256_madd_epi16(_mm256_unpackhi_epi16(r16, one), cR1));
+
+		__m256i words = _mm256_packs_epi32(_mm256_srli_epi32(lo, GRAY_SHIFT), _mm256_srli_epi32(hi, GRAY_SHIFT));
+		__m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(words, words), 0x08);
+		_mm_storeu_si128((__m128i*)(gray + x), _mm256_castsi256_si128(bytes));
+	}
+	grayRowScalar(bgr + x * 3, gray, x, width);
+}
+
+KERNEL_TARGET("sse4.1")
+static void thresholdRowSSE41(const unsigned char* gray, unsigned char* binary, int width,
+	const unsigned int* top, const unsigned int* bottom, int left, int right, int area, int delta)
+{
+	const __m128 inverse = _mm_set1_ps(1.0f / (2 * area));
+	const __m128i twoArea = _mm_set1_epi32(2 * area);
+	const __m128i twoAreaMinusOne = _mm_set1_epi32(2 * area - 1);
+	const __m128i areaV = _mm_set1_epi32(area);
+	const __m128i deltaV = _mm_set1_epi32(delta);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i maxValue = _mm_set1_epi32(255);
+
+	int x = 0;
+	for (; x + 4 <= width; x += 4)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i*)(bottom + x + right));
+		__m128i b = _mm_loadu_si128((const __m128i*)(top + x + right));
+		__m128i c = _mm_loadu_si128((const __m128i*)(bottom + x + left));
+		__m128i d = _mm_loadu_si128((const __m128i*)(top + x + left));
+		__m128i sum = _mm_sub_epi32(_mm_sub_epi32(a, b), _mm_sub_epi32(c, d));
+
+		// floor((2 * sum + area) / (2 * area)), float estimate corrected by one
+		__m128i numerator = _mm_add_epi32(_mm_add_epi32(sum, sum), areaV);
+		__m128i mean = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(numerator), inverse));
+		__m128i remainder = _mm_sub_epi32(numerator, _mm_mullo_epi32(mean, twoArea));
+		mean = _mm_sub_epi32(mean, _mm_cmpgt_epi32(remainder, twoAreaMinusOne));
+		mean = _mm_add_epi32(mean, _mm_cmplt_epi32(remainder, zero));
+
+		int pixels;
+		memcpy(&pixels, gray + x, 4);
+		__m128i g = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(pixels));
+		__m128i result = _mm_andnot_si128(_mm_cmpgt_epi32(_mm_add_epi32(g, deltaV), mean), maxValue);
+
+		__m128i words = _mm_packs_epi32(result, result);
+		int packed = _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+		memcpy(binary + x, &packed, 4);
+	}
+	thresholdRowScalar(gray, binary, x, width, top, bottom, left, right, area, delta);
+}
+
+KERNEL_TARGET("avx2")
+static void thresholdRowAVX2(const unsigned char* gray, unsigned char* binary, int width,
+	const unsigned int* top, const unsigned int* bottom, int left, int right, int area, int delta)
+{
+	const __m256 inverse = _mm256_set1_ps(1.0f / (2 * area));
+	const __m256i twoArea = _mm256_set1_epi32(2 * area);
+	const __m256i twoAreaMinusOne = _mm256_set1_epi32(2 * area - 1);
+	const __m256i areaV = _mm256_set1_epi32(area);
+	const __m256i deltaV = _mm256_set1_epi32(delta);
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i maxValue = _mm256_set1_epi32(255);
+
+	int x = 0;
+	for (; x + 8 <= width; x += 8)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i*)(bottom + x + right));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(top + x + right));
+		__m256i c = _mm256_loadu_si256((const __m256i*)(bottom + x + left));
+		__m256i d = _mm256_loadu_si256((const __m256i*)(top + x + left));
+		__m256i sum = _mm256_sub_epi32(_mm256_sub_epi32(a, b), _mm256_sub_epi32(c, d));
+
+		__m256i numerator = _mm256_add_epi32(_mm256_add_epi32(sum, sum), areaV);
+		__m256i mean = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(numerator), inverse));
+		__m256i remainder = _mm256_sub_epi32(numerator, _mm256_mullo_epi32(mean, twoArea));
+		mean = _mm256_sub_epi32(mean, _mm256_cmpgt_epi32(remainder, twoAreaMinusOne));
+		mean = _mm256_add_epi32(mean, _mm256_cmpgt_epi32(zero, remainder));
+
+		__m256i g = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(gray + x)));
+		__m256i result = _mm256_andnot_si256(_mm256_cmpgt_epi32(_mm256_add_epi32(g, deltaV), mean), maxValue);
+
+		// In-lane packs leave pixels 0-3 in the low lane and 4-7 in the high lane
+		__m256i words = _mm256_packs_epi32(result, result);
+		__m256i bytes = _mm256_packus_epi16(words, words);
+		__m128i ordered = _mm_unpacklo_epi32(_mm256_castsi256_si128(bytes), _mm256_extracti128_si256(bytes, 1));
+		_mm_storel_epi64((__m128i*)(binary + x), ordered);
+	}
+	thresholdRowScalar(gray, binary, x, width, top, bottom, left, right, area, delta);
+}
+
+#endif
+
+ThresholdKernel::ThresholdKernel()
+	: path(Detected())
+{
+
+}
+
+ThresholdKernel::Path ThresholdKernel::Detected()
+{
+#ifdef KERNEL_X86
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+
+	__cpuid(info, 1);
+	bool sse41 = (info[2] & (1 << 19)) != 0;
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+
+	bool avx2 = false;
+	if (maxLeaf >= 7 && osxsave && avx && (_xgetbv(0) & 6) == 6)
+	{
+		__cpuidex(info, 7, 0);
+		avx2 = (info[1] & (1 << 5)) != 0;
+	}
+#else
+	__builtin_cpu_init();
+	bool sse41 = __builtin_cpu_supports("sse4.1") != 0;
+	bool avx2 = __builtin_cpu_supports("avx2") != 0;
+#endif
+	if (avx2)
+		return AVX2;
+	if (sse41)
+		return SSE41;
+#endif
+	return SCALAR;
+}
+
+const char* ThresholdKernel::PathName(Path path)
+{
+	switch (path)
+	{
+	case AVX2:
+		return "avx2";
+	case SSE41:
+		return "sse4.1";
+	default:
+		return "scalar";
+	}
+}
+
+void ThresholdKernel::SetPath(Path path)
+{
+	this->path = std::min(path, Detected());
+}
+
+ThresholdKernel::Path ThresholdKernel::GetPath() const
+{
+	return this->path;
+}
+
+void ThresholdKernel::grayRow(const unsigned char* bgr, unsigned char* gray, int width) const
+{
+#ifdef KERNEL_X86
+	if (this->path == AVX2)
+		return grayRowAVX2(bgr, gray, width);
+	if (this->path == SSE41)
+		return grayRowSSE41(bgr, gray, width);
+#endif
+	grayRowScalar(bgr, gray, 0, width);
+}
+
+void ThresholdKernel::thresholdRow(const unsigned char* gray, unsigned char* binary, int width,
+	const unsigned int* top, const unsigned int* bottom, int left, int right, int area, int delta) const
+{
+#ifdef KERNEL_X86
+	if (this->path == AVX2)
+		return thresholdRowAVX2(gray, binary, width, top, bottom, left, right, area, delta);
+	if (this->path == SSE41)
+		return thresholdRowSSE41(gray, binary, width, top, bottom, left, right, area, delta);
+#endif
+	thresholdRowScalar(gray, binary, 0, width, top, bottom, left, right, area, delta);
+}
+
+void ThresholdKernel::Process(const unsigned char* bgr, size_t bgrStep, int width, int height,
+	unsigned char* gray, size_t grayStep,
+	const int* windows, int windowCount, double constant,
+	unsigned char* const* binary, size_t binaryStep)
+{
+	int radius = 0;
+	for (int k = 0; k < windowCount; k++)
+		radius = std::max(radius, windows[k] / 2);
+
+	// Integral rows of the frame padded by radius on every side with replicated
+	// borders; row i holds the sums of padded rows 0..i-1. Producing output row
+	// y needs integral rows y .. y + 2 * radius + 1.
+	int paddedWidth = width + 2 * radius;
+	int rowLength = paddedWidth + 1;
+	int ringRows = 2 * radius + 2;
+	if (windowCount > 0)
+	{
+		this->integral.resize((size_t)ringRows * rowLength);
+		std::fill(this->integral.begin(), this->integral.begin() + rowLength, 0u);
+	}
+
+	int delta = (int)std::floor(constant);
+	int next = 1;
+	int outY = 0;
+
+	for (int y = 0; y < height; y++)
+	{
+		this->grayRow(bgr + y * bgrStep, gray + y * grayStep, width);
+
+		if (windowCount == 0)
+			continue;
+
+		// Padded row i is gray row clamp(i - radius); with row y converted, padded
+		// rows up to y + radius are known, all of them once the frame is done.
+		int limit = y == height - 1 ? height + 2 * radius : y + radius + 1;
+		while (next <= limit)
+		{
+			int source = std::min(std::max(next - 1 - radius, 0), height - 1);
+			const unsigned char* g = gray + source * grayStep;
+			const unsigned int* previous = &this->integral[(size_t)((next - 1) % ringRows) * rowLength];
+			unsigned int* current = &this->integral[(size_t)(next % ringRows) * rowLength];
+
+			unsigned int run = 0;
+			current[0] = 0;
+			for (int j = 0; j < radius; j++)
+			{
+				run += g[0];
+				current[j + 1] = previous[j + 1] + run;
+			}
+			for (int j = 0; j < width; j++)
+			{
+				run += g[j];
+				current[radius + j + 1] = previous[radius + j + 1] + run;
+			}
+			for (int j = radius + width; j < paddedWidth; j++)
+			{
+				run += g[width - 1];
+				current[j + 1] = previous[j + 1] + run;
+			}
+			next++;
+
+			while (outY < height && outY + 2 * radius + 1 <= next - 1)
+			{
+				const unsigned char* row = gray + outY * grayStep;
+				for (int k = 0; k < windowCount; k++)
+				{
+					int r = windows[k] / 2;
+					const unsigned int* top = &this->integral[(size_t)((outY + radius - r) % ringRows) * rowLength];
+					const unsigned int* bottom = &this->integral[(size_t)((outY + radius + r + 1) % ringRows) * rowLength];
+					int area = (2 * r + 1) * (2 * r + 1);
+					this->thresholdRow(row, binary[k] + outY * binaryStep, width, top, bottom,
+						radius - r, radius + r + 1, area, delta);
+				}
+				outY++;
+			}
+		}
+	}
+}
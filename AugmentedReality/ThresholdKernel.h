@@ -0,0 +1,54 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+// Fused BGR -> gray, integral image and multi-window adaptive threshold.
+//
+// One pass over the frame: every input row is converted to gray, extended to
+// a border-replicated integral row kept in a small ring, and as soon as the
+// integral rows below a row exist, that row is thresholded for all windows.
+// Output matches OpenCV bit for bit:
+//   gray      == cvtColor(bgr, CV_BGR2GRAY)
+//   binary[k] == adaptiveThreshold(gray, 255, ADAPTIVE_THRESH_MEAN_C,
+//                                  THRESH_BINARY_INV, windows[k], constant)
+// which is what aruco's candidate stage computes for each window size.
+//
+// The inner loops are dispatched at runtime to AVX2, SSE4.1 or plain C++.
+class ThresholdKernel
+{
+public:
+	enum Path
+	{
+		SCALAR,
+		SSE41,
+		AVX2
+	};
+
+	ThresholdKernel();
+
+	// Best path the CPU supports
+	static Path Detected();
+	static const char* PathName(Path path);
+
+	// Forces a path, clamped to what the CPU supports. Used for validation.
+	void SetPath(Path path);
+	Path GetPath() const;
+
+	// windowCount may be 0 to only produce the gray image. Window sizes must
+	// be odd and at least 3.
+	void Process(const unsigned char* bgr, size_t bgrStep, int width, int height,
+		unsigned char* gray, size_t grayStep,
+		const int* windows, int windowCount, double constant,
+		unsigned char* const* binary, size_t binaryStep);
+
+private:
+	Path path;
+
+	// Ring of border-replicated integral rows, padded by the largest radius
+	std::vector<unsigned int> integral;
+
+	void grayRow(const unsigned char* bgr, unsigned char* gray, int width) const;
+	void thresholdRow(const unsigned char* gray, unsigned char* binary, int width,
+		const unsigned int* top, const unsigned int* bottom, int left, int right, int area, int delta) const;
+};
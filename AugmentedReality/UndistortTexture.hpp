@@ -0,0 +1,100 @@
+#pragma once
+
+#include <vector>
+
+#include <GL/glew.h>
+
+#include "CameraModel.hpp"
+
+using namespace std;
+
+// The camera model's undistortion maps as a texture for bg_f.glsl: for every
+// pixel of the undistorted image, the texture coordinates in the captured
+// frame to sample. Built from the maps when the model changes and otherwise
+// left alone, so undistorting the background costs one dependent texture
+// read per pixel and nothing on the CPU.
+//
+// Coordinates are stored as 16 bit normalised values, a 65536th of the frame
+// apart, which is well below a pixel at any capture resolution.
+class UndistortTexture
+{
+public:
+	GLuint Texture;
+
+	UndistortTexture()
+		: Texture(0), version(0), width(0), height(0)
+	{
+
+	}
+
+	// Rebuilds the texture if the model changed since the last call
+	void Update(const CameraModel& camera)
+	{
+		if (this->Texture != 0 && camera.Version() == this->version)
+			return;
+		const cv::Mat& mapX = camera.MapX();
+		const cv::Mat& mapY = camera.MapY();
+		if (mapX.empty())
+			return;
+		this->version = camera.Version();
+
+		// Pixel centres are at integer map coordinates, at half texels in
+		// texture coordinates. Rows stay top-down like the frames.
+		int width = mapX.cols, height = mapX.rows;
+		vector<GLushort> coordinates(width * height * 2);
+		for (int y = 0; y < height; y++)
+		{
+			const float* rowX = mapX.ptr<float>(y);
+			const float* rowY = mapY.ptr<float>(y);
+			GLushort* target = &coordinates[y * width * 2];
+			for (int x = 0; x < width; x++)
+			{
+				target[x * 2] = this->normalise((rowX[x] + 0.5f) / width);
+				target[x * 2 + 1] = this->normalise((rowY[x] + 0.5f) / height);
+			}
+		}
+
+		if (this->Texture == 0 || width != this->width || height != this->height)
+		{
+			if (this->Texture != 0)
+				glDeleteTextures(1, &this->Texture);
+			this->width = width;
+			this->height = height;
+			glGenTextures(1, &this->Texture);
+			glBindTexture(GL_TEXTURE_2D, this->Texture);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RG16, width, height, 0, GL_RG, GL_UNSIGNED_SHORT, 0);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		}
+		else
+		{
+			glBindTexture(GL_TEXTURE_2D, this->Texture);
+		}
+		// Rows are a multiple of four bytes, whatever the unpack alignment
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RG, GL_UNSIGNED_SHORT, &coordinates[0]);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+
+	void Release()
+	{
+		if (this->Texture != 0)
+			glDeleteTextures(1, &this->Texture);
+		this->Texture = 0;
+	}
+
+private:
+	unsigned int version;
+	int width, height;
+
+	// Coordinates outside the frame clamp to its border texel
+	GLushort normalise(float coordinate) const
+	{
+		if (coordinate <= 0.0f)
+			return 0;
+		if (coordinate >= 1.0f)
+			return 65535;
+		return (GLushort)(coordinate * 65535.0f + 0.5f);
+	}
+};
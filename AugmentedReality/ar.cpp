@@ -15,10 +15,32 @@
 #include <opencv2/aruco.hpp>
 #include <opencv2/calib3d/calib3d.hpp>
 #include <iostream>
+#include <atomic>
+#include <thread>
+#include <cstdlib>
+#include <chrono>
 
 #include "Camera.hpp"
+#include "CameraModel.hpp"
+#include "UndistortTexture.hpp"
 #include "Shader.h"
+#include "CameraBuffer.hpp"
 #include "Model.hpp"
+#include "Frustum.hpp"
+#include "TextureLoader.hpp"
+#include "TextureCache.hpp"
+#include "FrameRing.hpp"
+#include "BackgroundStream.hpp"
+#include "DetectionPipeline.hpp"
+#include "FrameSource.hpp"
+#include "PoseTracker.hpp"
+#include "AllocationCounter.h"
+#include "AsyncLogger.hpp"
+#include "Profiler.hpp"
+#include "GpuTimer.hpp"
+#include "HeadlessContext.hpp"
+#include "OffscreenTarget.hpp"
+#include "FrameSink.hpp"
 
 using namespace cv;
 using namespace std;
@@ -32,9 +54,17 @@ int windowHeight = 768;
 
 GLFWwindow* window;
 
-const char* ARWindowName = "Augmented Reality";
+// Texture bytes uploaded per rendered frame while models are loading
+const size_t textureBudget = 8 << 20;
+
+// --headless: no window, frames are drawn offscreen and go to a sink
+bool headless = false;
+HeadlessContext headlessContext;
+OffscreenTarget offscreen;
+Ptr<FrameSink> sink;
+unsigned long long renderedSequence = 0;
 
-GLuint bgTexture;
+const char* ARWindowName = "Augmented Reality";
 
 GLfloat bgVertices[] = {
 	// Positions       // Texture Coords
@@ -49,12 +79,31 @@ GLuint bgIndices[] = {
 	1, 2, 3
 };
 
-float borderColor[] = { 1.0f, 1.0f, 0.0f, 1.0f };
-
 GLuint bgVAO, bgVBO, bgEBO;
 
+BackgroundStream bgStream;
+
 Shader bgShader;
 Shader modelShader;
+Shader instancedShader;
+CameraBuffer cameraBuffer;
+GLint modelLocation;
+
+// --anchors: a small statue on every board marker and controller, drawn as
+// instances of the one model
+bool anchors = false;
+// --occlusion: hardware occlusion queries between the statue's submeshes
+bool occlusion = false;
+// Height of the anchor copies, board units
+const float anchorHeight = 100.0f;
+// Largest screen-space error a model's level of detail may show, pixels
+const float lodPixels = 1.0f;
+vector<Vec3d> markerCenters;
+vector<glm::mat4> anchorTransforms;
+// The statue standing on the middle of the board and an anchor copy standing
+// on the board origin, both in board coordinates
+glm::mat4 statuePlacement;
+glm::mat4 anchorPlacement;
 
 Camera camera(glm::vec3(0.0f, 0.0f, 0.0f));
 
@@ -64,87 +113,116 @@ vector<Vec3d> c_r_vecs;
 vector<Vec3d> c_t_vecs;
 Vec3d r_vecs, t_vecs;
 
-Mat intrinsic;
-Mat distCoeffs;
-
-
-static void cGetBoardObjectAndImagePoints(const Ptr<Board> &_board, InputArray _detectedIds,
-	InputArrayOfArrays _detectedCorners,
-	OutputArray _imgPoints, OutputArray _objPoints) {
-
-	CV_Assert(_board->ids.size() == _board->objPoints.size());
-	CV_Assert(_detectedIds.total() == _detectedCorners.total());
+// Filtered board pose from the latest detection, extrapolated every redraw
+PoseState boardPose;
+// Time from drawing a frame to it being on screen, roughly one refresh
+const double displayLatency = 1.0 / 60.0;
+// Content on the board is hidden once its pose is older than this, seconds
+const double maxPoseAge = 0.5;
+// The board pose was current at the frame being drawn
+bool boardVisible = false;
+
+CameraModel cameraModel;
+UndistortTexture undistortTexture;
+
+// buffer is the BackgroundStream slot the image memory belongs to; it travels
+// with the image when frames are swapped between stages.
+struct CapturedFrame
+{
+	Mat image;
+	int buffer;
+	unsigned long long sequence;
+	// Seconds, when the frame was grabbed
+	double timestamp;
+};
 
-	size_t nDetectedMarkers = _detectedIds.total();
+struct DetectedFrame
+{
+	Mat image;
+	int buffer;
+	unsigned long long sequence;
+	double timestamp;
+	Vec3d r_vecs, t_vecs;
+	PoseState pose;
+	vector<Vec3d> c_r_vecs;
+	vector<Vec3d> c_t_vecs;
+};
 
-	vector< Point3f > objPnts;
-	objPnts.reserve(nDetectedMarkers);
+FrameRing<CapturedFrame> captureRing;
+FrameRing<DetectedFrame> detectionRing;
+atomic<bool> running(true);
+// Cleared when a stage's thread finishes, e.g. at the end of a recording
+atomic<bool> capturing(true);
+atomic<bool> detecting(true);
 
-	vector< Point2f > imgPnts;
-	imgPnts.reserve(nDetectedMarkers);
+// Profiler stage ids, registered in main before the stages start
+struct ProfileStages
+{
+	int capture;
+	int detectFrame;
+	int upload;
+	int textures;
+	int background;
+	int backgroundGpu;
+	int model;
+	int modelGpu;
+	int swap;
+	int renderFrame;
+};
 
-	// look for detected markers that belong to the board and get their information
-	for (unsigned int i = 0; i < nDetectedMarkers; i++) {
-		int currentId = _detectedIds.getMat().ptr< int >(0)[i];
-		if (currentId >= markersX * markersY)
-			continue;
-		for (unsigned int j = 0; j < _board->ids.size(); j++) {
-			if (currentId == _board->ids[j]) {
-				for (int p = 0; p < 4; p++) {
-					objPnts.push_back(_board->objPoints[j][p]);
-					imgPnts.push_back(_detectedCorners.getMat(i).ptr< Point2f >(0)[p]);
-				}
-			}
-		}
-	}
+ProfileStages stages;
+GpuTimer backgroundTimer;
+GpuTimer modelTimer;
+ProfilerOverlay overlay;
 
-	// create output
-	Mat(objPnts).copyTo(_objPoints);
-	Mat(imgPnts).copyTo(_imgPoints);
+void registerStages()
+{
+	Profiler& profiler = Profiler::Instance();
+	stages.capture = profiler.Stage("capture");
+	stages.detectFrame = profiler.Stage("detect frame");
+	stages.upload = profiler.Stage("upload");
+	stages.textures = profiler.Stage("textures");
+	stages.background = profiler.Stage("drawBackground");
+	stages.backgroundGpu = profiler.Stage("drawBackground gpu");
+	stages.model = profiler.Stage("drawModel");
+	stages.modelGpu = profiler.Stage("drawModel gpu");
+	stages.swap = profiler.Stage("swap");
+	stages.renderFrame = profiler.Stage("render frame");
+
+	backgroundTimer.Init(stages.backgroundGpu);
+	modelTimer.Init(stages.modelGpu);
 }
 
-int cEstimatePoseBoard(InputArrayOfArrays _corners, InputArray _ids, const Ptr<Board> &board,
-	InputArray _cameraMatrix, InputArray _distCoeffs, OutputArray _rvec,
-	OutputArray _tvec) {
-
-	CV_Assert(_corners.total() == _ids.total());
-
-	// get object and image points for the solvePnP function
-	Mat objPoints, imgPoints;
-	cGetBoardObjectAndImagePoints(board, _ids, _corners, imgPoints, objPoints);
-
-	CV_Assert(imgPoints.total() == objPoints.total());
-
-	if (objPoints.total() == 0) // 0 of the detected markers in board
-		return 0;
-
-	bool useExtrinsicGuess = true;
-	if (_rvec.empty() || _tvec.empty())
-	{
-		_rvec.create(3, 1, CV_64FC1);
-		_tvec.create(3, 1, CV_64FC1);
-		useExtrinsicGuess = false;
-	}
-
-	solvePnP(objPoints, imgPoints, _cameraMatrix, _distCoeffs, _rvec, _tvec, useExtrinsicGuess, CV_EPNP);
-
-	cout << _rvec.getMat() << endl;
-	cout << _tvec.getMat() << endl;
-	// divide by four since all the four corners are concatenated in the array for each marker
-	return (int)objPoints.total() / 4;
+double secondsNow()
+{
+	return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
 }
 
 int initGLEnv()
 {
-	glfwInit();
-
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-	glfwWindowHint(GLFW_RESIZABLE, GL_FALSE);
-
-	window = glfwCreateWindow(windowWidth, windowHeight, ARWindowName, nullptr, nullptr);
-	glfwMakeContextCurrent(window);
+	if (headless)
+	{
+		if (!headlessContext.Init(windowWidth, windowHeight))
+			return -1;
+	}
+	else
+	{
+		glfwInit();
+
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+		glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+		glfwWindowHint(GLFW_RESIZABLE, GL_FALSE);
+		// GLEW built for the headless backend only finds that backend's contexts
+#if defined(AR_HEADLESS_EGL)
+		glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_EGL_CONTEXT_API);
+#elif defined(AR_HEADLESS_OSMESA)
+		glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_OSMESA_CONTEXT_API);
+#endif
+
+		window = glfwCreateWindow(windowWidth, windowHeight, ARWindowName, nullptr, nullptr);
+		glfwMakeContextCurrent(window);
+	}
 	glewExperimental = GL_TRUE;
 
 	GLenum err;
@@ -157,11 +235,16 @@ int initGLEnv()
 		return -1;
 	}
 
+	if (headless)
+	{
+		if (!offscreen.Init(windowWidth, windowHeight))
+			return -1;
+		offscreen.Bind();
+	}
+
 	glViewport(0, 0, windowWidth, windowHeight);
 	glEnable(GL_DEPTH_TEST);
 
-	glGenTextures(1, &bgTexture);
-
 	glGenVertexArrays(1, &bgVAO);
 	glGenBuffers(1, &bgVBO);
 	glGenBuffers(1, &bgEBO);
@@ -184,24 +267,23 @@ int initGLEnv()
 	
 	return 0;
 }
-void drawBackground(InputArray image)
+void uploadBackground(const DetectedFrame& frame)
+{
+	bgStream.Upload(frame.buffer, frame.image.data, frame.image.cols, frame.image.rows);
+}
+
+void drawBackground()
 {
 	glDisable(GL_DEPTH_TEST);
-	Mat _image = image.getMat();
-	flip(_image, _image, 0);
-	cvtColor(_image, _image, CV_BGR2RGB);
+	if (cameraModel.Distorted())
+	{
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, undistortTexture.Texture);
+	}
 	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, bgTexture);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-	glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, borderColor);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glBindTexture(GL_TEXTURE_2D, bgStream.Texture);
 
 	bgShader.Use();
-	glUniform1i(glGetUniformLocation(bgShader.Program, "bgImage"), 0);
-
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, _image.cols, _image.rows, 0, GL_RGB, GL_UNSIGNED_BYTE, _image.data);
 
 	glBindVertexArray(bgVAO);
 	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
@@ -212,68 +294,63 @@ Vec3d Old100Trans = Vec3d(0, 0, 0);
 Vec3d Accumulate100 = Vec3d(0, 0, 0);
 Vec3d Old200Trans = Vec3d(0, 0, 0);
 
-void drawModel()
+// Stands the statue upright on the board plane at the origin, height board
+// units tall: its base centred there and its y axis along the board's z,
+// which faces the camera
+glm::mat4 standingMatrix(float height)
 {
-	glEnable(GL_DEPTH_TEST);
-	modelShader.Use();
-
-	double f_x = intrinsic.at<double>(0, 0);
-	double f_y = intrinsic.at<double>(1, 1);
-
-	double c_x = intrinsic.at<double>(0, 2);
-	double c_y = intrinsic.at<double>(1, 2);
+	const Bounds& bounds = statue.BoundingBox();
+	glm::vec3 base = bounds.Center();
+	base.y = bounds.lower.y;
+	float scale = height / max(bounds.upper.y - bounds.lower.y, 1e-6f);
 
+	glm::mat4 model;
+	model = glm::rotate(model, glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+	model = glm::scale(model, glm::vec3(scale, scale, scale));
+	return glm::translate(model, -base);
+}
 
-	float near = 0.1;
-	float far = 6000;
-	
-	float right = (windowWidth - c_x) * near / f_x;
-	float left = -c_x * near / f_x;
-	float top = (windowHeight - c_y) * near / f_y;
-	float bottom = (-c_y * near) / f_y;
+// Keeps the anchor if any of the model would be on screen there
+void addAnchor(const glm::mat4& viewProjection, const glm::mat4& model)
+{
+	if (Frustum(viewProjection * model).Intersects(statue.BoundingBox()))
+		anchorTransforms.push_back(model);
+}
 
-	cout << f_x << " " << f_y << " " << c_x << " " << c_y << endl;
-	/*
-	glm::mat4 projection = glm::mat4(
-		-2.0 * f_x / windowWidth, 
-		0.0, 
-		0.0, 
-		0.0, 
-
-		0.0, 
-		2.0 * f_y / windowWidth, 
-		0.0, 
-		0.0,
-
-		2.0 * c_x / windowWidth - 1.0, 
-		2.0 * c_y / windowHeight - 1.0,
-		-(far + near) / (far - near),
-		-1.0,
-
-		0.0,
-		0.0,
-		-2.0 * far * near / (far - near),
-		0.0
-	);
-	*/
+void drawAnchors(const glm::mat4& viewProjection)
+{
+	anchorTransforms.clear();
+	if (boardVisible)
+	{
+		glm::mat4 board = CameraModel::PoseMatrix(r_vecs, t_vecs);
+		for (size_t i = 0; i < markerCenters.size(); i++)
+		{
+			const Vec3d& center = markerCenters[i];
+			glm::vec3 offset((float)center[0], (float)center[1], (float)center[2]);
+			addAnchor(viewProjection, glm::translate(board, offset) * anchorPlacement);
+		}
+	}
+	for (size_t i = 0; i < c_t_vecs.size(); i++)
+		addAnchor(viewProjection, CameraModel::PoseMatrix(c_r_vecs[i], c_t_vecs[i]) * anchorPlacement);
 
+	if (anchorTransforms.empty())
+		return;
+	instancedShader.Use();
+	statue.DrawInstanced(instancedShader, &anchorTransforms[0], (int)anchorTransforms.size(), &viewProjection);
+}
 
-	/*
-	glm::mat4 projection = glm::mat4(
-		2 * near / (right - left), 0, (right + left) / (right - left), 0,
-		0, 2 * near / (top - bottom), (top + bottom)/(top - bottom), 0,
-		0, 0, -(far + near) / (far - near), -2 * far * near / (far - near),
-		0, 0, -1, 1 
-	);
-
-	projection = glm::transpose(projection);
-	*/
+void drawModel()
+{
+	glEnable(GL_DEPTH_TEST);
+	modelShader.Use();
 
-	glm::mat4 projection = glm::perspective(glm::radians(90.0f), (float)windowWidth / (float)windowHeight, 0.1f, 5000.0f);
+	// Built from the calibration once; the background fills the viewport, so
+	// the capture resolution defines clip space, not the window's. A distorted
+	// camera's background is drawn undistorted.
+	const glm::mat4& projection = cameraModel.Distorted() ? cameraModel.RectifiedProjection() : cameraModel.Projection();
 
 	glm::mat4 view = camera.GetViewMatrix();
-	glUniformMatrix4fv(glGetUniformLocation(modelShader.Program, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
-	glUniformMatrix4fv(glGetUniformLocation(modelShader.Program, "view"), 1, GL_FALSE, glm::value_ptr(view));
+	cameraBuffer.Update(projection, view);
 	
 	if (c_r_vecs.size() > 0)
 	{
@@ -288,107 +365,204 @@ void drawModel()
 		}
 		Old100Trans = trans;
 		Accumulate100 += offset * 50;
-		cout << offset << endl;
+		AsyncLogger::Instance().Write(LOG_DEBUG, "RENDER", "controller 100 offset", offset.val, 3);
 	}
 
 	if (c_r_vecs.size() > 1)
 	{
 		Vec3d trans = c_t_vecs[1];
-		cout << trans << endl;
+		AsyncLogger::Instance().Write(LOG_DEBUG, "RENDER", "controller 200 translation", trans.val, 3);
 	}
 
 
-	glm::mat4 model;
-
-	//t_vecs += Accumulate100;
-
-	model = glm::translate(model, glm::vec3(t_vecs[0] * 3.5, -t_vecs[1] * 3.5, -t_vecs[2]));
-	Mat cvRotateMat;
-	Rodrigues(r_vecs, cvRotateMat);
-
+	glm::mat4 model = CameraModel::PoseMatrix(r_vecs, t_vecs) * statuePlacement;
 
-	//cvRotateMat = cvRotateMat.inv();
-
-	Mat invertAxis = Mat::eye(Size(3, 3), CV_64F);
-	invertAxis.at<double>(2, 2) = 1;
-	invertAxis.at<double>(1, 1) = -1;
-	invertAxis.at<double>(0, 0) = -1;
-
-	cvRotateMat = invertAxis * cvRotateMat;
-
-
-	/*
-	Mat Rt = Mat::zeros(4, 4, CV_64F);
-	for (int y = 0; y < 3; y++)
+	// A lost board leaves nothing to draw the statue on
+	if (boardVisible)
 	{
-		for (int x = 0; x < 3; x++)
-			Rt.at<double>(y, x) = cvRotateMat.at<double>(y, x);
+		glUniformMatrix4fv(modelLocation, 1, GL_FALSE, glm::value_ptr(model));
+		statue.Draw(modelShader, projection * view * model);
 	}
 
-	Rt.at<double>(0, 3) = -t_vecs[0];
-	Rt.at<double>(1, 3) = -t_vecs[1];
-	Rt.at<double>(2, 3) = t_vecs[2];
-	Rt.at<double>(3, 3) = 1.0;
+	static LogRateLimit cullLimit(5.0);
+	if (cullLimit.Allow())
+		AsyncLogger::Instance().Write(LOG_DEBUG, "RENDER", "statue submeshes, triangles drawn",
+			{ (double)(boardVisible ? statue.Visible() : 0), (double)(boardVisible ? statue.Triangles() : 0) });
 
-	Rt = invertAxis * Rt;
-	glm::mat4x4 rMat = glm::mat4x4(
-		Rt.at<double>(0, 0), Rt.at<double>(0, 1), Rt.at<double>(0, 2), Rt.at<double>(0, 3), 
-		Rt.at<double>(1, 0), Rt.at<double>(1, 1), Rt.at<double>(1, 2), Rt.at<double>(1, 3),
-		Rt.at<double>(2, 0), Rt.at<double>(2, 1), Rt.at<double>(2, 2), Rt.at<double>(2, 3),
-		Rt.at<double>(3, 0), Rt.at<double>(3, 1), Rt.at<double>(3, 2), Rt.at<double>(3, 3)
-	);
-
-
-	*/
-
-	/*
-	glm::mat4x4 rMat = glm::mat4x4(
-		cvRotateMat.at<double>(0, 0), cvRotateMat.at<double>(0, 1), cvRotateMat.at<double>(0, 2), 0, 
-		cvRotateMat.at<double>(1, 0), cvRotateMat.at<double>(1, 1), cvRotateMat.at<double>(1, 2), 0,
-		cvRotateMat.at<double>(2, 0), cvRotateMat.at<double>(2, 1), cvRotateMat.at<double>(2, 2), 0,
-		0 , 0, 0, 1
-	);
-
-//	rMat = glm::transpose(rMat);
-	model = model * rMat;
-	*/
+	if (anchors)
+		drawAnchors(projection * view);
+}
 
+void drawScene()
+{
+	glClearColor(0.5f, 0.5f, 0.5f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+	{
+		ScopedTimer timer(stages.background);
+		backgroundTimer.Begin();
+		drawBackground();
+		backgroundTimer.End();
+	}
+	{
+		ScopedTimer timer(stages.model);
+		modelTimer.Begin();
+		drawModel();
+		modelTimer.End();
+	}
 
-	model = glm::rotate(model, (float)r_vecs[2], glm::vec3(0.0f, 1.0f, 0.0f));
-	model = glm::rotate(model, glm::radians(30.0f), glm::vec3(1.0, 0.0, 0.0));
+	ScopedTimer timer(stages.swap);
+	if (headless)
+	{
+		offscreen.Readback(renderedSequence, *sink);
+		offscreen.Collect(*sink, false);
+	}
+	else
+		glfwSwapBuffers(window);
+}
 
-	model = glm::scale(model, glm::vec3(1000.0f, 1000.0f, 1000.0f));
+// Capture stage: grabs frames as fast as the source delivers them. Frames are
+// stamped with the render clock, whatever time the source gives them.
+// Recordings are played back at their own frame rate, except headless, where
+// every frame is read as soon as detection has taken the previous one.
+// firstFrame, already read to size the buffers, is handed on first.
+void captureLoop(FrameSource& source, const Mat& firstFrame, double firstTime)
+{
+	unsigned long long sequence = 0;
+	double sourceTime, firstSourceTime = 0;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	// Failed reads of a live source, e.g. an unplugged or stalled camera
+	static LogRateLimit failureLimit(5.0);
+	unsigned long long failures = 0;
+	while (running)
+	{
+		CapturedFrame& frame = captureRing.Back();
+		bool read;
+		{
+			ScopedTimer timer(stages.capture);
+			if (sequence == 0)
+			{
+				firstFrame.copyTo(frame.image);
+				sourceTime = firstTime;
+				read = true;
+			}
+			else
+			{
+				read = source.Read(frame.image, sourceTime);
+			}
+		}
+		if (!read || frame.image.empty())
+		{
+			if (!source.Live())
+				break;
+			failures++;
+			if (failureLimit.Allow())
+				AsyncLogger::Instance().Write(LOG_WARNING, "CAPTURE", "failed reads of a live source", { (double)failures });
+			// Retrying at once would spin a core for as long as the camera is gone
+			this_thread::sleep_for(chrono::milliseconds(2));
+			continue;
+		}
 
+		if (!source.Live() && !headless)
+		{
+			if (sequence == 0)
+				firstSourceTime = sourceTime;
+			this_thread::sleep_until(start + chrono::duration_cast<chrono::steady_clock::duration>(
+				chrono::duration<double>(sourceTime - firstSourceTime)));
+		}
 
+		frame.sequence = sequence++;
+		frame.timestamp = secondsNow();
+		if (headless)
+			captureRing.WaitConsumed(running);
+		captureRing.Publish();
+	}
+	capturing = false;
+}
 
+// Detection stage: marker detection and pose estimation on the newest captured
+// frame. The annotated image and the poses are handed to the render stage.
+void detectLoop(DetectionPipeline& pipeline)
+{
+	// Frames before every buffer has grown to its working size
+	const int warmupFrames = 30;
+	int frames = 0;
 
+	// Solver iterations per estimated pose, reported once a second
+	int estimates = 0, iterationSum = 0;
+	double reportTime = secondsNow();
 
-	glUniformMatrix4fv(glGetUniformLocation(modelShader.Program, "model"), 1, GL_FALSE, glm::value_ptr(model));
+	while (captureRing.WaitAcquire(capturing))
+	{
+		ScopedTimer frameTimer(stages.detectFrame);
+		CapturedFrame& captured = captureRing.Front();
+		DetectedFrame& detected = detectionRing.Back();
 
+		unsigned long long allocations = AllocationCount();
 
-	statue.Draw(modelShader);
+		pipeline.Process(captured.image, captured.timestamp, captured.sequence, true);
+		if (pipeline.BoardFound())
+		{
+			estimates++;
+			iterationSum += pipeline.Iterations();
+		}
 
-}
+		detected.r_vecs = pipeline.Rvec();
+		detected.t_vecs = pipeline.Tvec();
+		detected.c_r_vecs = pipeline.ControllerRvecs();
+		detected.c_t_vecs = pipeline.ControllerTvecs();
+		detected.pose = pipeline.Pose();
+		detected.sequence = captured.sequence;
+		detected.timestamp = captured.timestamp;
 
-void drawScene(InputArray image)
-{
-	glClearColor(0.5f, 0.5f, 0.5f, 1.0f);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		allocations = AllocationCount() - allocations;
+		if (++frames > warmupFrames && allocations > 0)
+			AsyncLogger::Instance().Write(LOG_WARNING, "DETECT", "heap allocations, frame", { (double)allocations, (double)captured.sequence });
 
-	drawBackground(image);
-	drawModel();
+		if (captured.timestamp - reportTime >= 1.0 && estimates > 0)
+		{
+			AsyncLogger::Instance().Write(LOG_INFO, "DETECT", "PnP iterations per pose", { (double)iterationSum / estimates });
+			estimates = iterationSum = 0;
+			reportTime = captured.timestamp;
+		}
 
-	glfwSwapBuffers(window);
+		// Hand the buffer over instead of copying it; the capture ring gets the
+		// previous buffer of this slot back for reuse.
+		swap(detected.image, captured.image);
+		swap(detected.buffer, captured.buffer);
+		// Headless output must get every frame, however slow rendering is
+		if (headless)
+			detectionRing.WaitConsumed(running);
+		detectionRing.Publish();
+	}
+	detecting = false;
 }
 
-int main()
+// ar [source] [--headless output] [--anchors] [--occlusion]
+//   source  camera index (default 1), video file, image sequence pattern or
+//           synthetic[:frames], see openFrameSource
+//   output  video file, or image pattern such as out/%05d.png; renders
+//           without a window until the source ends
+//   --anchors  also stand a small copy of the model on every board marker
+//              and controller
+//   --occlusion  skip statue parts hidden behind its nearer parts, with
+//                occlusion queries
+int main(int argc, char** argv)
 {
-
-	VideoCapture cap(1);
-
-	
-	Mat image;
+	const char* sourceSpec = "1";
+	const char* output = nullptr;
+	for (int i = 1; i < argc; i++)
+	{
+		if (string(argv[i]) == "--headless" && i + 1 < argc)
+			output = argv[++i];
+		else if (string(argv[i]) == "--anchors")
+			anchors = true;
+		else if (string(argv[i]) == "--occlusion")
+			occlusion = true;
+		else
+			sourceSpec = argv[i];
+	}
+	headless = output != nullptr;
 
 	/*
 	namedWindow(ARWindowName, WINDOW_OPENGL);
@@ -396,14 +570,30 @@ int main()
 	setOpenGlContext(ARWindowName);
 	*/
 
-	initGLEnv();
+	if (initGLEnv() != 0)
+		return -1;
 
 	bgShader = Shader("bg_v.glsl", "bg_f.glsl");
 	modelShader = Shader("vertex.glsl", "fragment.glsl");
+	modelLocation = modelShader.Uniform("model");
+	if (anchors)
+		instancedShader = Shader("instanced_v.glsl", "fragment.glsl");
+	cameraBuffer.Init();
+
+	// The background samplers never change unit
+	bgShader.Use();
+	glUniform1i(bgShader.Uniform("bgImage"), 0);
+	glUniform1i(bgShader.Uniform("undistortMap"), 1);
 	statue = Model("LibertyStatue/LibertStatue.obj");
+	statue.SetOcclusionQueries(occlusion);
+	statue.SetLodThreshold(lodPixels, windowWidth, windowHeight);
+	// Offline output should not start with placeholder textures
+	if (headless)
+		TextureLoader::Instance().Finish();
 	
 
-	namedWindow("Marker");
+	if (!headless)
+		namedWindow("Marker");
 
 
 	int markerLength = 150;
@@ -416,12 +606,29 @@ int main()
 	Ptr<Dictionary> dictionary = getPredefinedDictionary(DICT_7X7_1000);
 
 	Ptr<DetectorParameters> parameters = DetectorParameters::create();
+	TrackerParameters trackerParameters;
+	PyramidParameters pyramidParameters;
 
 	Ptr<GridBoard> board = GridBoard::create(markersX, markersY, float(markerLength), float(markerSeparation), dictionary);
 
 	Mat boardImage;
 	board->draw(imageSize, boardImage, markerSeparation, 1);
 
+	for (size_t i = 0; i < board->objPoints.size(); i++)
+	{
+		const vector<Point3f>& corners = board->objPoints[i];
+		Point3f center = (corners[0] + corners[1] + corners[2] + corners[3]) * 0.25f;
+		markerCenters.push_back(Vec3d(center.x, center.y, center.z));
+	}
+
+	// The statue is as tall as the board and stands on its middle
+	Size gridSize = board->getGridSize();
+	float boardWidth = gridSize.width * float(markerLength + markerSeparation) - markerSeparation;
+	float boardHeight = gridSize.height * float(markerLength + markerSeparation) - markerSeparation;
+	statuePlacement = glm::translate(glm::mat4(), glm::vec3(boardWidth * 0.5f, boardHeight * 0.5f, 0.0f)) *
+		standingMatrix(boardHeight);
+	anchorPlacement = standingMatrix(anchorHeight);
+
 
 
 	Mat markerImage1;
@@ -434,66 +641,142 @@ int main()
 	imwrite("marker_left.jpg", markerImage1);
 	imwrite("marker_right.jpg", markerImage2);
 
-	imshow("Marker", boardImage);
+	if (!headless)
+		imshow("Marker", boardImage);
 
-	FileStorage fs;
-	fs.open("camera.xml", FileStorage::READ);
+	Ptr<FrameSource> source = openFrameSource(sourceSpec, board);
+	Mat firstFrame;
+	double firstTime;
+	if (!source || !source->Read(firstFrame, firstTime))
+	{
+		cout << "ERROR::SOURCE::NO_FRAMES " << sourceSpec << endl;
+		return -1;
+	}
+	// Output runs at the rate of the input
+	if (headless)
+		sink = openFrameSink(output, source->FrameRate());
+
+	// Synthetic frames come with their own camera
+	Mat sourceMatrix, sourceDistortion;
+	if (source->Intrinsics(sourceMatrix, sourceDistortion))
+		cameraModel.Set(sourceMatrix, sourceDistortion);
+	else if (!cameraModel.Load("camera.xml"))
+		return -1;
+	// Board units are those of markerLength; the board is metres away
+	cameraModel.SetClipRange(10.0f, 20000.0f);
+	cameraModel.Resize(firstFrame.cols, firstFrame.rows);
+	// Lens distortion is corrected by bg_f.glsl through a map built here once
+	if (cameraModel.Distorted())
+		undistortTexture.Update(cameraModel);
+	bgShader.Use();
+	glUniform1i(bgShader.Uniform("undistort"), cameraModel.Distorted() ? 1 : 0);
 
-	fs["Intrinsic"] >> intrinsic;
-	fs["DistortionCoefficients"] >> distCoeffs;
+	bgStream.Init(firstFrame.cols, firstFrame.rows);
 
-	fs.release();
+	// Full scans on large frames detect on a half resolution level
+	if (firstFrame.cols >= 1920)
+		pyramidParameters.levels = 1;
 
-	while(!glfwWindowShouldClose(window))
+	for (int i = 0; i < 3; i++)
 	{
-		vector<int> markerIds;
-		vector<vector<Point2f>> markerCorners, rejectedCandidatees;
-		cap >> image;
-		detectMarkers(image, dictionary, markerCorners, markerIds, parameters, rejectedCandidatees);
-		refineDetectedMarkers(image, board, markerCorners, markerIds, rejectedCandidatees, intrinsic, distCoeffs);
-		drawDetectedMarkers(image, markerCorners, markerIds);
-		if (markerIds.size() > 0)
-		{
+		CapturedFrame& captured = captureRing.Slot(i);
+		captured.buffer = i;
+		if (bgStream.Persistent())
+			captured.image = Mat(firstFrame.rows, firstFrame.cols, CV_8UC3, bgStream.SlotData(captured.buffer));
+
+		DetectedFrame& detected = detectionRing.Slot(i);
+		detected.buffer = 3 + i;
+		if (bgStream.Persistent())
+			detected.image = Mat(firstFrame.rows, firstFrame.cols, CV_8UC3, bgStream.SlotData(detected.buffer));
+	}
+
+	// Start the logger here so its buffers are not counted against a stage.
+	// AR_POSE_TRACE=<file> records every board pose for replay.
+	AsyncLogger::Instance().SetLevel(LOG_INFO);
+	if (getenv("AR_POSE_TRACE"))
+		AsyncLogger::Instance().OpenTrace(getenv("AR_POSE_TRACE"));
+
+	registerStages();
+	DetectionPipeline pipeline(dictionary, parameters, trackerParameters, pyramidParameters, board,
+		cameraModel.CameraMatrix(), cameraModel.DistCoeffs());
 
-			int markers = cEstimatePoseBoard(markerCorners, markerIds, board, intrinsic, distCoeffs, r_vecs, t_vecs);
+	thread captureThread(captureLoop, ref(*source), cref(firstFrame), firstTime);
+	thread detectThread(detectLoop, ref(pipeline));
 
-			if (markers > 0)
-				drawAxis(image, intrinsic, distCoeffs, r_vecs, t_vecs, 100);
+	while (headless ? detecting || detectionRing.Pending() : !glfwWindowShouldClose(window))
+	{
+		// Headless output gets one frame per detected frame, not repeats
+		if (headless && !detectionRing.Pending())
+		{
+			this_thread::sleep_for(chrono::milliseconds(1));
+			continue;
+		}
 
-			vector<vector<Point2f>> controllerCorners;
-			for (int i = 0; i < markerIds.size(); i++)
+		// Render stage: redraws at its own cadence and picks up the newest
+		// detection result whenever one is ready.
+		ScopedTimer frameTimer(stages.renderFrame);
+		double displayTime = secondsNow() + displayLatency;
+		if (detectionRing.Pending())
+		{
+			// The frame we are about to give up goes back to the capture
+			// stage, so the GPU must be done reading its buffer.
+			bgStream.Release(detectionRing.Front().buffer);
+			detectionRing.Acquire();
+
+			DetectedFrame& detected = detectionRing.Front();
+			r_vecs = detected.r_vecs;
+			t_vecs = detected.t_vecs;
+			c_r_vecs = detected.c_r_vecs;
+			c_t_vecs = detected.c_t_vecs;
+			boardPose = detected.pose;
+			overlay.Draw(detected.image);
+
+			// Offline there is no display to lead, draw the pose of the frame
+			if (headless)
 			{
-				switch (markerIds[i])
-				{
-				case 100:
-					if (controllerCorners.size() == 0)
-						controllerCorners.push_back(markerCorners[i]);
-					else
-					{
-						controllerCorners.push_back(controllerCorners[0]);
-						controllerCorners[0] = markerCorners[i];
-					}
-					break;
-				case 200:
-					controllerCorners.push_back(markerCorners[i]);
-					break;
-				default:
-					break;
-				}
+				displayTime = detected.timestamp;
+				renderedSequence = detected.sequence;
 			}
 
+			ScopedTimer timer(stages.upload);
+			uploadBackground(detected);
+		}
 
-			estimatePoseSingleMarkers(controllerCorners, 10, intrinsic, distCoeffs, c_r_vecs, c_t_vecs);
-
-			for (int i = 0; i < c_r_vecs.size(); i++)
-				drawAxis(image, intrinsic, distCoeffs, c_r_vecs[i], c_t_vecs[i], 5);
+		if (TextureLoader::Instance().Pending() > 0)
+		{
+			ScopedTimer timer(stages.textures);
+			TextureLoader::Instance().Update(textureBudget);
 		}
-		drawScene(image);
-		waitKey(1);
+
+		// Draw the board pose where it will be when this frame is shown,
+		// not where it was when the camera saw it
+		boardVisible = boardPose.At(displayTime, r_vecs, t_vecs) && displayTime - boardPose.time <= maxPoseAge;
+		drawScene();
+		if (!headless)
+			waitKey(1);
+	}
+
+	running = false;
+	detectThread.join();
+	captureThread.join();
+
+	TextureCacheStats textureStats = TextureCache::Instance().Stats();
+	AsyncLogger::Instance().Write(LOG_INFO, "TEXTURE", "cache hits, misses, textures, MB",
+		{ (double)textureStats.hits, (double)textureStats.misses, (double)textureStats.textures, textureStats.bytes / 1048576.0 });
+	statue.Release();
+	undistortTexture.Release();
+
+	if (headless)
+	{
+		offscreen.Collect(*sink, true);
+		sink.release();
 	}
 
+	Profiler::Instance().WriteCSV("profile.csv");
+	Profiler::Instance().WriteJSON("profile.json");
 
-	waitKey(0);
+	if (!headless)
+		waitKey(0);
 
 	return 0;
 
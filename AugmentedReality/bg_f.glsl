@@ -5,8 +5,14 @@ in vec2 TexCoords;
 out vec4 color;
 
 uniform sampler2D bgImage;
+// Where each pixel of the undistorted image lies in the camera frame, see
+// UndistortTexture.hpp
+uniform sampler2D undistortMap;
+uniform bool undistort;
 
 void main()
 {
-	color = vec4(texture(bgImage, TexCoords));
-}
\ No newline at end of file
+	vec2 source = undistort ? texture(undistortMap, TexCoords).rg : TexCoords;
+	// Camera frames are uploaded as BGR
+	color = vec4(texture(bgImage, source).bgr, 1.0f);
+}
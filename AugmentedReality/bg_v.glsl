@@ -7,5 +7,6 @@ out vec2 TexCoords;
 void main()
 {
 	gl_Position = vec4(position, 1.0f);
-	TexCoords = texCoords;
+	// Camera frames are uploaded top-down, flip them here instead of on the CPU
+	TexCoords = vec2(texCoords.x, 1.0f - texCoords.y);
 }
\ No newline at end of file
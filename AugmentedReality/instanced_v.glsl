@@ -0,0 +1,25 @@
+#version 330 core
+// PackedVertex: position in [0, 1] of the model's bounds, octahedral normal
+// (unread until a lit shader needs it)
+layout(location = 0) in vec3 position;
+layout(location = 1) in vec2 normal;
+layout(location = 2) in vec2 texCoords;
+// One model matrix per instance, see Model::DrawInstanced
+layout(location = 3) in mat4 instanceModel;
+
+out vec2 TexCoords;
+
+layout(std140) uniform Camera
+{
+	mat4 projection;
+	mat4 view;
+};
+
+uniform vec3 positionScale;
+uniform vec3 positionOffset;
+
+void main()
+{
+	gl_Position = projection * view * instanceModel * vec4(position * positionScale + positionOffset, 1.0f);
+	TexCoords = texCoords;
+}
\ No newline at end of file
@@ -0,0 +1,822 @@
+#define GLEW_STATIC
+#include <GL/glew.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/aruco.hpp>
+#include <opencv2/calib3d/calib3d.hpp>
+
+#include "PyramidDetector.hpp"
+#include "SyntheticBoard.hpp"
+#include "ThresholdKernel.h"
+#include "PoseBatch.hpp"
+#include "ThreadPool.hpp"
+#include "DetectionPipeline.hpp"
+#include "FrameSource.hpp"
+#include "Profiler.hpp"
+#include "AllocationCounter.h"
+#include "CompressedTexture.hpp"
+
+using namespace cv;
+using namespace std;
+using namespace cv::aruco;
+
+const int markersX = 6;
+const int markersY = 4;
+const float markerLength = 150;
+const float markerSeparation = 25;
+
+struct SyntheticFrame
+{
+	Mat image;
+	Vec3d rvec, tvec;
+	vector<vector<Point2f>> corners;
+	vector<int> ids;
+};
+
+// A synthetic 4K camera looking at the GridBoard from random poses
+static void makeSyntheticFrames(const Ptr<GridBoard>& board, Size imageSize, int count, Mat& cameraMatrix, vector<SyntheticFrame>& frames)
+{
+	double f = imageSize.width * 0.8;
+	cameraMatrix = (Mat_<double>(3, 3) <<
+		f, 0, (imageSize.width - 1) * 0.5,
+		0, f, (imageSize.height - 1) * 0.5,
+		0, 0, 1);
+
+	SyntheticBoard synthetic(board, 2.0f);
+
+	Point3f boardCenter(
+		(markersX * (markerLength + markerSeparation) - markerSeparation) * 0.5f,
+		(markersY * (markerLength + markerSeparation) - markerSeparation) * 0.5f, 0);
+
+	RNG rng(12345);
+	frames.resize(count);
+	for (int i = 0; i < count; i++)
+	{
+		SyntheticFrame& frame = frames[i];
+
+		// Board facing the camera, tilted by up to 35 degrees, at varying distance
+		Vec3d tilt(rng.uniform(-0.6, 0.6), rng.uniform(-0.6, 0.6), rng.uniform(-3.14, 3.14));
+		Vec3d flipToCamera(CV_PI, 0, 0);
+		Mat R, R0, R1;
+		Rodrigues(flipToCamera, R0);
+		Rodrigues(tilt, R1);
+		R = R0 * R1;
+		Rodrigues(R, frame.rvec);
+
+		double distance = rng.uniform(2500.0, 7000.0);
+		Mat center = R * Mat(Vec3d(boardCenter.x, boardCenter.y, boardCenter.z));
+		frame.tvec = Vec3d(rng.uniform(-300.0, 300.0), rng.uniform(-200.0, 200.0), distance) - Vec3d(center);
+
+		synthetic.Render(imageSize, cameraMatrix, frame.rvec, frame.tvec, frame.image, frame.corners, frame.ids);
+	}
+}
+
+// Coarse-to-fine detection: speed against corner accuracy per pyramid level
+static int pyramidBenchmark(int frameCount)
+{
+	Ptr<Dictionary> dictionary = getPredefinedDictionary(DICT_7X7_1000);
+	Ptr<GridBoard> board = GridBoard::create(markersX, markersY, markerLength, markerSeparation, dictionary);
+	Ptr<DetectorParameters> parameters = DetectorParameters::create();
+
+	Size imageSize(3840, 2160);
+	Mat cameraMatrix;
+	vector<SyntheticFrame> frames;
+	makeSyntheticFrames(board, imageSize, frameCount, cameraMatrix, frames);
+
+	printf("pyramid: %d synthetic frames at %dx%d\n", frameCount, imageSize.width, imageSize.height);
+	printf("%-8s %10s %10s %12s %12s\n", "levels", "ms/frame", "detected", "mean err px", "max err px");
+
+	for (int levels = 0; levels <= 3; levels++)
+	{
+		PyramidParameters pyramidParameters;
+		pyramidParameters.levels = levels;
+		PyramidDetector detector(dictionary, parameters, pyramidParameters);
+
+		int visible = 0, detected = 0;
+		double errorSum = 0, errorMax = 0;
+		int errorCount = 0;
+		int64 ticks = 0;
+
+		vector<vector<Point2f>> corners, rejected;
+		vector<int> ids;
+
+		for (size_t i = 0; i < frames.size(); i++)
+		{
+			const SyntheticFrame& frame = frames[i];
+
+			int64 start = getTickCount();
+			detector.Detect(frame.image, corners, ids, rejected);
+			ticks += getTickCount() - start;
+
+			map<int, int> truthIndex;
+			for (size_t j = 0; j < frame.ids.size(); j++)
+			{
+				if (SyntheticBoard::Visible(frame.corners[j], imageSize))
+				{
+					truthIndex[frame.ids[j]] = (int)j;
+					visible++;
+				}
+			}
+
+			for (size_t k = 0; k < ids.size(); k++)
+			{
+				map<int, int>::iterator truth = truthIndex.find(ids[k]);
+				if (truth == truthIndex.end())
+					continue;
+				detected++;
+				for (int p = 0; p < 4; p++)
+				{
+					double error = norm(corners[k][p] - frame.corners[truth->second][p]);
+					errorSum += error;
+					errorMax = max(errorMax, error);
+					errorCount++;
+				}
+			}
+		}
+
+		double ms = ticks * 1000.0 / getTickFrequency() / frames.size();
+		printf("%-8d %10.2f %9.1f%% %12.3f %12.3f\n", levels, ms,
+			visible > 0 ? 100.0 * detected / visible : 0.0,
+			errorCount > 0 ? errorSum / errorCount : 0.0, errorMax);
+	}
+
+	return 0;
+}
+
+// Fused gray/threshold kernel: bit-exact check against OpenCV and timing of
+// every dispatch path the CPU supports
+static int kernelBenchmark(int width, int height)
+{
+	const int windows[] = { 3, 13, 23 };
+	const int windowCount = 3;
+	const double constant = 7;
+	const int repeats = 20;
+
+	Ptr<Dictionary> dictionary = getPredefinedDictionary(DICT_7X7_1000);
+	Ptr<GridBoard> board = GridBoard::create(markersX, markersY, markerLength, markerSeparation, dictionary);
+	Mat cameraMatrix;
+	vector<SyntheticFrame> frames;
+	makeSyntheticFrames(board, Size(width, height), 1, cameraMatrix, frames);
+
+	// Colour noise on top of the board so every channel and every gray level matters
+	Mat bgr = frames[0].image.clone();
+	Mat noise(bgr.size(), bgr.type());
+	randu(noise, Scalar::all(0), Scalar::all(64));
+	bgr += noise;
+
+	Mat grayReference;
+	Mat binaryReference[windowCount];
+	int64 start = getTickCount();
+	for (int r = 0; r < repeats; r++)
+	{
+		cvtColor(bgr, grayReference, COLOR_BGR2GRAY);
+		for (int k = 0; k < windowCount; k++)
+			adaptiveThreshold(grayReference, binaryReference[k], 255, ADAPTIVE_THRESH_MEAN_C, THRESH_BINARY_INV, windows[k], constant);
+	}
+	double referenceMs = (getTickCount() - start) * 1000.0 / getTickFrequency() / repeats;
+
+	printf("kernel: %dx%d, windows 3/13/23, C = %.0f\n", width, height, constant);
+	printf("%-8s %10s %10s %14s\n", "path", "ms/frame", "speedup", "mismatches");
+	printf("%-8s %10.2f %10s %14s\n", "opencv", referenceMs, "1.00x", "-");
+
+	int failures = 0;
+	for (int path = ThresholdKernel::SCALAR; path <= ThresholdKernel::Detected(); path++)
+	{
+		ThresholdKernel kernel;
+		kernel.SetPath((ThresholdKernel::Path)path);
+
+		Mat gray(bgr.size(), CV_8UC1);
+		Mat binary[windowCount];
+		unsigned char* outputs[windowCount];
+		for (int k = 0; k < windowCount; k++)
+		{
+			binary[k].create(bgr.size(), CV_8UC1);
+			outputs[k] = binary[k].data;
+		}
+
+		start = getTickCount();
+		for (int r = 0; r < repeats; r++)
+			kernel.Process(bgr.data, bgr.step, bgr.cols, bgr.rows, gray.data, gray.step, windows, windowCount, constant, outputs, binary[0].step);
+		double ms = (getTickCount() - start) * 1000.0 / getTickFrequency() / repeats;
+
+		int mismatches = countNonZero(gray != grayReference);
+		for (int k = 0; k < windowCount; k++)
+			mismatches += countNonZero(binary[k] != binaryReference[k]);
+		failures += mismatches;
+
+		printf("%-8s %10.2f %9.2fx %14d\n", ThresholdKernel::PathName((ThresholdKernel::Path)path), ms, referenceMs / ms, mismatches);
+	}
+
+	return failures == 0 ? 0 : 2;
+}
+
+// Batched pose solve: the same set of targets solved on the calling thread
+// only and on the work-stealing pool, from 1 to 64 targets per frame. Even
+// targets are full boards, odd ones single 100 unit controller markers.
+static int batchBenchmark(int repeats)
+{
+	const double noise = 0.3;
+
+	Ptr<Dictionary> dictionary = getPredefinedDictionary(DICT_7X7_1000);
+	Ptr<GridBoard> board = GridBoard::create(markersX, markersY, markerLength, markerSeparation, dictionary);
+
+	Size imageSize(1920, 1080);
+	double f = imageSize.width * 0.8;
+	Mat cameraMatrix = (Mat_<double>(3, 3) <<
+		f, 0, (imageSize.width - 1) * 0.5,
+		0, f, (imageSize.height - 1) * 0.5,
+		0, 0, 1);
+	Mat distCoeffs = Mat::zeros(1, 5, CV_64F);
+
+	vector<Point3f> boardPoints;
+	for (size_t i = 0; i < board->objPoints.size(); i++)
+		boardPoints.insert(boardPoints.end(), board->objPoints[i].begin(), board->objPoints[i].end());
+
+	const int maxTargets = 64;
+	RNG rng(12345);
+	vector<Vec3d> truthR(maxTargets), truthT(maxTargets);
+	vector<vector<Point2f>> projected(maxTargets);
+	vector<vector<Point3f>> objects(maxTargets);
+	for (int i = 0; i < maxTargets; i++)
+	{
+		PoseBatch markers;
+		markers.AddMarker(vector<Point2f>(4), 100);
+		objects[i] = i % 2 == 0 ? boardPoints : markers.At(0).objPoints;
+
+		truthR[i] = Vec3d(CV_PI + rng.uniform(-0.5, 0.5), rng.uniform(-0.5, 0.5), rng.uniform(-0.5, 0.5));
+		truthT[i] = Vec3d(rng.uniform(-500.0, 500.0), rng.uniform(-300.0, 300.0), rng.uniform(2000.0, 5000.0));
+		projectPoints(objects[i], truthR[i], truthT[i], cameraMatrix, distCoeffs, projected[i]);
+		for (size_t p = 0; p < projected[i].size(); p++)
+			projected[i][p] += Point2f((float)rng.gaussian(noise), (float)rng.gaussian(noise));
+	}
+
+	ThreadPool serial(0);
+	ThreadPool pool;
+
+	printf("batch: %d repeats, %d pool workers plus the caller\n", repeats, pool.Workers());
+	printf("%-8s %12s %12s %10s %14s %14s\n", "targets", "serial ms", "pool ms", "speedup", "reproj err px", "trans err");
+
+	for (int targets = 1; targets <= maxTargets; targets *= 2)
+	{
+		PoseBatch batch;
+		double ms[2];
+		ThreadPool* pools[2] = { &serial, &pool };
+		for (int k = 0; k < 2; k++)
+		{
+			int64 ticks = 0;
+			for (int r = 0; r < repeats; r++)
+			{
+				batch.Clear();
+				for (int i = 0; i < targets; i++)
+				{
+					PoseBatch::Group& group = batch.At(batch.Add());
+					group.objPoints = objects[i];
+					group.imgPoints = projected[i];
+				}
+
+				int64 start = getTickCount();
+				batch.Solve(*pools[k], cameraMatrix, distCoeffs);
+				ticks += getTickCount() - start;
+			}
+			ms[k] = ticks * 1000.0 / getTickFrequency() / repeats;
+		}
+
+		double reprojection = 0, translation = 0;
+		int valid = 0;
+		for (int i = 0; i < targets; i++)
+		{
+			const PoseResult& result = batch.Result(i);
+			if (!result.valid)
+				continue;
+			valid++;
+			reprojection += result.reprojectionError;
+			translation += norm(result.tvec - truthT[i]);
+		}
+
+		printf("%-8d %12.3f %12.3f %9.2fx %14.3f %14.2f\n", targets, ms[0], ms[1], ms[0] / ms[1],
+			valid > 0 ? reprojection / valid : 0.0, valid > 0 ? translation / valid : 0.0);
+	}
+
+	return 0;
+}
+
+static double rotationError(const Vec3d& r, const Vec3d& truth)
+{
+	Mat R, T, E;
+	Rodrigues(r, R);
+	Rodrigues(truth, T);
+	Rodrigues(R.t() * T, E);
+	return norm(E);
+}
+
+struct PoseError
+{
+	int count;
+	double translationSum, translationMax;
+	double rotationSum, rotationMax;
+
+	PoseError()
+		: count(0), translationSum(0), translationMax(0), rotationSum(0), rotationMax(0)
+	{
+
+	}
+
+	void Add(const Vec3d& r, const Vec3d& t, const Vec3d& truthR, const Vec3d& truthT)
+	{
+		double translation = norm(t - truthT);
+		double rotation = rotationError(r, truthR) * 180 / CV_PI;
+		count++;
+		translationSum += translation;
+		translationMax = max(translationMax, translation);
+		rotationSum += rotation;
+		rotationMax = max(rotationMax, rotation);
+	}
+
+	void Print(const char* name) const
+	{
+		printf("%-10s %12.2f %12.2f %12.3f %12.3f\n", name,
+			count > 0 ? translationSum / count : 0.0, translationMax,
+			count > 0 ? rotationSum / count : 0.0, rotationMax);
+	}
+};
+
+// Full detection pipeline on recorded or synthetic frames: throughput,
+// per-stage latency and, when the source knows the poses, pose error of the
+// raw solve and of the filtered pose. Stage statistics also go to
+// replay_profile.csv/json so runs can be compared.
+static int replayBenchmark(const string& spec, const string& calibration)
+{
+	Ptr<Dictionary> dictionary = getPredefinedDictionary(DICT_7X7_1000);
+	Ptr<GridBoard> board = GridBoard::create(markersX, markersY, markerLength, markerSeparation, dictionary);
+	Ptr<DetectorParameters> parameters = DetectorParameters::create();
+
+	Ptr<FrameSource> source = openFrameSource(spec, board);
+	Mat frame;
+	double timestamp;
+	if (!source || !source->Read(frame, timestamp))
+	{
+		cout << "ERROR::REPLAY::NO_FRAMES " << spec << endl;
+		return 1;
+	}
+
+	Mat cameraMatrix, distCoeffs;
+	if (!source->Intrinsics(cameraMatrix, distCoeffs))
+	{
+		FileStorage fs(calibration, FileStorage::READ);
+		fs["Intrinsic"] >> cameraMatrix;
+		fs["DistortionCoefficients"] >> distCoeffs;
+		if (cameraMatrix.empty())
+		{
+			cout << "ERROR::REPLAY::NO_CALIBRATION " << calibration << endl;
+			return 1;
+		}
+	}
+
+	TrackerParameters trackerParameters;
+	PyramidParameters pyramidParameters;
+	if (frame.cols >= 1920)
+		pyramidParameters.levels = 1;
+
+	Profiler& profiler = Profiler::Instance();
+	int readStage = profiler.Stage("read");
+	int frameStage = profiler.Stage("detect frame");
+	DetectionPipeline pipeline(dictionary, parameters, trackerParameters, pyramidParameters, board, cameraMatrix, distCoeffs);
+
+	int frames = 0, found = 0;
+	PoseError raw, filtered;
+	int64 start = getTickCount();
+	int64 detectTicks = 0;
+
+	do
+	{
+		int64 frameStart = getTickCount();
+		{
+			ScopedTimer timer(frameStage);
+			pipeline.Process(frame, timestamp, frames, false);
+		}
+		detectTicks += getTickCount() - frameStart;
+		frames++;
+
+		Vec3d truthR, truthT;
+		if (pipeline.BoardFound())
+		{
+			found++;
+			if (source->Truth(truthR, truthT))
+			{
+				raw.Add(pipeline.Rvec(), pipeline.Tvec(), truthR, truthT);
+				Vec3d r, t;
+				if (pipeline.Pose().At(timestamp, r, t))
+					filtered.Add(r, t, truthR, truthT);
+			}
+		}
+
+		ScopedTimer timer(readStage);
+		if (!source->Read(frame, timestamp))
+			break;
+	} while (true);
+
+	double seconds = (getTickCount() - start) / getTickFrequency();
+	double detectSeconds = detectTicks / getTickFrequency();
+
+	printf("replay: %s, %d frames at %dx%d\n", spec.c_str(), frames, frame.cols, frame.rows);
+	printf("throughput %.1f fps end to end, %.1f fps detection only, board found in %.1f%% of frames\n\n",
+		frames / seconds, frames / detectSeconds, 100.0 * found / frames);
+
+	printf("%-20s %10s %10s %10s %10s\n", "stage", "count", "mean ms", "p50 ms", "p99 ms");
+	LatencyHistogram::Counts counts;
+	for (int i = 0; i < profiler.Stages(); i++)
+	{
+		profiler.Histogram(i).Read(counts);
+		printf("%-20s %10llu %10.3f %10.3f %10.3f\n", profiler.Name(i), counts.total,
+			LatencyHistogram::Mean(counts) * 1e-6,
+			LatencyHistogram::Percentile(counts, 0.50) * 1e-6,
+			LatencyHistogram::Percentile(counts, 0.99) * 1e-6);
+	}
+
+	if (raw.count > 0)
+	{
+		printf("\n%-10s %12s %12s %12s %12s\n", "pose", "mean t err", "max t err", "mean r deg", "max r deg");
+		raw.Print("raw");
+		filtered.Print("filtered");
+	}
+
+	profiler.WriteCSV("replay_profile.csv");
+	profiler.WriteJSON("replay_profile.json");
+
+	return found > 0 ? 0 : 2;
+}
+
+// The detection stage as ar.cpp runs it, on synthetic frames: after warm-up
+// no frame may allocate on the detecting thread. Fails when one does, so the
+// allocation-free steady state is checked rather than only logged.
+static int allocationBenchmark(int frames)
+{
+#ifndef AR_COUNT_ALLOCATIONS
+	cout << "ERROR::ALLOCATIONS::NOT_COUNTED build with AR_COUNT_ALLOCATIONS" << endl;
+	return 1;
+#else
+	// Frames before every buffer has grown to its working size, as in ar.cpp
+	const int warmupFrames = 30;
+
+	Ptr<Dictionary> dictionary = getPredefinedDictionary(DICT_7X7_1000);
+	Ptr<GridBoard> board = GridBoard::create(markersX, markersY, markerLength, markerSeparation, dictionary);
+	Ptr<DetectorParameters> parameters = DetectorParameters::create();
+
+	stringstream spec;
+	spec << "synthetic:" << warmupFrames + frames;
+	Ptr<FrameSource> source = openFrameSource(spec.str(), board);
+	Mat frame, cameraMatrix, distCoeffs;
+	double timestamp;
+	if (!source || !source->Read(frame, timestamp) || !source->Intrinsics(cameraMatrix, distCoeffs))
+	{
+		cout << "ERROR::ALLOCATIONS::NO_FRAMES " << spec.str() << endl;
+		return 1;
+	}
+
+	TrackerParameters trackerParameters;
+	PyramidParameters pyramidParameters;
+	if (frame.cols >= 1920)
+		pyramidParameters.levels = 1;
+	DetectionPipeline pipeline(dictionary, parameters, trackerParameters, pyramidParameters, board, cameraMatrix, distCoeffs);
+
+	// What detectLoop copies out of the pipeline every frame
+	Vec3d rvec, tvec;
+	vector<Vec3d> controllerRvecs, controllerTvecs;
+	PoseState pose;
+
+	int processed = 0, allocatingFrames = 0;
+	unsigned long long total = 0;
+	do
+	{
+		unsigned long long allocations = AllocationCount();
+
+		pipeline.Process(frame, timestamp, processed, true);
+		rvec = pipeline.Rvec();
+		tvec = pipeline.Tvec();
+		controllerRvecs = pipeline.ControllerRvecs();
+		controllerTvecs = pipeline.ControllerTvecs();
+		pose = pipeline.Pose();
+
+		allocations = AllocationCount() - allocations;
+		if (++processed > warmupFrames && allocations > 0)
+		{
+			printf("frame %d: %llu allocations\n", processed - 1, allocations);
+			allocatingFrames++;
+			total += allocations;
+		}
+	} while (source->Read(frame, timestamp));
+
+	printf("allocations: %d frames after %d warm-up, %d allocating, %llu allocations\n",
+		processed - warmupFrames, warmupFrames, allocatingFrames, total);
+	return allocatingFrames == 0 ? 0 : 2;
+#endif
+}
+
+// Four colour mode only, which is all encodeColorBlock writes
+static void decodeColorBlock(const unsigned char* block, unsigned char texels[16][4])
+{
+	uint16_t color0 = block[0] | block[1] << 8, color1 = block[2] | block[3] << 8;
+	int palette[4][3];
+	unpackColor565(color0, palette[0]);
+	unpackColor565(color1, palette[1]);
+	for (int c = 0; c < 3; c++)
+	{
+		palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+		palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+	}
+	uint32_t indices = block[4] | block[5] << 8 | block[6] << 16 | (uint32_t)block[7] << 24;
+	for (int i = 0; i < 16; i++)
+	{
+		int p = (indices >> (2 * i)) & 3;
+		for (int c = 0; c < 3; c++)
+			texels[i][c] = (unsigned char)palette[p][c];
+	}
+}
+
+// Eight value mode, or a single value when both ends are equal, which is all
+// encodeAlphaBlock writes
+static void decodeAlphaBlock(const unsigned char* block, unsigned char texels[16][4])
+{
+	int palette[8];
+	palette[0] = block[0];
+	palette[1] = block[1];
+	for (int p = 1; p < 7; p++)
+		palette[p + 1] = ((7 - p) * palette[0] + p * palette[1]) / 7;
+	uint64_t indices = 0;
+	for (int b = 0; b < 6; b++)
+		indices |= (uint64_t)block[2 + b] << (8 * b);
+	for (int i = 0; i < 16; i++)
+		texels[i][3] = (unsigned char)palette[(indices >> (3 * i)) & 7];
+}
+
+// Root mean square error per channel after a round trip through the colour
+// block, or through the alpha block
+static double blockError(const unsigned char texels[16][4], bool alpha)
+{
+	unsigned char block[8], decoded[16][4];
+	if (alpha)
+	{
+		encodeAlphaBlock(texels, block);
+		decodeAlphaBlock(block, decoded);
+	}
+	else
+	{
+		encodeColorBlock(texels, block);
+		decodeColorBlock(block, decoded);
+	}
+
+	int first = alpha ? 3 : 0, last = alpha ? 4 : 3;
+	double sum = 0;
+	for (int i = 0; i < 16; i++)
+	{
+		for (int c = first; c < last; c++)
+		{
+			double d = (double)texels[i][c] - decoded[i][c];
+			sum += d * d;
+		}
+	}
+	return sqrt(sum / (16 * (last - first)));
+}
+
+static bool checkBlock(const char* name, const unsigned char texels[16][4], bool alpha, double limit)
+{
+	double error = blockError(texels, alpha);
+	bool passed = error <= limit;
+	printf("%-4s %-22s rms %6.2f limit %6.2f\n", passed ? "ok" : "FAIL", name, error, limit);
+	return passed;
+}
+
+static void fillTexel(unsigned char texels[16][4], int i, int r, int g, int b, int a = 255)
+{
+	texels[i][0] = (unsigned char)r;
+	texels[i][1] = (unsigned char)g;
+	texels[i][2] = (unsigned char)b;
+	texels[i][3] = (unsigned char)a;
+}
+
+// Mip chain of compressTexture against the sizes a driver expects for a
+// width x height texture, level by level down to 1x1
+static bool checkMipChain(int width, int height, bool alpha)
+{
+	vector<unsigned char> rgba((size_t)width * height * 4, 128);
+	for (size_t i = 3; i < rgba.size(); i += 4)
+		rgba[i] = 255;
+	if (alpha)
+		rgba[3] = 0;
+	CompressedTexture texture;
+	compressTexture(&rgba[0], width, height, texture);
+
+	GLenum format = alpha ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+	bool passed = texture.format == format && texture.width == width && texture.height == height
+		&& (int)texture.sizes.size() == texture.Levels();
+	int levels = 0;
+	size_t offset = 0;
+	for (int w = width, h = height; passed; w = max(1, w / 2), h = max(1, h / 2))
+	{
+		passed = levels < texture.Levels()
+			&& texture.LevelWidth(levels) == w && texture.LevelHeight(levels) == h
+			&& texture.offsets[levels] == offset
+			&& texture.sizes[levels] == (size_t)((w + 3) / 4) * ((h + 3) / 4) * (alpha ? 16 : 8);
+		offset += passed ? texture.sizes[levels] : 0;
+		levels++;
+		if (w == 1 && h == 1)
+			break;
+	}
+	passed = passed && levels == texture.Levels() && texture.data.size() == offset;
+
+	printf("%-4s mips %4dx%-4d %s %2d levels %8u bytes\n", passed ? "ok" : "FAIL", width, height,
+		alpha ? "BC3" : "BC1", texture.Levels(), (unsigned)texture.data.size());
+	return passed;
+}
+
+static bool writeFile(const string& path, const string& contents)
+{
+	FILE* file = fopen(path.c_str(), "wb");
+	if (!file)
+		return false;
+	bool written = fwrite(contents.c_str(), contents.size(), 1, file) == 1;
+	return fclose(file) == 0 && written;
+}
+
+// writeKtx then readKtx gives back the same texture, and a KTX file stops
+// loading once its source changes or goes away
+static bool checkKtx(const CompressedTexture& texture)
+{
+	const string sourcePath = "benchmark_texture.src";
+	const string ktxPath = "benchmark_texture.ktx";
+
+	CompressedTexture loaded;
+	bool passed = writeFile(sourcePath, "source image")
+		&& writeKtx(ktxPath, sourcePath, texture)
+		&& readKtx(ktxPath, sourcePath, loaded)
+		&& loaded.format == texture.format && loaded.width == texture.width && loaded.height == texture.height
+		&& loaded.offsets == texture.offsets && loaded.sizes == texture.sizes && loaded.data == texture.data;
+	printf("%-4s ktx round trip\n", passed ? "ok" : "FAIL");
+
+	// A different size, so the stamp changes within the same second
+	bool stale = writeFile(sourcePath, "edited source image") && !readKtx(ktxPath, sourcePath, loaded);
+	printf("%-4s ktx rejected after its source changed\n", stale ? "ok" : "FAIL");
+
+	remove(sourcePath.c_str());
+	bool missing = !readKtx(ktxPath, sourcePath, loaded);
+	printf("%-4s ktx rejected without its source\n", missing ? "ok" : "FAIL");
+
+	remove(ktxPath.c_str());
+	return passed && stale && missing;
+}
+
+// Texture transcoding: BC1 and BC3 block round trips against the GPU's
+// decoding, mip chain layout, the KTX cache, and the time to compress a
+// width x height image with its mips
+static int textureBenchmark(int width, int height)
+{
+	bool passed = true;
+	unsigned char texels[16][4];
+
+	for (int i = 0; i < 16; i++)
+		fillTexel(texels, i, 90, 160, 30);
+	passed &= checkBlock("flat", texels, false, 4.0);
+
+	// Colours differing only orthogonally to grey
+	for (int i = 0; i < 16; i++)
+		fillTexel(texels, i, ((i & 1) ^ (i >> 2 & 1)) ? 255 : 0, ((i & 1) ^ (i >> 2 & 1)) ? 0 : 255, 0);
+	passed &= checkBlock("red/green checker", texels, false, 4.0);
+
+	for (int i = 0; i < 16; i++)
+		fillTexel(texels, i, i * 16, 255 - i * 16, 40);
+	passed &= checkBlock("red to green ramp", texels, false, 20.0);
+
+	for (int i = 0; i < 16; i++)
+		fillTexel(texels, i, 40 + i * 8, 40 + i * 8, 40 + i * 8);
+	passed &= checkBlock("grey ramp", texels, false, 12.0);
+
+	for (int i = 0; i < 16; i++)
+		fillTexel(texels, i, 200, 60 + i * 10, 255 - i * 12);
+	passed &= checkBlock("green to blue ramp", texels, false, 16.0);
+
+	// Two colours mixed at random, as in most real blocks
+	srand(1);
+	bool mixed = true;
+	for (int k = 0; k < 100 && mixed; k++)
+	{
+		int a[3] = { rand() % 256, rand() % 256, rand() % 256 }, b[3] = { rand() % 256, rand() % 256, rand() % 256 };
+		for (int i = 0; i < 16; i++)
+		{
+			float t = (rand() % 256) / 255.0f;
+			fillTexel(texels, i, (int)(a[0] + (b[0] - a[0]) * t), (int)(a[1] + (b[1] - a[1]) * t), (int)(a[2] + (b[2] - a[2]) * t));
+		}
+		mixed = blockError(texels, false) <= 24.0;
+	}
+	passed &= checkBlock("two colour mix", texels, false, 24.0);
+
+	// Alpha: eight levels between the extremes, so a ramp is off by at most
+	// half a step of (max - min) / 7
+	for (int i = 0; i < 16; i++)
+		fillTexel(texels, i, 0, 0, 0, 77);
+	passed &= checkBlock("flat alpha", texels, true, 0.0);
+
+	for (int i = 0; i < 16; i++)
+		fillTexel(texels, i, 0, 0, 0, (i & 1) ? 255 : 0);
+	passed &= checkBlock("alpha cutout", texels, true, 0.0);
+
+	for (int i = 0; i < 16; i++)
+		fillTexel(texels, i, 0, 0, 0, i * 17);
+	passed &= checkBlock("alpha ramp", texels, true, 255.0 / 14);
+
+	bool alphaMixed = true;
+	for (int k = 0; k < 100 && alphaMixed; k++)
+	{
+		for (int i = 0; i < 16; i++)
+			fillTexel(texels, i, 0, 0, 0, rand() % 256);
+		alphaMixed = blockError(texels, true) <= 255.0 / 14;
+	}
+	passed &= checkBlock("random alpha", texels, true, 255.0 / 14);
+
+	passed &= checkMipChain(256, 256, false);
+	passed &= checkMipChain(100, 60, false);
+	passed &= checkMipChain(1, 7, true);
+	passed &= checkMipChain(13, 1, true);
+
+	// A natural-ish image: the synthetic board with noise, and a soft alpha
+	Ptr<Dictionary> dictionary = getPredefinedDictionary(DICT_7X7_1000);
+	Ptr<GridBoard> board = GridBoard::create(markersX, markersY, markerLength, markerSeparation, dictionary);
+	Mat cameraMatrix;
+	vector<SyntheticFrame> frames;
+	makeSyntheticFrames(board, Size(width, height), 1, cameraMatrix, frames);
+	Mat noise(frames[0].image.size(), frames[0].image.type());
+	randu(noise, Scalar::all(0), Scalar::all(32));
+	Mat rgba;
+	cvtColor(frames[0].image + noise, rgba, COLOR_BGR2RGBA);
+
+	CompressedTexture texture;
+	int64 start = getTickCount();
+	compressTexture(rgba.data, rgba.cols, rgba.rows, texture);
+	double opaqueMs = (getTickCount() - start) * 1000.0 / getTickFrequency();
+
+	passed &= checkKtx(texture);
+
+	vector<Mat> channels;
+	split(rgba, channels);
+	channels[3] = channels[1].clone();
+	merge(channels, rgba);
+	CompressedTexture alphaTexture;
+	start = getTickCount();
+	compressTexture(rgba.data, rgba.cols, rgba.rows, alphaTexture);
+	double alphaMs = (getTickCount() - start) * 1000.0 / getTickFrequency();
+
+	passed &= checkKtx(alphaTexture);
+
+	printf("\ntexture: %dx%d with %d mips\n", width, height, texture.Levels() - 1);
+	printf("%-8s %10s %12s\n", "format", "ms", "bytes");
+	printf("%-8s %10.2f %12u\n", "BC1", opaqueMs, (unsigned)texture.data.size());
+	printf("%-8s %10.2f %12u\n", "BC3", alphaMs, (unsigned)alphaTexture.data.size());
+
+	return passed ? 0 : 2;
+}
+
+static void usage()
+{
+	cout << "Benchmark pyramid [frames]" << endl;
+	cout << "Benchmark kernel [width height]" << endl;
+	cout << "Benchmark batch [repeats]" << endl;
+	cout << "Benchmark replay <camera index | video | image pattern | synthetic[:frames]> [camera.xml]" << endl;
+	cout << "Benchmark allocations [frames]" << endl;
+	cout << "Benchmark texture [width height]" << endl;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		usage();
+		return 1;
+	}
+
+	string mode = argv[1];
+
+	if (mode == "pyramid")
+		return pyramidBenchmark(argc > 2 ? atoi(argv[2]) : 20);
+	if (mode == "kernel")
+		return kernelBenchmark(argc > 3 ? atoi(argv[2]) : 1920, argc > 3 ? atoi(argv[3]) : 1080);
+	if (mode == "batch")
+		return batchBenchmark(argc > 2 ? atoi(argv[2]) : 100);
+	if (mode == "replay" && argc > 2)
+		return replayBenchmark(argv[2], argc > 3 ? argv[3] : "camera.xml");
+	if (mode == "allocations")
+		return allocationBenchmark(argc > 2 ? atoi(argv[2]) : 300);
+	if (mode == "texture")
+		return textureBenchmark(argc > 3 ? atoi(argv[2]) : 1024, argc > 3 ? atoi(argv[3]) : 1024);
+
+	usage();
+	return 1;
+}